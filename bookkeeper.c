@@ -1,5 +1,4 @@
-#define _POSIX_C_SOURCE 200809L
-#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,27 +16,54 @@
 #include <sys/resource.h>
 #include <sys/inotify.h>
 #include <sys/signalfd.h>
-#include <sys/timerfd.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/uio.h>
 #include <sys/epoll.h>
 #include <getopt.h>
+#include <time.h>
 #include <pwd.h>
 
 #include "config.h"
 #include "users.h"
 #include "event.h"
 #include "protocol.h"
+#include "workers.h"
+#include "subscribe.h"
+#include "state.h"
+#include "ports.h"
+#include "upgrade.h"
 
 struct config config;
 int sockfd = -1;
 int inotifyfd = -1;
 int sigfd = -1;
-int timefd = -1;
 
 int wds[2];
 
+/* What to exec when upgrading in place */
+static char exe_path[4096];
+static char **saved_argv;
+
+/* Accept queue statistics */
+struct {
+  unsigned long wakeups;
+  unsigned long accepted;
+  unsigned long queue_full;
+  unsigned long errors;
+} accept_stats;
+
+/* Passwd change statistics */
+struct {
+  unsigned long reads;
+  unsigned long events;
+  unsigned long syncs;
+} passwd_stats;
+
+/* Pending sync of the passwd file and when the first change it covers came in */
+static uint64_t sync_timer = 0;
+static struct timespec sync_first;
+
 static void print_help(
     void)
 {
@@ -50,9 +76,41 @@ static void print_help(
 "                                      default: 10000\n"
 "  -u  --user                STRING    User and group to transiton to\n"
 "  -f  --sockpath            STRING    Path of the socket file to create for client communication.\n"
-"                                      default: %s"
+"                                      default: %s\n"
+"  -w  --workers             INTEGER   Number of threads serving client requests, 0 serves them\n"
+"                                      from the main loop. default: 0, maximum: %d\n"
+"  -b  --backlog             INTEGER   Length of the pending connection queue on the socket, the kernel\n"
+"                                      may cap this at net.core.somaxconn. default: %d\n"
+"  -i  --idle-timeout        INTEGER   Seconds a client connection may sit idle before it is closed.\n"
+"                                      default: %d\n"
+"  -t  --socket-type         STRING    Type of the request socket, stream or seqpacket. A seqpacket socket\n"
+"                                      carries one v2 frame per message and checks credentials once per\n"
+"                                      connection. default: stream\n"
+"  -d  --settle-delay        INTEGER   Milliseconds the passwd file must go unchanged before it is\n"
+"                                      synced, a run of writes is synced once. default: %d\n"
+"  -W  --warm-slice          INTEGER   Serve requests as soon as the daemon starts and bind the ports of\n"
+"                                      this many users between handling events until all are bound.\n"
+"                                      default: bind every port before serving\n"
+"  -D  --state-dir           STRING    Directory to keep released ports and policies in across restarts.\n"
+"                                      default: %s\n"
+"  -P  --ports-file          STRING    File listing extra ports for users, as lines of a user name or\n"
+"                                      UID followed by ports and ranges like 2000,3000-3009. Re-read\n"
+"                                      on HUP. default: %s\n"
+"  -F  --max-files           INTEGER   Most descriptors the daemon may hold, one for each reserved port\n"
+"                                      and each client, and one for each user mapping its own entry.\n"
+"                                      default: %d\n"
+"  -a  --assign-ports        LO-HI     Ports to assign to users whose port offset plus UID is past the\n"
+"                                      last port or taken. Assigned ports are kept across restarts and\n"
+"                                      handed out from the top down. A range above the port offset\n"
+"                                      plus the system UID threshold can take the port of a user added\n"
+"                                      later. default: the port offset up to the system UID threshold,\n"
+"                                      whose ports no user maps to\n"
+"\n"
+"Sending USR2 execs the daemon again from the same path and hands it every reserved port without\n"
+"unbinding any, to upgrade it in place."
 "\n\n",
-DEFAULT_SOCKPATH);
+DEFAULT_SOCKPATH, WORKERS_MAX, DEFAULT_BACKLOG, DEFAULT_IDLE_TIMEOUT, DEFAULT_SETTLE_DELAY,
+DEFAULT_STATEDIR, DEFAULT_PORTSFILE, DEFAULT_MAX_FILES);
 }
 
 static void parse_config(
@@ -61,18 +119,29 @@ static void parse_config(
 {
   int c;
   struct passwd *p;
+  char junk;
   static struct option long_options[] = {
     { "help", no_argument, 0, 'h'},
     { "port-offset", required_argument, 0, 'p' },
     { "sys-uid-threshold", required_argument, 0, 's' },
     { "user", required_argument, 0, 'u' },
+    { "workers", required_argument, 0, 'w' },
+    { "backlog", required_argument, 0, 'b' },
+    { "idle-timeout", required_argument, 0, 'i' },
+    { "socket-type", required_argument, 0, 't' },
+    { "settle-delay", required_argument, 0, 'd' },
+    { "warm-slice", required_argument, 0, 'W' },
+    { "state-dir", required_argument, 0, 'D' },
+    { "ports-file", required_argument, 0, 'P' },
+    { "assign-ports", required_argument, 0, 'a' },
+    { "max-files", required_argument, 0, 'F' },
     { 0, 0, 0, 0 }
   };
 
   while (1) {
     int opt_idx = 0;
 
-    c = getopt_long(argc, argv, "hs:p:u:", long_options, &opt_idx);
+    c = getopt_long(argc, argv, "hs:p:u:w:b:i:t:d:W:D:P:a:F:", long_options, &opt_idx);
 
     if (c == -1)
       break;
@@ -115,6 +184,74 @@ static void parse_config(
         config.gid = p->pw_gid;
       break;
 
+      case 'w':
+        config.workers = atoi(optarg);
+        if (config.workers < 0 || config.workers > WORKERS_MAX)
+          errx(EXIT_FAILURE, "The number of workers must be between 0 and %d", WORKERS_MAX);
+      break;
+
+      case 'b':
+        config.backlog = atoi(optarg);
+        if (config.backlog <= 0)
+          errx(EXIT_FAILURE, "The backlog must be a number 1 or greater");
+      break;
+
+      case 'i':
+        config.idle_timeout = atoi(optarg);
+        if (config.idle_timeout <= 0)
+          errx(EXIT_FAILURE, "The idle timeout must be a number 1 or greater");
+      break;
+
+      case 't':
+        if (strcmp(optarg, "stream") == 0)
+          config.socktype = SOCK_STREAM;
+        else if (strcmp(optarg, "seqpacket") == 0)
+          config.socktype = SOCK_SEQPACKET;
+        else
+          errx(EXIT_FAILURE, "The socket type must be one of stream or seqpacket");
+      break;
+
+      case 'd':
+        config.settle_delay = atoi(optarg);
+        if (config.settle_delay <= 0)
+          errx(EXIT_FAILURE, "The settle delay must be a number 1 or greater");
+      break;
+
+      case 'W':
+        config.warm_slice = atoi(optarg);
+        if (config.warm_slice <= 0)
+          errx(EXIT_FAILURE, "The warm slice must be a number 1 or greater");
+      break;
+
+      case 'D':
+        config.statedir = strdup(optarg);
+        if (!config.statedir)
+          err(EXIT_FAILURE, "Cannot setup state directory");
+        if (config.statedir[0] != '/')
+          errx(EXIT_FAILURE, "The state directory must be an absolute path");
+      break;
+
+      case 'P':
+        config.portsfile = strdup(optarg);
+        if (!config.portsfile)
+          err(EXIT_FAILURE, "Cannot setup ports file");
+        if (config.portsfile[0] != '/')
+          errx(EXIT_FAILURE, "The ports file must be an absolute path");
+      break;
+
+      case 'F':
+        config.max_files = strtoul(optarg, NULL, 10);
+        if (config.max_files < 1024)
+          errx(EXIT_FAILURE, "The most files must be a number 1024 or greater");
+      break;
+
+      case 'a':
+        if (sscanf(optarg, "%u-%u%c", &config.assign_min, &config.assign_max, &junk) != 2
+            || config.assign_min < PRIVPORTS || config.assign_min > config.assign_max
+            || config.assign_max > 65535)
+          errx(EXIT_FAILURE, "The ports to assign must be a range LO-HI between %d and 65535", PRIVPORTS);
+      break;
+
       default:
         fprintf(stderr, "An unknown option was passed");
         print_help();
@@ -127,8 +264,41 @@ static void parse_config(
     config.system_user_threshold = 1000;
   if (config.port_offset == 0)
     config.port_offset = 10000;
+  if (config.backlog == 0)
+    config.backlog = DEFAULT_BACKLOG;
+  if (config.idle_timeout == 0)
+    config.idle_timeout = DEFAULT_IDLE_TIMEOUT;
+  if (config.socktype == 0)
+    config.socktype = SOCK_STREAM;
+  if (config.settle_delay == 0)
+    config.settle_delay = DEFAULT_SETTLE_DELAY;
   if (config.user == NULL)
     errx(EXIT_FAILURE, "You must supply a username to transition to");
+  if (config.statedir == NULL) {
+    config.statedir = strdup(DEFAULT_STATEDIR);
+    if (!config.statedir)
+      err(EXIT_FAILURE, "Cannot setup initial configuration");
+  }
+  if (config.max_files == 0)
+    config.max_files = DEFAULT_MAX_FILES;
+  /* System users never get a port, so their share of the ports past the
+   * offset is free to assign without taking one a uid maps to */
+  if (config.assign_max == 0) {
+    config.assign_min = config.port_offset;
+    config.assign_max = config.port_offset + config.system_user_threshold - 1;
+    if (config.assign_max > 65535)
+      config.assign_max = 65535;
+    if (config.assign_min > config.assign_max)
+      config.assign_min = config.assign_max;
+  }
+  else if (config.assign_max >= config.port_offset + config.system_user_threshold)
+    warnx("The ports to assign overlap those users %u and up map to, a user added later may be "
+          "given another port than its own", config.system_user_threshold);
+  if (config.portsfile == NULL) {
+    config.portsfile = strdup(DEFAULT_PORTSFILE);
+    if (!config.portsfile)
+      err(EXIT_FAILURE, "Cannot setup initial configuration");
+  }
   if (config.sockfile == NULL) {
     config.sockfile = strdup(DEFAULT_SOCKPATH);
     if (!config.sockfile)
@@ -141,11 +311,12 @@ static void set_resource_limits(
     void)
 {
   struct rlimit lim;
-  lim.rlim_cur = 70000;
-  lim.rlim_max = 70000;
+  lim.rlim_cur = config.max_files;
+  lim.rlim_max = config.max_files;
 
+  /* Raised while still root, the ports file is only read once users switch */
   if (setrlimit(RLIMIT_NOFILE, &lim) < 0)
-    err(EXIT_FAILURE, "Cannot set file handle limit");
+    err(EXIT_FAILURE, "Cannot set file handle limit to %lu, see fs.nr_open", config.max_files);
 }
 
 
@@ -164,7 +335,7 @@ static void inotify_setup(
 {
   inotifyfd = -1;
 
-  if ((inotifyfd = inotify_init()) < 0)
+  if ((inotifyfd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC)) < 0)
     err(EXIT_FAILURE, "Cannot start inotify");
 
   /* We actually watch etc too because of renames overwriting the original file */
@@ -177,55 +348,125 @@ static void inotify_setup(
 }
 
 
+/* Runs on the main loop, so a sync never starts while another is going */
+static void passwd_sync(
+    int full)
+{
+  if (sync_timer)
+    event_timer_del(sync_timer);
+  sync_timer = 0;
+  passwd_stats.syncs++;
+
+  if (full)
+    users_resync();
+  else
+    users_sync();
+}
+
+
+static void passwd_settled(
+    void *data)
+{
+  sync_timer = 0;
+  passwd_sync(0);
+}
+
+
+/* Every change restarts the settle delay so a run of writes to passwd ends up
+ * as one sync, though a file that never settles is still synced once the
+ * first change has waited ten delays */
+static void passwd_changed(
+    void)
+{
+  struct timespec now;
+  long waited;
+
+  passwd_stats.events++;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  if (sync_timer) {
+    waited = (now.tv_sec - sync_first.tv_sec) * 1000 +
+             (now.tv_nsec - sync_first.tv_nsec) / 1000000;
+    if (waited >= (long)config.settle_delay * 10)
+      return;
+    event_timer_del(sync_timer);
+  }
+  else {
+    sync_first = now;
+  }
+
+  sync_timer = event_timer_add(config.settle_delay, passwd_settled, NULL);
+  if (!sync_timer) {
+    syslog(LOG_WARNING, "Cannot delay passwd sync, syncing now");
+    passwd_sync(0);
+  }
+}
+
+
 static int inotify_read(
     int fd,
     int event,
     void *data)
 {
   int rc;
-  char buf[2048];
+  char buf[2048] __attribute__((aligned(__alignof__(struct inotify_event))));
   char *p;
   struct inotify_event *in;
 
   if ((event & EPOLLERR) == EPOLLERR || (event & EPOLLHUP) == EPOLLHUP)
      return -1;
 
-  rc = read(fd, buf, sizeof(buf));
-  if (rc < 0)
-    return -1;
+  /* A burst may not fit in one read, drain the queue */
+  while (1) {
+    rc = read(fd, buf, sizeof(buf));
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return -1;
+    }
+    passwd_stats.reads++;
 
-  p = buf;
-  while (p < (buf+rc)) {
-    in = (struct inotify_event *)p;
+    p = buf;
+    while (p < (buf+rc)) {
+      in = (struct inotify_event *)p;
 
-    /* The directory being watched */
-    if (in->wd == wds[0]) {
-      if (strcmp(in->name, "passwd") != 0)
-        goto next;
+      /* Events were lost, one of them may have been for passwd */
+      if ((in->mask & IN_Q_OVERFLOW) == IN_Q_OVERFLOW) {
+        syslog(LOG_WARNING, "Inotify queue overflowed, syncing passwd");
+        passwd_changed();
+      }
 
-      if ((in->mask & IN_MOVED_TO) == IN_MOVED_TO)
-        users_sync();
-    }
+      /* The directory being watched */
+      else if (in->wd == wds[0]) {
+        if (strcmp(in->name, "passwd") != 0)
+          goto next;
 
-    /* Is /etc/passwd */
-    else if (in->wd == wds[1]) {
+        if ((in->mask & IN_MOVED_TO) == IN_MOVED_TO)
+          passwd_changed();
+      }
 
-      /* The file was edited by hand */
-      if ((in->mask & IN_MODIFY) == IN_MODIFY)
-        users_sync();
-      if ((in->mask & IN_IGNORED) == IN_IGNORED) {
-        /* In this case, we must re-add the watch */
-        if ((wds[1] = inotify_add_watch(fd, "/etc/passwd", IN_MODIFY)) < 0)
-          err(EXIT_FAILURE, "Unable to re-add watch for /etc/passwd!");
+      /* Is /etc/passwd */
+      else if (in->wd == wds[1]) {
+
+        /* The file was edited by hand */
+        if ((in->mask & IN_MODIFY) == IN_MODIFY)
+          passwd_changed();
+        if ((in->mask & IN_IGNORED) == IN_IGNORED) {
+          /* In this case, we must re-add the watch */
+          if ((wds[1] = inotify_add_watch(fd, "/etc/passwd", IN_MODIFY)) < 0)
+            err(EXIT_FAILURE, "Unable to re-add watch for /etc/passwd!");
+        }
       }
-    }
 
-    else {
-      syslog(LOG_WARNING, "Unknown watch descriptor was passed to us: %s", strerror(errno));
-    }
+      else {
+        syslog(LOG_WARNING, "Unknown watch descriptor was passed to us: %s", strerror(errno));
+      }
 
 next:
-    p += sizeof(struct inotify_event) + in->len;
+      p += sizeof(struct inotify_event) + in->len;
+    }
   }
 
   return 0;
@@ -241,6 +482,8 @@ static void signal_setup(
   sigaddset(&sigs, SIGHUP);
   sigaddset(&sigs, SIGINT);
   sigaddset(&sigs, SIGTERM);
+  sigaddset(&sigs, SIGUSR1);
+  sigaddset(&sigs, SIGUSR2);
 
   if (sigprocmask(SIG_BLOCK, &sigs, NULL) < 0)
     err(EXIT_FAILURE, "Cannot setup signalfd");
@@ -249,6 +492,37 @@ static void signal_setup(
     err(EXIT_FAILURE, "Cannot setup signalfd");
 }
 
+static void stats_log(
+    void)
+{
+  struct event_stats st;
+  struct subscribe_stats sst;
+  struct bind_stats bst;
+  struct state_stats stst;
+
+  event_get_stats(&st);
+  subscribe_get_stats(&sst);
+  users_get_bind_stats(&bst);
+  state_get_stats(&stst);
+  syslog(LOG_NOTICE, "Events: %d/%d fds monitored", st.curfds, st.maxfds);
+  syslog(LOG_NOTICE, "Callback pool: %lu slabs, %lu/%lu free, %lu allocations",
+         st.pool_slabs, st.pool_free, st.pool_total, st.pool_allocs);
+  syslog(LOG_NOTICE, "Timers: %d pending", st.timers);
+  syslog(LOG_NOTICE, "Accept queue: %lu wakeups, %lu accepted, %lu full drains, %lu errors",
+         accept_stats.wakeups, accept_stats.accepted, accept_stats.queue_full,
+         accept_stats.errors);
+  syslog(LOG_NOTICE, "Subscribers: %lu, %lu changes published, %lu resyncs",
+         sst.subscribers, sst.published, sst.resyncs);
+  syslog(LOG_NOTICE, "Passwd: %lu reads, %lu change events, %lu syncs",
+         passwd_stats.reads, passwd_stats.events, passwd_stats.syncs);
+  syslog(LOG_NOTICE, "Port binds: %lu, %lu failed, %lluus average, %lluus slowest",
+         bst.binds, bst.failures,
+         bst.binds ? (unsigned long long)(bst.total_ns / bst.binds / 1000) : 0ULL,
+         (unsigned long long)(bst.max_ns / 1000));
+  syslog(LOG_NOTICE, "Saved state: %lu users, %lu journal records, %lu commits, %lu compactions",
+         stst.users, stst.records, stst.commits, stst.compactions);
+}
+
 static int signal_read(
     int fd,
     int event,
@@ -267,8 +541,22 @@ static int signal_read(
   switch (info.ssi_signo) {
 
   case SIGHUP:
-    syslog(LOG_WARNING, "Got HUP, re-reading passwd file");
-    users_sync();
+    syslog(LOG_WARNING, "Got HUP, re-reading ports and passwd files");
+    /* A file that cannot be read leaves everyone the ports they have */
+    if (ports_load(config.portsfile) == 0)
+      users_ports_reload();
+    /* Replaces any sync still waiting for the file to settle */
+    passwd_sync(1);
+  break;
+
+  case SIGUSR1:
+    stats_log();
+  break;
+
+  case SIGUSR2:
+    syslog(LOG_NOTICE, "Got USR2, handing over to a new %s", exe_path);
+    if (upgrade_start(exe_path, saved_argv, sockfd) == 0)
+      exit(0);
   break;
 
   case SIGTERM:
@@ -295,12 +583,14 @@ static void sockfile_setup(
 
   un.sun_family = AF_UNIX;
   strncpy(un.sun_path, config.sockfile, strlen(config.sockfile));
-  sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockfd = socket(AF_UNIX, config.socktype|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
 
   if (sockfd < 0)
     err(EXIT_FAILURE, "Could not acquire unix socket");
 
-  if (setsockopt(sockfd, SOL_SOCKET, SO_PASSCRED, &rc, sizeof(rc)) < 0)
+  /* Seqpacket clients are identified once with SO_PEERCRED instead */
+  if (config.socktype == SOCK_STREAM
+      && setsockopt(sockfd, SOL_SOCKET, SO_PASSCRED, &rc, sizeof(rc)) < 0)
     err(EXIT_FAILURE, "Could not set socket options\n");
 
   /* May not work as file doesn't exist. Dont care about this */
@@ -314,7 +604,7 @@ static void sockfile_setup(
   if (chmod(config.sockfile, 0777) < 0)
     err(EXIT_FAILURE, "Cannot set mode on socket");
 
-  if (listen(sockfd, 5) < 0)
+  if (listen(sockfd, config.backlog) < 0)
     err(EXIT_FAILURE, "Cannot listen on socket");
 }
 
@@ -325,63 +615,49 @@ static int sockfile_read(
     void *data)
 {
   int clifd = -1;
+  int n = 0;
 
   if ((event & EPOLLERR) == EPOLLERR || (event & EPOLLHUP) == EPOLLHUP)
      return -1;
 
-  clifd = accept(sockfd, NULL, NULL);
-  if (clifd < 0)
-    return 0;
+  accept_stats.wakeups++;
 
-  event_add_fd(clifd, decode_packet, NULL, NULL, EPOLLIN);
-  return 0;
-}
-
-
-static void timer_setup(
-    void)
-{
-  timefd = timerfd_create(CLOCK_MONOTONIC, 0);
-  struct itimerspec ts;
-  ts.it_interval.tv_sec = 60;
-  ts.it_interval.tv_nsec = 0;
-  ts.it_value.tv_sec = 60;
-  ts.it_value.tv_nsec = 0;
-
-  if (timefd < 0)
-    err(EXIT_FAILURE, "Failed to setup timerfd");
-
-  if (timerfd_settime(timefd, 0, &ts, NULL) < 0)
-    err(EXIT_FAILURE, "Failed to setup timerfd");
-}
-
-
-static int timer_read(
-    int fd,
-    int event,
-    void *data)
-{
-  uint64_t triggered;
-  int rc;
+  /* Empty the whole queue, the listening socket is non-blocking */
+  while (1) {
+    clifd = accept4(sockfd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+    if (clifd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        accept_stats.errors++;
+        syslog(LOG_WARNING, "Cannot accept client: %s", strerror(errno));
+      }
+      break;
+    }
+    n++;
 
-  if ((event & EPOLLERR) == EPOLLERR || (event & EPOLLHUP) == EPOLLHUP)
-     return -1;
+    if (workers_enabled()) {
+      if (workers_dispatch(clifd) < 0)
+        close(clifd);
+      continue;
+    }
 
-  rc = read(fd, &triggered, sizeof(triggered));
-  if (rc != sizeof(triggered))
-    err(EXIT_FAILURE, "Error reading from timerfd");
+    if (protocol_client_add(clifd) < 0)
+      close(clifd);
+  }
 
-  /* When the timer is triggered, we read all our reserved ports for released entries */
-  users_reacquire_ports();
+  /* We found the queue at its limit, the kernel was refusing clients */
+  accept_stats.accepted += n;
+  if (n >= config.backlog)
+    accept_stats.queue_full++;
 
   return 0;
 }
 
+
 static void setup_events(
     void)
 {
-  if (event_add_fd(timefd, timer_read, NULL, NULL, EPOLLIN) < 0)
-    err(EXIT_FAILURE, "Cannot add timer event");
   if (event_add_fd(sigfd, signal_read, NULL, NULL, EPOLLIN) < 0)
     err(EXIT_FAILURE, "Cannot add signal event");
   if (event_add_fd(inotifyfd, inotify_read, NULL, NULL, EPOLLIN) < 0)
@@ -396,6 +672,10 @@ int main(
 {
 
   openlog(NULL, LOG_PID, LOG_DAEMON);
+  /* The path rather than the file, an upgrade replaces what is there */
+  if (readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1) < 0)
+    strncpy(exe_path, argv[0], sizeof(exe_path) - 1);
+  saved_argv = (char **)argv;
   chdir("/");
   parse_config(argc, (char **)argv);
   set_resource_limits();
@@ -403,15 +683,31 @@ int main(
 
   inotify_setup();
   signal_setup();
-  sockfile_setup();
-  timer_setup();
+  /* An upgrade hands over the socket clients are already queued on */
+  if ((sockfd = upgrade_listener()) < 0)
+    sockfile_setup();
 
   users_init();
   event_init();
+  workers_init(config.workers);
 
   setup_events();
-
-  users_sync();
+  ports_load(config.portsfile);
+  upgrade_adopt();
+  /* Only once a predecessor has let go of the files, adopted users carry
+   * their state with them */
+  state_init(config.statedir);
+  users_book_ports();
+
+  /* Progressive startup binds ports in between events, without blocking */
+  if (config.warm_slice) {
+    users_warm_start();
+    while (users_warm_step(config.warm_slice))
+      event_loop(128, 0);
+  }
+  else {
+    users_sync();
+  }
 
   while(1) {
     event_loop(128, -1);
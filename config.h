@@ -8,10 +8,29 @@ struct config {
   char *sockfile;
   uid_t uid;
   gid_t gid;
+  int workers;
+  int backlog;
+  int idle_timeout;
+  int socktype;
+  int settle_delay;
+  int warm_slice;
+  char *statedir;
+  char *portsfile;
+  /* Ports handed to users whose uid does not map onto a free one */
+  unsigned int assign_min;
+  unsigned int assign_max;
+  unsigned long max_files;
 };
 
 #define DEFAULT_SOCKPATH "/var/run/bookkeeper/bookkeeper.sock"
+#define DEFAULT_STATEDIR "/var/lib/bookkeeper"
 #define DEFAULT_REACQUIRE_TIMEOUT 7200
+#define DEFAULT_BACKLOG 4096
+#define DEFAULT_IDLE_TIMEOUT 30
+#define DEFAULT_SETTLE_DELAY 250
+/* A socket for every port a user can hold, with as many again for client
+ * connections and the snapshot views of users */
+#define DEFAULT_MAX_FILES 131072
 #define PRIVPORTS 1024
 
 #endif
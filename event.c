@@ -1,48 +1,341 @@
 #include "event.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <err.h>
 #include <assert.h>
 #include <syslog.h>
 #include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/queue.h>
+#include <sys/timerfd.h>
+#include <time.h>
 
 /* Event */
 struct callback {
   void *data;
   int fd;
+  uint32_t seq;
   int (*callback)(int fd, int event, void *data);
   void (*destroy)(void *data);
-  LIST_ENTRY(callback) list;
+  SLIST_ENTRY(callback) free;
 };
 
-/* Global event handle */
+/* Callbacks are carved out of slabs and recycled through a free list */
+#define CALLBACK_SLAB 256
+
+struct callback_slab {
+  SLIST_ENTRY(callback_slab) next;
+  struct callback cbs[CALLBACK_SLAB];
+};
+
+/* Timer, lives in a slot array and is ordered by a binary min-heap of slots */
+struct event_timer {
+  uint64_t deadline;
+  uint32_t gen;
+  int heapidx;
+  int nextfree;
+  void (*callback)(void *data);
+  void *data;
+};
+
+/* Event handle, every thread running an event loop has its own */
 struct event_handle {
   int epollfd;
   int curfds;
   int maxfds;
-  LIST_HEAD(evlist_head, callback) head;
+  uint32_t seq;
+  /* Callbacks indexed directly by their file descriptor */
+  struct callback **table;
+  /* Reused between calls to event_loop */
+  struct epoll_event *events;
+  int nevents;
+  /* Callback pool */
+  SLIST_HEAD(cbfree_head, callback) pool;
+  SLIST_HEAD(cbslab_head, callback_slab) slabs;
+  unsigned long pool_slabs;
+  unsigned long pool_free;
+  unsigned long pool_allocs;
+  /* Timers, one timerfd armed for the earliest deadline */
+  int timerfd;
+  uint64_t armed;
+  struct event_timer *timers;
+  int ntimers;
+  int freetimer;
+  int *heap;
+  int heaplen;
 };
 
 
 /* Static function prototypes */
 static struct callback * event_search(int fd);
 
-static struct event_handle eh = { -1, 0, EVENT_MAXFDS };
+static __thread struct event_handle eh = { -1, 0, EVENT_MAXFDS, 0, NULL, NULL, 0,
+                                           .timerfd = -1, .freetimer = -1 };
 
 /* Returns an event handle from searching by fd */ 
-static struct callback * event_search(
+static inline struct callback * event_search(
     int fd)
 {
-  struct callback *ev;
-  for (ev = eh.head.lh_first; ev != NULL; ev = ev->list.le_next) {
-    if (ev->fd == fd)
-      return ev;
+  if (fd < 0 || fd >= eh.maxfds)
+    return NULL;
+  return eh.table[fd];
+}
+
+
+/* Take a callback from the pool, growing it by a slab when empty */
+static struct callback * callback_alloc(
+    void)
+{
+  struct callback *cb;
+  struct callback_slab *slab;
+  int i;
+
+  if (SLIST_EMPTY(&eh.pool)) {
+    slab = malloc(sizeof(*slab));
+    if (!slab)
+      return NULL;
+    SLIST_INSERT_HEAD(&eh.slabs, slab, next);
+    for (i=CALLBACK_SLAB-1; i >= 0; i--)
+      SLIST_INSERT_HEAD(&eh.pool, &slab->cbs[i], free);
+    eh.pool_slabs++;
+    eh.pool_free += CALLBACK_SLAB;
+  }
+
+  cb = SLIST_FIRST(&eh.pool);
+  SLIST_REMOVE_HEAD(&eh.pool, free);
+  eh.pool_free--;
+  eh.pool_allocs++;
+  return cb;
+}
+
+
+/* Return a callback to the pool */
+static inline void callback_free(
+    struct callback *cb)
+{
+  SLIST_INSERT_HEAD(&eh.pool, cb, free);
+  eh.pool_free++;
+}
+
+
+/* Pack the fd and its registration sequence into the epoll cookie. The
+ * sequence lets us detect events for an fd that was deleted (and possibly
+ * re-added) by an earlier callback in the same batch. */
+static inline uint64_t event_cookie(
+    struct callback *cb)
+{
+  return ((uint64_t)cb->seq << 32) | (uint32_t)cb->fd;
+}
+
+
+/* Milliseconds on the monotonic clock */
+static uint64_t event_now(
+    void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static inline uint64_t timer_deadline(
+    int i)
+{
+  return eh.timers[eh.heap[i]].deadline;
+}
+
+
+static inline void timer_heap_set(
+    int i,
+    int slot)
+{
+  eh.heap[i] = slot;
+  eh.timers[slot].heapidx = i;
+}
+
+
+static void timer_heap_up(
+    int i)
+{
+  int slot = eh.heap[i];
+  int parent;
+
+  while (i > 0) {
+    parent = (i - 1) / 2;
+    if (timer_deadline(parent) <= eh.timers[slot].deadline)
+      break;
+    timer_heap_set(i, eh.heap[parent]);
+    i = parent;
+  }
+  timer_heap_set(i, slot);
+}
+
+
+static void timer_heap_down(
+    int i)
+{
+  int slot = eh.heap[i];
+  int child;
+
+  while ((child = 2 * i + 1) < eh.heaplen) {
+    if (child + 1 < eh.heaplen && timer_deadline(child + 1) < timer_deadline(child))
+      child++;
+    if (eh.timers[slot].deadline <= timer_deadline(child))
+      break;
+    timer_heap_set(i, eh.heap[child]);
+    i = child;
+  }
+  timer_heap_set(i, slot);
+}
+
+
+/* Take a timer out of the heap and return its slot to the free list */
+static void timer_remove(
+    int slot)
+{
+  int i = eh.timers[slot].heapidx;
+  int last;
+
+  eh.heaplen--;
+  if (i != eh.heaplen) {
+    last = eh.heap[eh.heaplen];
+    timer_heap_set(i, last);
+    timer_heap_down(i);
+    timer_heap_up(eh.timers[last].heapidx);
+  }
+
+  eh.timers[slot].heapidx = -1;
+  eh.timers[slot].gen++;
+  eh.timers[slot].nextfree = eh.freetimer;
+  eh.freetimer = slot;
+}
+
+
+/* Point the timerfd at the earliest deadline, or disarm it */
+static void timer_arm(
+    void)
+{
+  struct itimerspec ts;
+  uint64_t deadline = eh.heaplen ? timer_deadline(0) : 0;
+
+  if (deadline == eh.armed)
+    return;
+
+  memset(&ts, 0, sizeof(ts));
+  ts.it_value.tv_sec = deadline / 1000;
+  ts.it_value.tv_nsec = (deadline % 1000) * 1000000;
+  if (timerfd_settime(eh.timerfd, TFD_TIMER_ABSTIME, &ts, NULL) < 0) {
+    syslog(LOG_ERR, "Cannot arm timer: %s", strerror(errno));
+    return;
+  }
+  eh.armed = deadline;
+}
+
+
+/* Runs every expired timer */
+static int timer_read(
+    int fd,
+    int event,
+    void *data)
+{
+  uint64_t triggered, now;
+  struct event_timer *t;
+  void (*callback)(void *data);
+  void *arg;
+  int slot;
+
+  if (read(fd, &triggered, sizeof(triggered)) < 0 && errno != EAGAIN)
+    return 0;
+
+  /* The timerfd is no longer armed */
+  eh.armed = 0;
+  now = event_now();
+  while (eh.heaplen && timer_deadline(0) <= now) {
+    slot = eh.heap[0];
+    t = &eh.timers[slot];
+    callback = t->callback;
+    arg = t->data;
+    /* Removed before running, the callback may add or delete timers */
+    timer_remove(slot);
+    callback(arg);
+  }
+
+  timer_arm();
+  return 0;
+}
+
+
+/* Schedules callback to run after ms milliseconds on this threads event
+ * loop. Returns a timer id to pass to event_timer_del, or 0 on error */
+uint64_t event_timer_add(
+    int ms,
+    void (*callback)(void *data),
+    void *data)
+{
+  struct event_timer *timers;
+  int *heap;
+  int slot, i, n;
+
+  assert(callback);
+  assert(eh.timerfd >= 0);
+  if (ms < 0)
+    ms = 0;
+
+  /* Grow the slots and heap together */
+  if (eh.freetimer < 0) {
+    n = eh.ntimers ? eh.ntimers * 2 : 64;
+    timers = realloc(eh.timers, n * sizeof(*timers));
+    if (!timers)
+      goto fail;
+    eh.timers = timers;
+    heap = realloc(eh.heap, n * sizeof(*heap));
+    if (!heap)
+      goto fail;
+    eh.heap = heap;
+
+    for (i=n-1; i >= eh.ntimers; i--) {
+      eh.timers[i].gen = 1;
+      eh.timers[i].heapidx = -1;
+      eh.timers[i].nextfree = eh.freetimer;
+      eh.freetimer = i;
+    }
+    eh.ntimers = n;
   }
 
-  return NULL;
+  slot = eh.freetimer;
+  eh.freetimer = eh.timers[slot].nextfree;
+  eh.timers[slot].deadline = event_now() + ms;
+  eh.timers[slot].callback = callback;
+  eh.timers[slot].data = data;
+  eh.heap[eh.heaplen] = slot;
+  timer_heap_up(eh.heaplen++);
+
+  timer_arm();
+  return ((uint64_t)eh.timers[slot].gen << 32) | (uint32_t)slot;
+
+fail:
+  syslog(LOG_ERR, "Cannot allocate memory for timer: %s", strerror(errno));
+  return 0;
+}
+
+
+/* Cancels a timer, is idempotent and ignores timers that already ran */
+void event_timer_del(
+    uint64_t id)
+{
+  int slot = (int)(id & 0xFFFFFFFF);
+
+  if (id == 0 || slot >= eh.ntimers)
+    return;
+  if (eh.timers[slot].gen != (uint32_t)(id >> 32) || eh.timers[slot].heapidx < 0)
+    return;
+
+  timer_remove(slot);
+  timer_arm();
 }
 
 
@@ -50,12 +343,44 @@ static struct callback * event_search(
 void event_init(
     void)
 {
+  struct rlimit lim;
   int fd = epoll_create1(EPOLL_CLOEXEC);
   if (fd < 0)
     err(EXIT_FAILURE, "Cannot initialize event handler");
+  eh.epollfd = fd;
+
+  /* Size the table from the descriptor limit, we can never see an fd above it */
+  eh.maxfds = EVENT_MAXFDS;
+  if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur != RLIM_INFINITY
+      && lim.rlim_cur < EVENT_MAXFDS)
+    eh.maxfds = lim.rlim_cur;
+
+  eh.table = calloc(eh.maxfds, sizeof(*eh.table));
+  if (!eh.table)
+    err(EXIT_FAILURE, "Cannot allocate event table");
+
+  SLIST_INIT(&eh.pool);
+  SLIST_INIT(&eh.slabs);
+
+  eh.timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+  if (eh.timerfd < 0)
+    err(EXIT_FAILURE, "Cannot create timer");
+  if (event_add_fd(eh.timerfd, timer_read, NULL, NULL, EPOLLIN) < 0)
+    err(EXIT_FAILURE, "Cannot add timer event");
+}
 
-  eh.epollfd = fd; 
-  LIST_INIT(&eh.head); 
+
+/* Fill in usage statistics for the event handle */
+void event_get_stats(
+    struct event_stats *st)
+{
+  st->curfds = eh.curfds;
+  st->maxfds = eh.maxfds;
+  st->pool_slabs = eh.pool_slabs;
+  st->pool_total = eh.pool_slabs * CALLBACK_SLAB;
+  st->pool_free = eh.pool_free;
+  st->pool_allocs = eh.pool_allocs;
+  st->timers = eh.heaplen;
 }
 
 
@@ -65,16 +390,24 @@ int event_loop(
     int timeout)
 {
   int cnt = 0;
-  int rc, i;
+  int rc, i, fd;
   struct callback *cb;
   assert(max < EVENT_MAXFDS && max > 0);
   assert(timeout >= -1);
 
-  struct epoll_event *events = calloc(max, sizeof(struct epoll_event));
-  if (!events) {
-    syslog(LOG_ERR, "Cannot allocate memory for events: %s", strerror(errno));
-    goto fail;
+  struct epoll_event *events;
+
+  /* The event buffer lives as long as the handle, only grow it */
+  if (max > eh.nevents) {
+    events = realloc(eh.events, max * sizeof(struct epoll_event));
+    if (!events) {
+      syslog(LOG_ERR, "Cannot allocate memory for events: %s", strerror(errno));
+      return -1;
+    }
+    eh.events = events;
+    eh.nevents = max;
   }
+  events = eh.events;
 
 restart:
   /* Do the epoll, safely handle interrupts */
@@ -83,28 +416,27 @@ restart:
     if (errno == EINTR)
       goto restart;
     else {
-      goto fail;
+      return -1;
     }
   }
 
   for (i=0; i < rc; i++) {
-    cb = (struct callback *)events[i].data.ptr;
+    fd = (int)(events[i].data.u64 & 0xFFFFFFFF);
+    cb = event_search(fd);
+    /* Removed by an earlier callback in this batch */
+    if (!cb || cb->seq != (uint32_t)(events[i].data.u64 >> 32))
+      continue;
+
     assert(cb->callback);
     if (cb->callback(cb->fd, events[i].events, cb->data) < 0) {
-      event_del_fd(cb->fd);
+      event_del_fd(fd);
     }
     else {
       cnt++;
     }
   }
 
-  free(events);
   return cnt;
-  
-fail:
-  if (events)
-    free(events);
-  return -1;
 }
 
 
@@ -116,8 +448,9 @@ void event_del_fd(
   if (!ev)
     return;
 
-  /* Remove from the list */
-  LIST_REMOVE(ev, list);
+  /* Remove from the table */
+  eh.table[fd] = NULL;
+  eh.curfds--;
 
   /* Call the objects destructor */
   if (ev->destroy)
@@ -126,7 +459,7 @@ void event_del_fd(
   /* Remove from the epoll */
   epoll_ctl(eh.epollfd, EPOLL_CTL_DEL, ev->fd, NULL);
   /* WARNING WARNING, cb->data MAY BE ALLOCATED */
-  free(ev);
+  callback_free(ev);
 }
 
 /* Modify the event mask of an existing cli */
@@ -143,11 +476,13 @@ int event_mod_event(
       return 0;
     }
 
+    memset(&ev, 0, sizeof(ev));
     ev.events = event;
-    ev.data.ptr = cb;
-    if (epoll_ctl(eh.epollfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+    ev.data.u64 = event_cookie(cb);
+    if (epoll_ctl(eh.epollfd, EPOLL_CTL_MOD, fd, &ev) < 0) {
       syslog(LOG_WARNING, "Unable to modify event mask: %s", strerror(errno));
       return -1;
+    }
 
     return 0;
 }
@@ -164,8 +499,18 @@ int event_add_fd(
   assert(fd >= 0);
   assert(callback);
   struct epoll_event ep_ev;
-  struct callback *ev = malloc(sizeof(*ev));
-  struct callback *tmp;
+  struct callback *ev = NULL;
+
+  if (fd >= eh.maxfds || eh.curfds + 1 > eh.maxfds) {
+    syslog(LOG_ERR, "Adding FD maximum number of descriptors to monitor: %d", fd);
+    goto fail;
+  }
+
+  /* A previous owner of this fd number was closed without being removed */
+  if (eh.table[fd])
+    event_del_fd(fd);
+
+  ev = callback_alloc();
   if (!ev) {
     syslog(LOG_ERR, "Cannot allocate memory for callback: %s", strerror(errno));
     goto fail;
@@ -174,15 +519,13 @@ int event_add_fd(
 
   /* Initialize callback and epoll event */
   ev->fd = fd;
+  ev->seq = ++eh.seq;
   ev->data = data;
   ev->callback = callback;
   ev->destroy = destructor;
 
   ep_ev.events = event;
-  ep_ev.data.ptr = ev;
-
-  /* Insert the FD onto our list */
-  LIST_INSERT_HEAD(&eh.head, ev, list);
+  ep_ev.data.u64 = event_cookie(ev);
 
   /* Register the fd with the epoll handler */
   if (epoll_ctl(eh.epollfd, EPOLL_CTL_ADD, fd, &ep_ev) < 0) {
@@ -190,21 +533,13 @@ int event_add_fd(
     goto fail;
   }
 
-  if (eh.curfds + 1 > eh.maxfds) {
-    syslog(LOG_ERR, "Adding FD maximum number of descriptors to monitor: %s", strerror(errno));
-    goto fail;
-  }
-
+  /* Insert the FD into our table */
+  eh.table[fd] = ev;
   eh.curfds++;
   return 0;
 
 fail:
-  tmp = event_search(fd);
-  if (tmp) {
-    LIST_REMOVE(tmp, list);
-  }
-
   if (ev)
-    free(ev);
+    callback_free(ev);
   return -1;
 }
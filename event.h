@@ -1,11 +1,24 @@
 #ifndef _EVENT_H_
 #define _EVENT_H_
 
+#include <stdint.h>
+
 #define EVENT_MAXFDS 1048576
 
+struct event_stats {
+  int curfds;
+  int maxfds;
+  unsigned long pool_slabs;
+  unsigned long pool_total;
+  unsigned long pool_free;
+  unsigned long pool_allocs;
+  int timers;
+};
+
 void event_init(void);
 /* Returns number of events handled or -1 on error */
 int event_loop(int max, int timeout);
+void event_get_stats(struct event_stats *st);
 void event_del_fd(int fd);
 int event_mod_event(int fd, int event);
 int event_add_fd(
@@ -14,4 +27,10 @@ int event_add_fd(
                 void (*destroy),
                 void *data,
                 int event);
+/* Timers run on the event loop of the thread that added them */
+uint64_t event_timer_add(
+                int ms,
+                void (*callback)(void *data),
+                void *data);
+void event_timer_del(uint64_t id);
 #endif
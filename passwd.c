@@ -0,0 +1,333 @@
+/* Parses the passwd file directly and works out which lines changed since the
+ * last parse, so a sync only has to touch the users that were added, removed
+ * or edited rather than walk the whole database through NSS */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "passwd.h"
+
+struct passwd_parse {
+  /* Sorted by uid, one entry per uid */
+  struct passwd_entry *ents;
+  int n;
+  /* Holds the names */
+  char *pool;
+};
+
+/* Diffed and replaced by the housekeeping thread. Workers adding a user
+ * early may forget lines in it too, so changes take prev_lock */
+static pthread_mutex_t prev_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct passwd_parse prev = { NULL, 0, NULL };
+
+
+static uint64_t passwd_hash(
+    const char *p,
+    size_t len)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  while (len--) {
+    h ^= (unsigned char)*p++;
+    h *= 0x100000001b3ULL;
+  }
+  /* Zero is kept to mean forgotten */
+  return h ? h : 1;
+}
+
+
+static void passwd_parse_free(
+    struct passwd_parse *ps)
+{
+  free(ps->ents);
+  free(ps->pool);
+  ps->ents = NULL;
+  ps->pool = NULL;
+  ps->n = 0;
+}
+
+
+/* Names are copied into the pool in file order, so for a uid listed twice the
+ * lower pointer is the first line, which is the one getpwuid returns */
+static int passwd_entry_compare(
+    const void *a,
+    const void *b)
+{
+  const struct passwd_entry *l = a;
+  const struct passwd_entry *r = b;
+
+  if (l->uid != r->uid)
+    return l->uid < r->uid ? -1 : 1;
+  if (l->name != r->name)
+    return l->name < r->name ? -1 : 1;
+  return 0;
+}
+
+
+static struct passwd_entry * passwd_find(
+    struct passwd_parse *ps,
+    uid_t uid)
+{
+  int lo = 0, hi = ps->n - 1, mid;
+
+  while (lo <= hi) {
+    mid = lo + (hi - lo) / 2;
+    if (ps->ents[mid].uid == uid)
+      return &ps->ents[mid];
+    if (ps->ents[mid].uid < uid)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+  return NULL;
+}
+
+
+/* Returns -2 if the file defers to NIS through compat entries */
+static int passwd_parse(
+    const char *buf,
+    size_t len,
+    struct passwd_parse *ps)
+{
+  const char *p = buf, *end = buf + len, *eol, *q, *f[3];
+  char *pool;
+  size_t nlines = 1;
+  unsigned long long uid;
+  int i, j, rc = -1;
+
+  memset(ps, 0, sizeof(*ps));
+
+  for (eol = buf; eol < end && (eol = memchr(eol, '\n', end - eol)); eol++)
+    nlines++;
+
+  ps->ents = calloc(nlines, sizeof(*ps->ents));
+  ps->pool = pool = malloc(len + 1);
+  if (!ps->ents || !ps->pool)
+    goto fail;
+
+  for (; p < end; p = eol + 1) {
+    eol = memchr(p, '\n', end - p);
+    if (!eol)
+      eol = end;
+
+    if (p == eol || *p == '#')
+      continue;
+    if (*p == '+' || *p == '-') {
+      rc = -2;
+      goto fail;
+    }
+
+    /* Ends of the name, password and uid fields */
+    f[0] = memchr(p, ':', eol - p);
+    if (!f[0] || f[0] == p)
+      continue;
+    f[1] = memchr(f[0] + 1, ':', eol - f[0] - 1);
+    if (!f[1])
+      continue;
+    f[2] = memchr(f[1] + 1, ':', eol - f[1] - 1);
+    if (!f[2] || f[2] == f[1] + 1)
+      continue;
+
+    /* Malformed lines are skipped, same as the files NSS module */
+    uid = 0;
+    for (q = f[1] + 1; q < f[2]; q++) {
+      if (*q < '0' || *q > '9' || uid > UINT32_MAX)
+        break;
+      uid = uid * 10 + (*q - '0');
+    }
+    if (q != f[2] || uid >= UINT32_MAX)
+      continue;
+
+    ps->ents[ps->n].uid = uid;
+    ps->ents[ps->n].hash = passwd_hash(p, eol - p);
+    ps->ents[ps->n].name = pool;
+    memcpy(pool, p, f[0] - p);
+    pool += f[0] - p;
+    *pool++ = 0;
+    ps->n++;
+  }
+
+  qsort(ps->ents, ps->n, sizeof(*ps->ents), passwd_entry_compare);
+  for (i=0, j=0; i < ps->n; i++) {
+    if (j > 0 && ps->ents[j-1].uid == ps->ents[i].uid)
+      continue;
+    ps->ents[j++] = ps->ents[i];
+  }
+  ps->n = j;
+  return 0;
+
+fail:
+  if (rc == -1)
+    syslog(LOG_WARNING, "Cannot allocate memory to parse %s: %s", PASSWD_PATH, strerror(errno));
+  passwd_parse_free(ps);
+  return rc;
+}
+
+
+int passwd_files_only(
+    void)
+{
+  FILE *f;
+  char line[512];
+  char *p, *tok, *save;
+  int files = 1;
+
+  /* Without a configuration glibc answers from the files */
+  f = fopen(NSSWITCH_PATH, "re");
+  if (!f)
+    return 1;
+
+  while (fgets(line, sizeof(line), f)) {
+    p = line + strspn(line, " \t");
+    if (strncmp(p, "passwd:", 7) != 0)
+      continue;
+
+    for (tok = strtok_r(p + 7, " \t\n", &save); tok; tok = strtok_r(NULL, " \t\n", &save)) {
+      /* Actions like [NOTFOUND=return] are not sources */
+      if (*tok == '[')
+        continue;
+      /* Compat lines that pull in NIS are caught while parsing. The users
+       * systemd adds come and go with services and never touched the passwd
+       * file, so they could not be tracked by watching it anyway */
+      if (strcmp(tok, "files") == 0 || strcmp(tok, "compat") == 0 || strcmp(tok, "systemd") == 0)
+        continue;
+      files = 0;
+      break;
+    }
+    break;
+  }
+
+  fclose(f);
+  return files;
+}
+
+
+int passwd_diff(
+    struct passwd_delta *d)
+{
+  struct passwd_parse next = { NULL, 0, NULL };
+  struct stat st;
+  char *buf = NULL;
+  int fd = -1, locked = 0;
+  int i = 0, j = 0, rc;
+
+  memset(d, 0, sizeof(*d));
+
+  fd = open(PASSWD_PATH, O_RDONLY|O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    syslog(LOG_WARNING, "Cannot open %s: %s", PASSWD_PATH, strerror(errno));
+    goto fail;
+  }
+
+  if (st.st_size > 0) {
+    buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (buf == MAP_FAILED) {
+      buf = NULL;
+      syslog(LOG_WARNING, "Cannot map %s: %s", PASSWD_PATH, strerror(errno));
+      goto fail;
+    }
+  }
+  close(fd);
+  fd = -1;
+
+  rc = passwd_parse(buf ? buf : "", buf ? st.st_size : 0, &next);
+  if (buf)
+    munmap(buf, st.st_size);
+  buf = NULL;
+  if (rc == -2)
+    syslog(LOG_INFO, "%s has compat entries, reading users through NSS", PASSWD_PATH);
+  if (rc < 0)
+    goto fail;
+
+  /* A line forgotten from here on is found changed by the next diff */
+  pthread_mutex_lock(&prev_lock);
+  locked = 1;
+  d->set = calloc(next.n ? next.n : 1, sizeof(*d->set));
+  d->removed = calloc(prev.n ? prev.n : 1, sizeof(*d->removed));
+  if (!d->set || !d->removed) {
+    syslog(LOG_WARNING, "Cannot allocate memory to diff %s: %s", PASSWD_PATH, strerror(errno));
+    goto fail;
+  }
+
+  if (!prev.ents) {
+    d->full = 1;
+    memcpy(d->set, next.ents, next.n * sizeof(*d->set));
+    d->nset = next.n;
+    goto done;
+  }
+
+  /* Both parses are sorted by uid, walk them together */
+  while (i < prev.n || j < next.n) {
+    if (j == next.n || (i < prev.n && prev.ents[i].uid < next.ents[j].uid)) {
+      d->removed[d->nremoved++] = prev.ents[i++].uid;
+    }
+    else if (i == prev.n || next.ents[j].uid < prev.ents[i].uid) {
+      d->set[d->nset++] = next.ents[j++];
+    }
+    else {
+      if (prev.ents[i].hash != next.ents[j].hash)
+        d->set[d->nset++] = next.ents[j];
+      i++;
+      j++;
+    }
+  }
+
+done:
+  passwd_parse_free(&prev);
+  prev = next;
+  pthread_mutex_unlock(&prev_lock);
+  return 0;
+
+fail:
+  if (locked)
+    pthread_mutex_unlock(&prev_lock);
+  if (buf)
+    munmap(buf, st.st_size);
+  if (fd > -1)
+    close(fd);
+  passwd_parse_free(&next);
+  passwd_delta_free(d);
+  return -1;
+}
+
+
+void passwd_delta_free(
+    struct passwd_delta *d)
+{
+  free(d->set);
+  free(d->removed);
+  memset(d, 0, sizeof(*d));
+}
+
+
+void passwd_forget(
+    uid_t uid)
+{
+  struct passwd_entry *e;
+
+  pthread_mutex_lock(&prev_lock);
+  e = passwd_find(&prev, uid);
+  if (e)
+    e->hash = 0;
+  pthread_mutex_unlock(&prev_lock);
+}
+
+
+void passwd_reset(
+    void)
+{
+  pthread_mutex_lock(&prev_lock);
+  passwd_parse_free(&prev);
+  pthread_mutex_unlock(&prev_lock);
+}
@@ -0,0 +1,36 @@
+#ifndef _PASSWD_H_
+#define _PASSWD_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PASSWD_PATH "/etc/passwd"
+#define NSSWITCH_PATH "/etc/nsswitch.conf"
+
+struct passwd_entry {
+  uid_t uid;
+  /* Hash of the whole line, a change to any field changes it */
+  uint64_t hash;
+  char *name;
+};
+
+struct passwd_delta {
+  /* Lines that were added or changed, names are valid until the next diff */
+  struct passwd_entry *set;
+  int nset;
+  /* Uids whose line went away */
+  uid_t *removed;
+  int nremoved;
+  /* There was no previous parse, set holds every line in the file */
+  int full;
+};
+
+/* True when passwd lookups are answered from the passwd file alone */
+int passwd_files_only(void);
+int passwd_diff(struct passwd_delta *d);
+void passwd_delta_free(struct passwd_delta *d);
+/* Have the uid show up as changed on the next diff, from any thread */
+void passwd_forget(uid_t uid);
+/* Drop the previous parse, the next diff returns the whole file */
+void passwd_reset(void);
+#endif
@@ -11,6 +11,10 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <pwd.h>
 
@@ -23,16 +27,40 @@ struct {
   uid_t uid;
   int cmd;
   int rqpolicy;
+  int mmap;
+  int numeric;
+  uint64_t since;
+  uint64_t epoch;
+  struct port_query query;
+  /* The command run with a checked out socket */
+  char **exec;
 } config;
 
 static void print_help(
     void)
 {
-  printf("Usage: portguard [OPTION] COMMAND\n\n"
+  printf("Usage: portguard [OPTION] COMMAND\n"
+"       portguard [OPTION] checkout -- PROGRAM [ARG]...\n\n"
 "OPTION:\n"
 "  -h  --help                          Prints this help\n"
 "  -f  --sockpath            STRING    The path to the socket. Defaults to %s\n"
 "  -u  --user                STRING    The user to perform the request on. Only root can change a port for another user\n"
+"  -m  --mmap                          List by mapping the shared snapshot of the table rather than copying it\n"
+"\n"
+"LIST OPTION:\n"
+"  -U  --uids                LO[-HI]   Only list users with a uid in the range\n"
+"  -P  --ports               LO[-HI]   Only list ports in the range. For reserve and release, the ports\n"
+"                                      of the user to change rather than the one at its uid\n"
+"  -S  --status              STRING    Only list ports that are reserved, released or checked_out\n"
+"  -R  --reacquire           STRING    Only list ports that are re-acquired, yes or no\n"
+"  -a  --assigned                      Only list users whose port was assigned rather than following their uid\n"
+"  -c  --cursor              NUMBER    Start listing from this uid, as given at the end of a previous list\n"
+"  -n  --limit               NUMBER    List at most this many entries\n"
+"  -N  --numeric                       Print uids rather than looking up user names\n"
+"  -g  --generation          NUMBER    Only list changes made after this generation, for the changes command\n"
+"  -e  --epoch               NUMBER    The epoch the generation came with. If the server has restarted since,\n"
+"                                      the whole table is listed\n"
+"  Passing --user to list shows only that user.\n"
 "\n"
 "COMMAND:\n"
 "  release                             The port is unprotected and can be used.\n\n"
@@ -42,11 +70,53 @@ static void print_help(
 "                                      automatically re-acquired by the server to prevent another user from binding\n"
 "                                      to it. If you pass this option this informs the server to never attempt this\n"
 "                                      operation.\n\n"
-"  reacquire                           Tells the system that re-acquiring the port automatically is permitted.\n"
+"  reacquire                           Tells the system that re-acquiring the port automatically is permitted.\n\n"
+"  batch                               Reads lines of the form \"USER COMMAND\" from standard input, where COMMAND\n"
+"                                      is one of release, reserve, no_reacquire or reacquire, and submits them\n"
+"                                      to the server in batches. USER may be a name or a numeric uid.\n\n"
+"  subscribe                           Prints changes to ports as they happen, until interrupted. A line saying\n"
+"                                      resync means changes were missed and the list should be read again.\n\n"
+"  changes                             Lists entries that changed after the generation given with --generation,\n"
+"                                      including users that were deleted, and the generation and epoch to ask\n"
+"                                      from next.\n\n"
+"  upgrade                             Has the server exec a new copy of itself and hand it every port without\n"
+"                                      letting go of any. Only root can do this.\n\n"
+"  checkout                            Takes the bound socket of the reserved port from the server and runs\n"
+"                                      PROGRAM with it as descriptor 3, setting LISTEN_FDS and LISTEN_PID. The\n"
+"                                      port is never unbound, and the socket is handed back when PROGRAM exits.\n\n"
+"  ready                               Says whether the server is still binding the ports of users found when it\n"
+"                                      started, and how far along it is. Exits 0 once every port is bound.\n"
 "\n\n",
 DEFAULT_SOCKPATH);
 }
 
+/* Parses a number or an inclusive range of them */
+static int parse_range(
+    const char *arg,
+    unsigned long *lo,
+    unsigned long *hi,
+    unsigned long max)
+{
+  char *end;
+
+  errno = 0;
+  *lo = strtoul(arg, &end, 10);
+  if (end == arg)
+    return -1;
+  *hi = *lo;
+  if (*end == '-') {
+    arg = end + 1;
+    *hi = strtoul(arg, &end, 10);
+    if (end == arg)
+      return -1;
+  }
+
+  if (*end != 0 || errno || *lo > *hi || *hi > max)
+    return -1;
+  return 0;
+}
+
+
 static void parse_config(
     const int argc,
     char **argv)
@@ -55,10 +125,23 @@ static void parse_config(
   char nodefault = 1;
   char haveuid = 0;
   struct passwd *p;
+  unsigned long lo, hi;
+  char *end;
   static struct option long_options[] = {
     { "help", no_argument, 0, 'c'},
     { "sockpath", required_argument, 0, 'f' },
     { "user", required_argument, 0, 'u' },
+    { "mmap", no_argument, 0, 'm' },
+    { "uids", required_argument, 0, 'U' },
+    { "ports", required_argument, 0, 'P' },
+    { "status", required_argument, 0, 'S' },
+    { "reacquire", required_argument, 0, 'R' },
+    { "cursor", required_argument, 0, 'c' },
+    { "limit", required_argument, 0, 'n' },
+    { "numeric", no_argument, 0, 'N' },
+    { "generation", required_argument, 0, 'g' },
+    { "epoch", required_argument, 0, 'e' },
+    { "assigned", no_argument, 0, 'a' },
     { 0, 0, 0, 0 }
   };
 
@@ -67,7 +150,7 @@ static void parse_config(
   int opt_idx = 0;
 
   while (1) {
-    c = getopt_long(argc, argv, "h:f:u:", long_options, &opt_idx);
+    c = getopt_long(argc, argv, "h:f:u:mU:P:S:R:c:n:Ng:e:a", long_options, &opt_idx);
 
     if (c == -1)
       break;
@@ -87,6 +170,82 @@ static void parse_config(
         haveuid = 1;
       break;
 
+      case 'm':
+        config.mmap = 1;
+      break;
+
+      case 'U':
+        if (parse_range(optarg, &lo, &hi, UINT32_MAX) < 0)
+          errx(EXIT_FAILURE, "Cannot parse uid range %s", optarg);
+        config.query.flags |= QUERY_UID;
+        config.query.uid_min = lo;
+        config.query.uid_max = hi;
+      break;
+
+      case 'P':
+        if (parse_range(optarg, &lo, &hi, UINT16_MAX) < 0)
+          errx(EXIT_FAILURE, "Cannot parse port range %s", optarg);
+        config.query.flags |= QUERY_PORT;
+        config.query.port_min = lo;
+        config.query.port_max = hi;
+      break;
+
+      case 'S':
+        config.query.flags |= QUERY_STATUS;
+        if (strcmp(optarg, "reserved") == 0)
+          config.query.status = STATUS_RESERVED;
+        else if (strcmp(optarg, "released") == 0)
+          config.query.status = STATUS_RELEASED;
+        else if (strcmp(optarg, "checked_out") == 0)
+          config.query.status = STATUS_CHECKED_OUT;
+        else
+          errx(EXIT_FAILURE, "Status must be reserved, released or checked_out");
+      break;
+
+      case 'R':
+        config.query.flags |= QUERY_REACQUIRE;
+        if (strcmp(optarg, "yes") == 0)
+          config.query.dont_reacquire = REACQUIRE_DO;
+        else if (strcmp(optarg, "no") == 0)
+          config.query.dont_reacquire = REACQUIRE_DONT;
+        else
+          errx(EXIT_FAILURE, "Re-acquire must be yes or no");
+      break;
+
+      case 'c':
+        if (parse_range(optarg, &lo, &hi, UINT32_MAX) < 0 || lo != hi)
+          errx(EXIT_FAILURE, "Cannot parse cursor %s", optarg);
+        config.query.cursor = lo;
+      break;
+
+      case 'n':
+        if (parse_range(optarg, &lo, &hi, UINT32_MAX) < 0 || lo != hi)
+          errx(EXIT_FAILURE, "Cannot parse limit %s", optarg);
+        config.query.limit = lo;
+      break;
+
+      case 'N':
+        config.numeric = 1;
+      break;
+
+      case 'a':
+        config.query.flags |= QUERY_ASSIGNED;
+      break;
+
+      case 'g':
+        errno = 0;
+        config.since = strtoull(optarg, &end, 10);
+        if (errno || end == optarg || *end != 0)
+          errx(EXIT_FAILURE, "Cannot parse generation %s", optarg);
+      break;
+
+      case 'e':
+        errno = 0;
+        config.epoch = strtoull(optarg, &end, 10);
+        if (errno || end == optarg || *end != 0)
+          errx(EXIT_FAILURE, "Cannot parse epoch %s", optarg);
+      break;
+
       case 'h':
         print_help();
         exit(0);
@@ -103,6 +262,14 @@ static void parse_config(
     nodefault = 0;
     config.cmd = PORT_LIST;
   }
+  else if (strcmp(argv[optind], "checkout") == 0) {
+    if (argc - optind < 2) {
+      fprintf(stderr, "The checkout command needs a program to run.\n");
+      print_help();
+      exit(EXIT_FAILURE);
+    }
+    config.exec = argv + optind + 1;
+  }
   else if (argc - optind != 1) {
     fprintf(stderr, "Passed incorrect number of commands.\n");
     print_help();
@@ -124,6 +291,18 @@ static void parse_config(
       config.cmd = PORT_RQPOLICY;
       config.rqpolicy = 0;
     }
+    else if (strcmp(argv[optind], "batch") == 0)
+      config.cmd = PORT_BATCH;
+    else if (strcmp(argv[optind], "subscribe") == 0)
+      config.cmd = PORT_SUBSCRIBE;
+    else if (strcmp(argv[optind], "changes") == 0)
+      config.cmd = PORT_CHANGES;
+    else if (strcmp(argv[optind], "ready") == 0)
+      config.cmd = PORT_READY;
+    else if (strcmp(argv[optind], "upgrade") == 0)
+      config.cmd = PORT_UPGRADE;
+    else if (strcmp(argv[optind], "checkout") == 0)
+      config.cmd = PORT_CHECKOUT;
     else {
       fprintf(stderr, "The command passed was not recognised\n");
       print_help();
@@ -139,119 +318,801 @@ static void parse_config(
 
   if (!haveuid)
     config.uid = getuid();
+  else if (config.cmd == PORT_LIST) {
+    config.query.flags |= QUERY_UID;
+    config.query.uid_min = config.query.uid_max = config.uid;
+  }
+
+  if (config.mmap && (config.query.flags || config.query.cursor || config.query.limit))
+    errx(EXIT_FAILURE, "The list cannot be narrowed down with --mmap");
 }
 
 
-static inline void fill_request_vector(
-    struct port_request *pr,
-    struct iovec vec[7])
+/* What was received from the server and not used yet. On a seqpacket
+ * socket this is read a whole message at a time */
+static struct {
+  int seqpacket;
+  char *buf;
+  size_t cap;
+  size_t len;
+  size_t off;
+  int fds[2];
+  int nfds;
+} rx;
+
+static void recv_more(
+    int sock)
 {
-  vec[0].iov_base = &pr->magic;
-  vec[0].iov_len = sizeof(pr->magic);
-  vec[1].iov_base = &pr->request;
-  vec[1].iov_len = sizeof(pr->request);
-  vec[2].iov_base = &pr->pi.uid;
-  vec[2].iov_len = sizeof(pr->pi.uid);
-  vec[3].iov_base = &pr->pi.port;
-  vec[3].iov_len = sizeof(pr->pi.port);
-  vec[4].iov_base = &pr->pi.status;
-  vec[4].iov_len = sizeof(pr->pi.status);
-  vec[5].iov_base = &pr->pi.dont_reacquire;
-  vec[5].iov_len = sizeof(pr->pi.dont_reacquire);
-  vec[6].iov_base = &pr->error;
-  vec[6].iov_len = sizeof(pr->error);  
+  char cbuf[CMSG_SPACE(sizeof(int) * 2)];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec vec;
+  size_t want = 65536;
+  ssize_t rc;
+  int n;
+
+  /* Size the buffer to the next message */
+  if (rx.seqpacket) {
+    do {
+      rc = recv(sock, NULL, 0, MSG_PEEK|MSG_TRUNC);
+    } while (rc < 0 && errno == EINTR);
+    if (rc > 0)
+      want = rc;
+  }
+  if (want > rx.cap) {
+    rx.buf = realloc(rx.buf, want);
+    if (!rx.buf)
+      err(EXIT_FAILURE, "Cannot allocate memory");
+    rx.cap = want;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  vec.iov_base = rx.buf;
+  vec.iov_len = rx.cap;
+  msg.msg_iov = &vec;
+  msg.msg_iovlen = 1;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  do {
+    rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  } while (rc < 0 && errno == EINTR);
+  if (rc < 0)
+    err(EXIT_FAILURE, "Cannot receive from server");
+  if (rc == 0)
+    errx(EXIT_FAILURE, "The server closed the connection");
+  if (msg.msg_flags & (MSG_CTRUNC|MSG_TRUNC))
+    errx(EXIT_FAILURE, "Garbled response from the server");
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (rx.nfds + n > 2)
+      errx(EXIT_FAILURE, "Garbled response from the server");
+    memcpy(rx.fds + rx.nfds, CMSG_DATA(cmsg), n * sizeof(int));
+    rx.nfds += n;
+  }
+
+  rx.len = rc;
+  rx.off = 0;
 }
 
 
+/* Reads exactly len bytes */
+static void recv_all(
+    int sock,
+    void *buf,
+    size_t len)
+{
+  char *p = buf;
+  size_t n;
 
-int main(
-    const int argc,
-    const char **argv)
+  while (len > 0) {
+    if (rx.off == rx.len)
+      recv_more(sock);
+    n = rx.len - rx.off < len ? rx.len - rx.off : len;
+    memcpy(p, rx.buf + rx.off, n);
+    rx.off += n;
+    p += n;
+    len -= n;
+  }
+}
+
+
+/* Sends one request frame, passing fd along with it unless it is -1 */
+static void send_frame_fd(
+    int sock,
+    uint16_t opcode,
+    const char *payload,
+    uint32_t len,
+    int fd)
 {
-  int sock = -1;
-  int rc, i;
+  char hdr[FRAME_HEADER_LEN];
+  char cbuf[CMSG_SPACE(sizeof(int))];
+  struct cmsghdr *cmsg;
+  struct iovec vec[2];
+  struct msghdr msg;
+  ssize_t rc;
 
-  parse_config(argc, (char **)argv);
+  frame_put_header(hdr, opcode, len);
+  vec[0].iov_base = hdr;
+  vec[0].iov_len = sizeof(hdr);
+  vec[1].iov_base = (void *)payload;
+  vec[1].iov_len = len;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = vec;
+  msg.msg_iovlen = 2;
+  if (fd > -1) {
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+  }
 
+  while (msg.msg_iovlen > 0) {
+    rc = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0)
+      err(EXIT_FAILURE, "Failed to send message");
+    /* The descriptor went with the first part */
+    msg.msg_control = NULL;
+    msg.msg_controllen = 0;
+
+    /* Pick up after a short write */
+    while (msg.msg_iovlen > 0 && (size_t)rc >= msg.msg_iov->iov_len) {
+      rc -= msg.msg_iov->iov_len;
+      msg.msg_iov++;
+      msg.msg_iovlen--;
+    }
+    if (msg.msg_iovlen > 0) {
+      msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + rc;
+      msg.msg_iov->iov_len -= rc;
+    }
+  }
+}
+
+
+static void send_frame(
+    int sock,
+    uint16_t opcode,
+    const char *payload,
+    uint32_t len)
+{
+  send_frame_fd(sock, opcode, payload, len, -1);
+}
+
+
+/* Reads the start of a reply, along with up to two descriptors passed
+ * with it. Returns the length of the items that follow */
+static uint32_t recv_reply(
+    int sock,
+    uint16_t opcode,
+    uint32_t *count,
+    int fds[2],
+    int *nfds)
+{
+  char buf[FRAME_HEADER_LEN + FRAME_REPLY_LEN];
+  struct frame_header hdr;
+  const char *p;
+  uint32_t error;
+
+  recv_all(sock, buf, sizeof(buf));
+  p = frame_get_header(buf, &hdr);
+  if (hdr.magic != FRAME_MAGIC || hdr.version != FRAME_VERSION
+      || hdr.opcode != opcode || hdr.length < FRAME_REPLY_LEN)
+    errx(EXIT_FAILURE, "Garbled response from the server");
+
+  p = frame_get32(p, &error);
+  frame_get32(p, count);
+  if (error) {
+    errno = error;
+    err(EXIT_FAILURE, "Result");
+  }
+
+  /* Descriptors only come with the reply that passes them */
+  if (rx.nfds && !fds)
+    errx(EXIT_FAILURE, "Garbled response from the server");
+  if (nfds)
+    *nfds = rx.nfds;
+  if (fds)
+    memcpy(fds, rx.fds, rx.nfds * sizeof(int));
+  rx.nfds = 0;
+
+  return hdr.length - FRAME_REPLY_LEN;
+}
+
+
+/* Parses one line of batch input, returns 0 on success */
+static int parse_batch_line(
+    char *line,
+    struct port_batch_entry *e)
+{
+  char *user, *cmd, *end;
+  struct passwd *p;
+  unsigned long uid;
+
+  user = strtok(line, " \t\n");
+  cmd = strtok(NULL, " \t\n");
+  if (!user || !cmd || strtok(NULL, " \t\n"))
+    return -1;
+
+  memset(e, 0, sizeof(*e));
+  p = getpwnam(user);
+  if (p)
+    e->uid = p->pw_uid;
+  else {
+    uid = strtoul(user, &end, 10);
+    if (*end != 0 || end == user)
+      return -1;
+    e->uid = uid;
+  }
+
+  if (strcmp(cmd, "release") == 0)
+    e->op = PORT_RELEASE;
+  else if (strcmp(cmd, "reserve") == 0)
+    e->op = PORT_RESERVE;
+  else if (strcmp(cmd, "no_reacquire") == 0) {
+    e->op = PORT_RQPOLICY;
+    e->dont_reacquire = 1;
+  }
+  else if (strcmp(cmd, "reacquire") == 0) {
+    e->op = PORT_RQPOLICY;
+    e->dont_reacquire = 0;
+  }
+  else
+    return -1;
+
+  return 0;
+}
+
+
+/* Sends one batch, reporting any entry that failed. Returns the number of
+ * failures */
+static int send_batch(
+    int sock,
+    struct port_batch_entry *entries,
+    uint32_t count)
+{
+  char buf[sizeof(uint32_t) + PORT_BATCH_MAX * FRAME_ENTRY_LEN];
+  char *p = buf;
+  uint32_t error;
+  uint32_t len, n;
+  int failed = 0;
+  uint32_t i;
+
+  p = frame_put32(p, count);
+  for (i=0; i < count; i++)
+    p = frame_put_entry(p, entries[i].uid, entries[i].port,
+                        entries[i].op, entries[i].dont_reacquire);
+  send_frame(sock, PORT_BATCH, buf, p - buf);
+
+  len = recv_reply(sock, PORT_BATCH, &n, NULL, NULL);
+  if (n != count || len < count * sizeof(error) || len > sizeof(buf))
+    errx(EXIT_FAILURE, "Garbled response from the server");
+
+  recv_all(sock, buf, len);
+  p = buf;
+  for (i=0; i < count; i++) {
+    p = (char *)frame_get32(p, &error);
+    if (error == 0)
+      continue;
+    fprintf(stderr, "uid %d: %s\n", entries[i].uid, strerror(error));
+    failed++;
+  }
+
+  return failed;
+}
+
+
+static int run_batch(
+    int sock)
+{
+  struct port_batch_entry entries[PORT_BATCH_MAX];
+  char line[1024];
+  uint32_t count = 0;
+  int lineno = 0;
+  int failed = 0;
+
+  while (fgets(line, sizeof(line), stdin)) {
+    lineno++;
+    if (line[0] == '\n' || line[0] == '#')
+      continue;
+    if (parse_batch_line(line, &entries[count]) < 0)
+      errx(EXIT_FAILURE, "Cannot parse line %d of the batch", lineno);
+
+    if (++count == PORT_BATCH_MAX) {
+      failed += send_batch(sock, entries, count);
+      count = 0;
+    }
+  }
+
+  if (count)
+    failed += send_batch(sock, entries, count);
+  return failed;
+}
+
+
+static void print_list(
+    struct portinfo *pi,
+    uint32_t len)
+{
   struct passwd *pw;
+  uint32_t i;
+
+  printf("%-24s%-8s%-16s%-8s\n", "User", "Port", "Status", "Re-acquire");
+  printf("----------------------------------------------------------\n");
+  for (i=0; i < len; i++) {
+      pw = config.numeric ? NULL : getpwuid(pi[i].uid);
+      if (!pw)
+        printf("%-24u", pi[i].uid);
+      else
+        printf("%-24s", pw->pw_name);
+
+      printf("%-8hu", pi[i].port);
+
+      if (pi[i].status == STATUS_RESERVED)
+        printf("%-16s", "reserved");
+      else if (pi[i].status == STATUS_RELEASED)
+        printf("%-16s", "released");
+      else if (pi[i].status == STATUS_CHECKED_OUT)
+        printf("%-16s", "checked out");
+      else if (pi[i].status == STATUS_UNKNOWN)
+        printf("%-16s", "");
+      else
+        printf("%-16s", "unknown");
+
+      if (pi[i].dont_reacquire == REACQUIRE_DO)
+        printf("%-8s", "yes");
+      else if (pi[i].dont_reacquire == REACQUIRE_DONT)
+        printf("%-8s", "no");
+      else if (pi[i].dont_reacquire == REACQUIRE_UNKNOWN)
+        printf("%-8s", "");
+      else
+        printf("%-8s", "unknown");
+      printf("\n");
+  }
+}
+
+
+/* Maps a snapshot and copies the used entries out of it consistently */
+static int read_snapshot(
+    int fd,
+    struct portinfo **out)
+{
+  struct port_snapshot_header *hdr;
+  struct port_snapshot_entry *entries;
   struct portinfo *pi = NULL;
-  struct port_request pr;
-  struct port_response resp;
-  struct iovec vec[7];
+  uint64_t seq;
+  size_t size;
+  uint32_t i;
+  int len;
+
+  hdr = mmap(NULL, sizeof(*hdr), PROT_READ, MAP_SHARED, fd, 0);
+  if (hdr == MAP_FAILED)
+    err(EXIT_FAILURE, "Cannot map the snapshot");
+  if (hdr->magic != SNAPSHOT_MAGIC || hdr->version != SNAPSHOT_VERSION)
+    errx(EXIT_FAILURE, "Unsupported snapshot from the server");
+
+  /* The capacity of a memfd never changes, it is replaced instead */
+  size = sizeof(*hdr) + hdr->capacity * sizeof(*entries);
+  munmap(hdr, sizeof(*hdr));
+  hdr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (hdr == MAP_FAILED)
+    err(EXIT_FAILURE, "Cannot map the snapshot");
+  entries = (struct port_snapshot_entry *)(hdr + 1);
+
+  pi = calloc(hdr->capacity ? hdr->capacity : 1, sizeof(*pi));
+  if (!pi)
+    err(EXIT_FAILURE, "Cannot allocate memory");
+
+  do {
+    while ((seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE)) & 1)
+      ;
+    len = 0;
+    for (i=0; i < hdr->capacity; i++) {
+      if (entries[i].flags & SNAPSHOT_ENTRY_USED)
+        pi[len++] = entries[i].pi;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while (__atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) != seq);
+
+  if (hdr->stale)
+    len = -1;
+  munmap(hdr, size);
+  *out = pi;
+  return len;
+}
+
+
+static int run_snapshot(
+    int sock)
+{
+  struct portinfo *pi, *self = NULL;
+  uint32_t count;
+  int fds[2];
+  int n, len, selflen = 0;
+  int i, j;
+
+  send_frame(sock, PORT_SNAPSHOT, NULL, 0);
+  recv_reply(sock, PORT_SNAPSHOT, &count, fds, &n);
+  if (n < 1 || (uint32_t)n != count)
+    errx(EXIT_FAILURE, "Garbled response from the server");
+
+  len = read_snapshot(fds[0], &pi);
+  if (n > 1)
+    selflen = read_snapshot(fds[1], &self);
+  for (i=0; i < n; i++)
+    close(fds[i]);
+  if (len < 0 || selflen < 0)
+    errx(EXIT_FAILURE, "The snapshot went stale, try again");
+
+  /* Fill our own row back in over the redacted one */
+  for (j=0; j < selflen; j++) {
+    for (i=0; i < len; i++) {
+      if (pi[i].uid == self[j].uid)
+        pi[i] = self[j];
+    }
+  }
+
+  print_list(pi, len);
+  free(pi);
+  free(self);
+  return 0;
+}
+
+
+static const char *status_name(
+    uint8_t status)
+{
+  if (status == STATUS_RESERVED)
+    return "reserved";
+  else if (status == STATUS_RELEASED)
+    return "released";
+  else if (status == STATUS_CHECKED_OUT)
+    return "checked_out";
+  return "-";
+}
+
+
+static int run_subscribe(
+    int sock)
+{
+  static const char *reasons[] = {
+    "added", "deleted", "reserved", "released", "policy", "reacquired", "resync",
+    "checkout", "return"
+  };
+  char hdrbuf[FRAME_HEADER_LEN];
+  struct frame_header hdr;
+  struct port_event ev;
+  struct passwd *pw;
+  const char *p;
+  char *buf;
+  uint32_t count, i;
+
+  send_frame(sock, PORT_SUBSCRIBE, NULL, 0);
+  recv_reply(sock, PORT_SUBSCRIBE, &count, NULL, NULL);
+
+  while (1) {
+    recv_all(sock, hdrbuf, sizeof(hdrbuf));
+    frame_get_header(hdrbuf, &hdr);
+    if (hdr.magic != FRAME_MAGIC || hdr.opcode != PORT_EVENT || hdr.length < FRAME_REPLY_LEN)
+      errx(EXIT_FAILURE, "Garbled response from the server");
+
+    buf = malloc(hdr.length);
+    if (!buf)
+      err(EXIT_FAILURE, "Cannot allocate memory");
+    recv_all(sock, buf, hdr.length);
+    p = frame_get32(buf + sizeof(uint32_t), &count);
+    if ((hdr.length - FRAME_REPLY_LEN) / FRAME_EVENT_LEN < count)
+      errx(EXIT_FAILURE, "Garbled response from the server");
+
+    for (i=0; i < count; i++) {
+      p = frame_get_event(p, &ev);
+      if (ev.reason == EVENT_RESYNC) {
+        printf("resync\n");
+        continue;
+      }
+
+      pw = config.numeric ? NULL : getpwuid(ev.uid);
+      if (pw)
+        printf("%-24s", pw->pw_name);
+      else
+        printf("%-24u", ev.uid);
+      printf("%-8hu%-12s%-10s -> %s\n", ev.port,
+             ev.reason <= EVENT_RETURN ? reasons[ev.reason] : "unknown",
+             status_name(ev.old_status), status_name(ev.new_status));
+    }
+    fflush(stdout);
+    free(buf);
+  }
+
+  return 0;
+}
+
+
+static int run_changes(
+    int sock)
+{
+  struct port_change ch;
+  struct passwd *pw;
+  char since[2 * sizeof(uint64_t)];
+  uint64_t gen = config.since, epoch = config.epoch;
+  uint32_t count, len, flags, i;
+  int full = 0;
+  const char *p;
+  char *buf;
+
+  printf("%-24s%-8s%-16s%-12s%s\n", "User", "Port", "Status", "Re-acquire", "Generation");
+  printf("----------------------------------------------------------------------\n");
+
+  /* A reply that stops short is picked up from its last generation */
+  do {
+    frame_put64(frame_put64(since, gen), epoch);
+    send_frame(sock, PORT_CHANGES, since, sizeof(since));
+    len = recv_reply(sock, PORT_CHANGES, &count, NULL, NULL);
+    if (len / FRAME_CHANGE_LEN < count
+        || len - count * FRAME_CHANGE_LEN < sizeof(gen) + sizeof(flags))
+      errx(EXIT_FAILURE, "Garbled response from the server");
+
+    buf = malloc(len);
+    if (!buf)
+      err(EXIT_FAILURE, "Cannot allocate memory");
+    recv_all(sock, buf, len);
+
+    p = buf;
+    for (i=0; i < count; i++) {
+      p = frame_get_change(p, &ch);
+      pw = config.numeric ? NULL : getpwuid(ch.pi.uid);
+      if (pw)
+        printf("%-24s", pw->pw_name);
+      else
+        printf("%-24u", ch.pi.uid);
+      printf("%-8hu", ch.pi.port);
+      if (ch.flags & CHANGE_DELETED)
+        printf("%-16s%-12s", "deleted", "");
+      else
+        printf("%-16s%-12s", status_name(ch.pi.status),
+               ch.pi.dont_reacquire == REACQUIRE_DONT ? "no" : "yes");
+      printf("%llu\n", (unsigned long long)ch.generation);
+    }
+
+    p = frame_get64(p, &gen);
+    p = frame_get32(p, &flags);
+    /* Older servers have no epoch */
+    if (len - count * FRAME_CHANGE_LEN >= sizeof(gen) + sizeof(flags) + sizeof(epoch))
+      frame_get64(p, &epoch);
+    if (flags & CHANGES_FULL)
+      full = 1;
+    free(buf);
+  } while (flags & CHANGES_MORE);
+
+  if (full)
+    fprintf(stderr, "This is the whole table, drop any entry not listed\n");
+  fprintf(stderr, "Continue with --generation %llu --epoch %llu\n", (unsigned long long)gen,
+          (unsigned long long)epoch);
+  return 0;
+}
+
+
+static int run_ready(
+    int sock)
+{
+  char buf[FRAME_READY_LEN];
+  uint32_t count, len, state, bound, total;
+  const char *p;
+
+  send_frame(sock, PORT_READY, NULL, 0);
+  len = recv_reply(sock, PORT_READY, &count, NULL, NULL);
+  if (len < FRAME_READY_LEN)
+    errx(EXIT_FAILURE, "Garbled response from the server");
+  recv_all(sock, buf, sizeof(buf));
+
+  p = frame_get32(buf, &state);
+  p = frame_get32(p, &bound);
+  frame_get32(p, &total);
+
+  printf("%s: %u of %u users bound (%u%%)\n", state == READY_DONE ? "ready" : "warming",
+         bound, total, total ? (unsigned)((uint64_t)bound * 100 / total) : 100);
+  return state == READY_DONE ? 0 : 1;
+}
+
+
+/* The server may be listening on either, connect says which */
+static int connect_server(
+    void)
+{
   struct sockaddr_un un;
+  int sock, rc;
 
   memset(&un, 0, sizeof(un));
-  fill_request_vector(&pr, vec);
-
-  pr.magic = MAGIC;
-  pr.request = config.cmd;
-  pr.pi.uid = config.uid;
-  pr.pi.port = 0;
-  pr.pi.status = 0;
-  if (config.cmd == PORT_RQPOLICY)
-    pr.pi.dont_reacquire = config.rqpolicy;
-  pr.error = 0;
+  un.sun_family = AF_UNIX;
+  strncpy(un.sun_path, config.sockfile, sizeof(un.sun_path) - 1);
 
+  rx.seqpacket = 0;
+  rx.len = rx.off = 0;
   sock = socket(AF_UNIX, SOCK_STREAM, 0);
   if (sock < 0)
     err(EXIT_FAILURE, "Could not make socket");
+  rc = connect(sock, (struct sockaddr *)&un, sizeof(un));
+  if (rc < 0 && errno == EPROTOTYPE) {
+    close(sock);
+    sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0)
+      err(EXIT_FAILURE, "Could not make socket");
+    rx.seqpacket = 1;
+    rc = connect(sock, (struct sockaddr *)&un, sizeof(un));
+  }
+  if (rc < 0)
+    err(EXIT_FAILURE, "Cannot connect to socket");
+  return sock;
+}
 
-  un.sun_family = AF_UNIX;
-  strncpy(un.sun_path, config.sockfile, strlen(config.sockfile));
 
-  if (connect(sock, (struct sockaddr *)&un, sizeof(un)) < 0)
-    err(EXIT_FAILURE, "Cannot connect to socket");
+/* Runs the program with the checked out socket, then hands it back. The
+ * program may run for a long time, so the socket goes back on a new
+ * connection. Returns the exit status to leave with */
+static int run_checkout(
+    int sock)
+{
+  char buf[FRAME_ENTRY_LEN];
+  char pidbuf[16];
+  struct sigaction ign, oldint, oldquit;
+  uint32_t count;
+  int fds[2], nfds;
+  int status = 0;
+  pid_t pid;
 
-  rc = writev(sock, vec, 7);
-  if (rc < 0)
-    err(EXIT_FAILURE, "Failed to send message");
+  frame_put_entry(buf, config.uid, 0, 0, 0);
+  send_frame(sock, PORT_CHECKOUT, buf, sizeof(buf));
+  recv_reply(sock, PORT_CHECKOUT, &count, fds, &nfds);
+  if (nfds != 1)
+    errx(EXIT_FAILURE, "Garbled response from the server");
+  close(sock);
 
-  rc = recv(sock, &resp, sizeof(resp), 0);
-  if (resp.error) {
-    errno = resp.error;
-    err(EXIT_FAILURE, "Result");
+  /* Like system(), leave interrupting to the program so we get to return
+   * the socket */
+  memset(&ign, 0, sizeof(ign));
+  ign.sa_handler = SIG_IGN;
+  sigaction(SIGINT, &ign, &oldint);
+  sigaction(SIGQUIT, &ign, &oldquit);
+
+  pid = fork();
+  if (pid == 0) {
+    sigaction(SIGINT, &oldint, NULL);
+    sigaction(SIGQUIT, &oldquit, NULL);
+    if (fds[0] == 3)
+      fcntl(3, F_SETFD, 0);
+    else if (dup2(fds[0], 3) < 0)
+      err(127, "Cannot pass socket");
+    snprintf(pidbuf, sizeof(pidbuf), "%d", getpid());
+    setenv("LISTEN_FDS", "1", 1);
+    setenv("LISTEN_PID", pidbuf, 1);
+    execvp(config.exec[0], config.exec);
+    err(127, "Cannot run %s", config.exec[0]);
+  }
+
+  if (pid < 0) {
+    warn("Cannot run %s", config.exec[0]);
+    status = 127 << 8;
+  }
+  while (pid > 0 && waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      warn("Cannot wait for %s", config.exec[0]);
+      break;
+    }
+  }
+
+  sock = connect_server();
+  send_frame_fd(sock, PORT_RETURN, buf, sizeof(buf), fds[0]);
+  close(fds[0]);
+  recv_reply(sock, PORT_RETURN, &count, NULL, NULL);
+  close(sock);
+
+  if (WIFSIGNALED(status))
+    return 128 + WTERMSIG(status);
+  return WEXITSTATUS(status);
+}
+
+
+int main(
+    const int argc,
+    const char **argv)
+{
+  int sock = -1;
+  int rc;
+
+  parse_config(argc, (char **)argv);
+
+  struct portinfo *pi = NULL;
+  char buf[FRAME_ENTRY_LEN + sizeof(uint16_t)];
+  char query[FRAME_QUERY_LEN];
+  uint32_t cursor;
+  const char *p;
+  char *items;
+  uint32_t count, len, i;
+
+  sock = connect_server();
+
+  if (config.cmd == PORT_CHECKOUT)
+    exit(run_checkout(sock));
+
+  if (config.cmd == PORT_BATCH) {
+    rc = run_batch(sock);
+    close(sock);
+    exit(rc ? EXIT_FAILURE : 0);
+  }
+
+  if (config.cmd == PORT_CHANGES) {
+    rc = run_changes(sock);
+    close(sock);
+    exit(rc);
+  }
+
+  if (config.cmd == PORT_UPGRADE) {
+    send_frame(sock, PORT_UPGRADE, NULL, 0);
+    recv_reply(sock, PORT_UPGRADE, &count, NULL, NULL);
+    close(sock);
+    exit(0);
+  }
+
+  if (config.cmd == PORT_READY) {
+    rc = run_ready(sock);
+    close(sock);
+    exit(rc);
+  }
+
+  if (config.cmd == PORT_SUBSCRIBE) {
+    rc = run_subscribe(sock);
+    close(sock);
+    exit(rc);
+  }
+
+  if (config.cmd == PORT_LIST && config.mmap) {
+    rc = run_snapshot(sock);
+    close(sock);
+    exit(rc);
   }
 
   if (config.cmd == PORT_LIST) {
-    if (resp.portslen < 0 || resp.portslen > 65535)
+    frame_put_query(query, &config.query);
+    send_frame(sock, PORT_LIST, query, sizeof(query));
+    len = recv_reply(sock, PORT_LIST, &count, NULL, NULL);
+    if (len / FRAME_ENTRY_LEN < count || len - count * FRAME_ENTRY_LEN < sizeof(cursor))
       errx(EXIT_FAILURE, "Garbled response from the server");
-    pi = calloc(resp.portslen, sizeof(*pi));
 
-    rc = recv(sock, pi, sizeof(*pi) * resp.portslen, 0);
-    if (rc < 0)
-      err(EXIT_FAILURE, "Cannot receive from server");
-
-    printf("%-24s%-8s%-16s%-8s\n", "User", "Port", "Status", "Re-acquire");
-    printf("----------------------------------------------------------\n", "");
-    for (i=0; i < resp.portslen; i++) {
-        pw = getpwuid(pi[i].uid);
-        if (!pw)
-          printf("%-24d", pi[i].uid);
-        else
-          printf("%-24s", pw->pw_name);
+    pi = calloc(count ? count : 1, sizeof(*pi));
+    items = malloc(len ? len : 1);
+    if (!pi || !items)
+      err(EXIT_FAILURE, "Cannot allocate memory");
+    recv_all(sock, items, len);
 
-        printf("%-8hd", pi[i].port);
+    p = items;
+    for (i=0; i < count; i++)
+      p = frame_get_portinfo(p, &pi[i]);
+    frame_get32(p, &cursor);
+    print_list(pi, count);
 
-        if (pi[i].status == STATUS_RESERVED)
-          printf("%-16s", "reserved");
-        else if (pi[i].status == STATUS_RELEASED)
-          printf("%-16s", "released");
-        else if (pi[i].status == STATUS_UNKNOWN)
-          printf("%-16s", "");
-        else
-          printf("%-16s", "unknown");
-
-        if (pi[i].dont_reacquire == REACQUIRE_DO)
-          printf("%-8s", "yes");
-        else if (pi[i].dont_reacquire == REACQUIRE_DONT)
-          printf("%-8s", "no");
-        else if (pi[i].dont_reacquire == REACQUIRE_UNKNOWN)
-          printf("%-8s", "");
-        else
-          printf("%-8s", "unknown");
-        printf("\n");
-    }
+    if (cursor)
+      fprintf(stderr, "There are more entries, continue the list with --cursor %u\n", cursor);
   }
+  else if (config.cmd == PORT_RESERVE || config.cmd == PORT_RELEASE) {
+    /* Without --ports this is the users own port */
+    frame_put16(frame_put_entry(buf, config.uid, config.query.port_min, 0, 0), config.query.port_max);
+    send_frame(sock, config.cmd, buf, sizeof(buf));
+    recv_reply(sock, config.cmd, &count, NULL, NULL);
+  }
+  else {
+    frame_put_entry(buf, config.uid, 0, 0,
+                    config.cmd == PORT_RQPOLICY ? config.rqpolicy : 0);
+    send_frame(sock, config.cmd, buf, FRAME_ENTRY_LEN);
+    recv_reply(sock, config.cmd, &count, NULL, NULL);
+  }
+
   close(sock);
   exit(0);
 }
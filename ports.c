@@ -0,0 +1,365 @@
+/* Reads which extra ports each user holds and keeps them per user as runs of
+ * consecutive ports, so tens of ports cost a few bytes each on top of their
+ * sockets rather than an entry apiece */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include "config.h"
+#include "ports.h"
+
+/* A line of the file, its runs are in the table's pool */
+struct ports_entry {
+  uid_t uid;
+  /* NULL when the user was given as a uid */
+  char *name;
+  int run;
+  int nruns;
+};
+
+struct ports_table {
+  struct ports_entry *ents;
+  int n;
+  struct port_run *runs;
+  int nruns;
+  /* Entries given by uid sorted by uid, those given by name by name */
+  struct ports_entry **byuid;
+  int nbyuid;
+  struct ports_entry **byname;
+  int nbyname;
+};
+
+/* Replaced whole by a reload, lookups may come from any thread */
+static pthread_mutex_t ports_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ports_table table;
+
+
+static void ports_table_free(
+    struct ports_table *t)
+{
+  int i;
+
+  for (i=0; i < t->n; i++)
+    free(t->ents[i].name);
+  free(t->ents);
+  free(t->runs);
+  free(t->byuid);
+  free(t->byname);
+  memset(t, 0, sizeof(*t));
+}
+
+
+static int ports_uid_compare(
+    const void *a,
+    const void *b)
+{
+  const struct ports_entry *x = *(struct ports_entry * const *)a;
+  const struct ports_entry *y = *(struct ports_entry * const *)b;
+
+  return (x->uid > y->uid) - (x->uid < y->uid);
+}
+
+
+static int ports_name_compare(
+    const void *a,
+    const void *b)
+{
+  const struct ports_entry *x = *(struct ports_entry * const *)a;
+  const struct ports_entry *y = *(struct ports_entry * const *)b;
+
+  return strcmp(x->name, y->name);
+}
+
+
+static int ports_run_compare(
+    const void *a,
+    const void *b)
+{
+  const struct port_run *x = a;
+  const struct port_run *y = b;
+
+  return (x->first > y->first) - (x->first < y->first);
+}
+
+
+/* Adds the runs of a list like 2000,3000-3009 to the table */
+static int ports_parse_list(
+    struct ports_table *t,
+    int *cap,
+    char *list,
+    const char *path,
+    int lineno)
+{
+  struct port_run *runs;
+  char *item, *save, *end;
+  unsigned long lo, hi;
+  int n = 0;
+
+  for (item = strtok_r(list, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+    errno = 0;
+    lo = hi = strtoul(item, &end, 10);
+    if (*end == '-')
+      hi = strtoul(end + 1, &end, 10);
+    if (end == item || *end || errno || lo < PRIVPORTS || lo > hi || hi > UINT16_MAX) {
+      syslog(LOG_WARNING, "Ignoring ports %s on line %d of %s", item, lineno, path);
+      continue;
+    }
+
+    if (t->nruns == *cap) {
+      *cap = *cap ? *cap * 2 : 256;
+      runs = realloc(t->runs, *cap * sizeof(*runs));
+      if (!runs)
+        return -1;
+      t->runs = runs;
+    }
+    t->runs[t->nruns].first = lo;
+    t->runs[t->nruns].count = hi - lo + 1;
+    t->nruns++;
+    n++;
+  }
+  return n;
+}
+
+
+int ports_load(
+    const char *path)
+{
+  struct ports_table t;
+  struct ports_entry *ents, *e;
+  FILE *f;
+  char *line = NULL, *user, *list, *save, *end;
+  size_t linecap = 0;
+  unsigned long uid;
+  int cap = 0, runcap = 0;
+  int lineno = 0, i, n;
+
+  memset(&t, 0, sizeof(t));
+  f = fopen(path, "re");
+  if (!f) {
+    /* Nobody has extra ports then */
+    if (errno == ENOENT)
+      goto swap;
+    syslog(LOG_WARNING, "Cannot open %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  while (getline(&line, &linecap, f) > 0) {
+    lineno++;
+    user = strtok_r(line, " \t\n", &save);
+    if (!user || *user == '#')
+      continue;
+
+    if (t.n == cap) {
+      cap = cap ? cap * 2 : 64;
+      ents = realloc(t.ents, cap * sizeof(*ents));
+      if (!ents)
+        goto fail;
+      t.ents = ents;
+    }
+    e = &t.ents[t.n];
+    memset(e, 0, sizeof(*e));
+
+    errno = 0;
+    uid = strtoul(user, &end, 10);
+    if (*end || errno || uid >= UINT32_MAX) {
+      e->name = strdup(user);
+      if (!e->name)
+        goto fail;
+    }
+    else {
+      e->uid = uid;
+    }
+
+    e->run = t.nruns;
+    while ((list = strtok_r(NULL, " \t\n", &save))) {
+      n = ports_parse_list(&t, &runcap, list, path, lineno);
+      if (n < 0)
+        goto fail;
+      e->nruns += n;
+    }
+
+    if (e->nruns == 0) {
+      free(e->name);
+      continue;
+    }
+    t.n++;
+  }
+  fclose(f);
+  f = NULL;
+
+  t.byuid = calloc(t.n ? t.n : 1, sizeof(*t.byuid));
+  t.byname = calloc(t.n ? t.n : 1, sizeof(*t.byname));
+  if (!t.byuid || !t.byname)
+    goto fail;
+  for (i=0; i < t.n; i++) {
+    if (t.ents[i].name)
+      t.byname[t.nbyname++] = &t.ents[i];
+    else
+      t.byuid[t.nbyuid++] = &t.ents[i];
+  }
+  qsort(t.byuid, t.nbyuid, sizeof(*t.byuid), ports_uid_compare);
+  qsort(t.byname, t.nbyname, sizeof(*t.byname), ports_name_compare);
+
+  syslog(LOG_INFO, "Read %d users with %d port ranges from %s", t.n, t.nruns, path);
+
+swap:
+  free(line);
+  pthread_mutex_lock(&ports_lock);
+  ports_table_free(&table);
+  table = t;
+  pthread_mutex_unlock(&ports_lock);
+  return 0;
+
+fail:
+  syslog(LOG_WARNING, "Cannot allocate memory to read %s: %s", path, strerror(errno));
+  if (f)
+    fclose(f);
+  free(line);
+  ports_table_free(&t);
+  return -1;
+}
+
+
+/* Copies the runs of every entry for the user into runs, ports_lock must be
+ * held. Returns how many were copied */
+static int ports_collect(
+    const char *name,
+    uid_t uid,
+    struct port_run *runs,
+    int max)
+{
+  struct ports_entry key, *kp = &key, **found;
+  struct ports_entry **idx;
+  int (*cmp)(const void *, const void *);
+  int nidx, pass, lo, n = 0, i;
+
+  key.uid = uid;
+  key.name = (char *)name;
+  for (pass=0; pass < 2; pass++) {
+    idx = pass ? table.byname : table.byuid;
+    nidx = pass ? table.nbyname : table.nbyuid;
+    cmp = pass ? ports_name_compare : ports_uid_compare;
+    found = bsearch(&kp, idx, nidx, sizeof(*idx), cmp);
+    if (!found)
+      continue;
+
+    /* Any of the entries with the key may have been found, take them all */
+    for (lo = found - idx; lo > 0 && cmp(&idx[lo-1], &kp) == 0; lo--);
+    for (; lo < nidx && cmp(&idx[lo], &kp) == 0; lo++) {
+      for (i=0; i < idx[lo]->nruns && n < max; i++)
+        runs[n++] = table.runs[idx[lo]->run + i];
+    }
+  }
+  return n;
+}
+
+
+int ports_lookup(
+    const char *name,
+    uid_t uid,
+    uint16_t skip,
+    uint16_t *ports,
+    int max)
+{
+  struct port_run runs[PORTS_USER_MAX];
+  uint32_t port, end, next = 0;
+  int nruns, n = 0, i;
+
+  pthread_mutex_lock(&ports_lock);
+  nruns = table.n ? ports_collect(name, uid, runs, PORTS_USER_MAX) : 0;
+  pthread_mutex_unlock(&ports_lock);
+
+  /* Overlapping runs give each port once */
+  qsort(runs, nruns, sizeof(*runs), ports_run_compare);
+  for (i=0; i < nruns; i++) {
+    end = (uint32_t)runs[i].first + runs[i].count;
+    for (port = runs[i].first > next ? runs[i].first : next; port < end; port++) {
+      if (port == skip)
+        continue;
+      if (n == max) {
+        syslog(LOG_WARNING, "User %s has more than %d extra ports, ignoring the rest", name, max);
+        return n;
+      }
+      ports[n++] = port;
+    }
+    if (end > next)
+      next = end;
+  }
+  return n;
+}
+
+
+struct port_set * ports_set_new(
+    const uint16_t *ports,
+    int n)
+{
+  struct port_set *ps;
+  int nruns = 0, i;
+
+  if (n == 0)
+    return NULL;
+
+  for (i=0; i < n; i++) {
+    if (i == 0 || ports[i] != ports[i-1] + 1)
+      nruns++;
+  }
+
+  /* Times first, they need the strictest alignment */
+  ps = malloc(sizeof(*ps) + n * sizeof(*ps->reacquire) + nruns * sizeof(*ps->runs)
+              + n * sizeof(*ps->fds));
+  if (!ps)
+    return NULL;
+  ps->nruns = 0;
+  ps->nports = n;
+  ps->reacquire = (time_t *)(ps + 1);
+  ps->runs = (struct port_run *)(ps->reacquire + n);
+  ps->fds = (int *)(ps->runs + nruns);
+
+  for (i=0; i < n; i++) {
+    if (i == 0 || ports[i] != ports[i-1] + 1) {
+      ps->runs[ps->nruns].first = ports[i];
+      ps->runs[ps->nruns].count = 0;
+      ps->nruns++;
+    }
+    ps->runs[ps->nruns-1].count++;
+    ps->fds[i] = -1;
+    ps->reacquire[i] = 0;
+  }
+  return ps;
+}
+
+
+int ports_set_find(
+    const struct port_set *ps,
+    uint16_t port)
+{
+  int i, pos = 0;
+
+  for (i=0; i < ps->nruns; i++) {
+    if (port < ps->runs[i].first)
+      break;
+    if (port - ps->runs[i].first < ps->runs[i].count)
+      return pos + port - ps->runs[i].first;
+    pos += ps->runs[i].count;
+  }
+  return -1;
+}
+
+
+int ports_set_ports(
+    const struct port_set *ps,
+    uint16_t *ports)
+{
+  int i, j, n = 0;
+
+  for (i=0; i < ps->nruns; i++) {
+    for (j=0; j < ps->runs[i].count; j++)
+      ports[n++] = ps->runs[i].first + j;
+  }
+  return n;
+}
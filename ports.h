@@ -0,0 +1,45 @@
+#ifndef _PORTS_H_
+#define _PORTS_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* Ports a user holds beyond its own at port_offset + uid are listed in a
+ * file of lines "USER PORTS". USER is a name or a uid and PORTS a comma
+ * separated list of ports and inclusive ranges LO-HI. A user listed more
+ * than once gets every port listed. The file is read at startup and on HUP,
+ * a missing file gives nobody extra ports */
+#define DEFAULT_PORTSFILE "/etc/bookkeeper/ports"
+/* Most extra ports one user may hold, the rest are ignored */
+#define PORTS_USER_MAX 128
+
+struct port_run {
+  uint16_t first;
+  uint16_t count;
+};
+
+/* The extra ports of a user as sorted runs, allocated as one block. Each
+ * port has its socket in fds in run order, -1 while it is released, and in
+ * reacquire the time it is due back while released */
+struct port_set {
+  uint16_t nruns;
+  uint16_t nports;
+  time_t *reacquire;
+  struct port_run *runs;
+  int *fds;
+};
+
+/* Returns -1 and keeps the ports already read if the file cannot be read */
+int ports_load(const char *path);
+/* Fills ports in with the sorted extra ports of a user, leaving out skip.
+ * Returns how many there are */
+int ports_lookup(const char *name, uid_t uid, uint16_t skip, uint16_t *ports, int max);
+/* Builds a set from sorted ports with every port released, NULL if n is 0
+ * or memory ran out */
+struct port_set * ports_set_new(const uint16_t *ports, int n);
+/* The position of a port in the set, -1 if it is not in it */
+int ports_set_find(const struct port_set *ps, uint16_t port);
+/* Lists the ports of a set in order, returns how many there are */
+int ports_set_ports(const struct port_set *ps, uint16_t *ports);
+#endif
@@ -2,12 +2,16 @@
 #define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <err.h>
 #include <signal.h>
+#include <time.h>
+#include <assert.h>
+#include <syslog.h>
 
 #include <sys/types.h>
 #include <sys/time.h>
@@ -19,10 +23,67 @@
 #include <sys/un.h>
 #include <sys/uio.h>
 #include <sys/epoll.h>
+#include <sys/queue.h>
 #include <getopt.h>
 #include <pwd.h>
 
+#include "config.h"
 #include "protocol.h"
+#include "users.h"
+#include "event.h"
+#include "subscribe.h"
+
+extern struct config config;
+
+/* Must hold the largest batch request */
+#define CLIENT_INBUF 16384
+/* Stop reading from a client while this much of its output is unsent */
+#define CLIENT_OUTMAX (1024 * 1024)
+/* Output buffers above this are not kept when a client is recycled */
+#define CLIENT_OUTKEEP 4096
+/* Most changes sent to a subscriber in one frame */
+#define CLIENT_EVENTS 256
+/* Largest message sent on a seqpacket socket, within the default socket
+ * buffer. Lists are cut short to fit, the cursor picks up the rest */
+#define CLIENT_MSGMAX 65536
+/* Room to leave for the largest request message on a seqpacket socket */
+#define CLIENT_REQMAX (FRAME_HEADER_LEN + sizeof(uint32_t) + PORT_BATCH_MAX * FRAME_ENTRY_LEN)
+
+/* Per connection state */
+struct client {
+  int fd;
+  int closing;
+  /* The client shut down its side, answer what it sent then close */
+  int eof;
+  int have_cred;
+  struct ucred cred;
+  /* One frame per message, credentials taken at accept */
+  int seqpacket;
+  uint64_t idle_timer;
+  time_t last_active;
+  /* Descriptors sent along with the output byte at passoff */
+  int passfds[2];
+  int npassfds;
+  size_t passoff;
+  /* A descriptor the client passed for PORT_RETURN, -1 if none */
+  int recvfd;
+  /* Set once the client subscribed to changes */
+  struct subscriber *sub;
+  char in[CLIENT_INBUF];
+  size_t inlen;
+  char *out;
+  size_t outlen;
+  size_t outoff;
+  size_t outcap;
+  SLIST_ENTRY(client) free;
+};
+
+/* Finished clients are recycled by the thread that served them */
+static __thread SLIST_HEAD(client_free_head, client) client_pool =
+  SLIST_HEAD_INITIALIZER(client_pool);
+
+static void client_idle(void *data);
+static int client_update(struct client *c);
 
 static inline void fill_request_vector(
     struct port_request *pr,
@@ -44,110 +105,1015 @@ static inline void fill_request_vector(
   vec[6].iov_len = sizeof(pr->error);  
 }
 
-static void handle_request(
-    int fd,
-    struct ucred *uc,
+/* Requests arrive as packed host-endian fields in the order of the vector */
+static void unpack_request(
+    const char *buf,
     struct port_request *pr)
 {
+  struct iovec vec[7];
+  int i;
+
+  fill_request_vector(pr, vec);
+  for (i=0; i < 7; i++) {
+    memcpy(vec[i].iov_base, buf, vec[i].iov_len);
+    buf += vec[i].iov_len;
+  }
+}
+
+
+static inline time_t client_now(
+    void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+
+/* Reclaim output space already sent */
+static inline void client_compact(
+    struct client *c)
+{
+  if (c->outoff == c->outlen) {
+    c->outoff = c->outlen = 0;
+    c->passoff = 0;
+  }
+}
+
+
+/* Makes room for len more bytes of output, returning where they go */
+static char *client_reserve(
+    struct client *c,
+    size_t len)
+{
+  char *out;
+  size_t cap;
+
+  client_compact(c);
+
+  if (c->outlen + len > c->outcap) {
+    cap = c->outcap ? c->outcap : CLIENT_OUTKEEP;
+    while (cap < c->outlen + len)
+      cap *= 2;
+    out = realloc(c->out, cap);
+    if (!out)
+      return NULL;
+    c->out = out;
+    c->outcap = cap;
+  }
+
+  out = c->out + c->outlen;
+  c->outlen += len;
+  return out;
+}
+
+
+/* Appends to the pending output of a client */
+static int client_queue(
+    struct client *c,
+    const void *buf,
+    size_t len)
+{
+  char *out = client_reserve(c, len);
+
+  if (!out)
+    return -1;
+  memcpy(out, buf, len);
+  return 0;
+}
+
+
+/* Queues the reply to a request in the version it was made in. items are
+ * the portinfo of a PORT_LIST or the errors of a PORT_BATCH, cursor is
+ * where a PORT_LIST carries on from */
+static void client_reply(
+    struct client *c,
+    int version,
+    uint16_t opcode,
+    int error,
+    uint32_t count,
+    const void *items,
+    uint32_t cursor)
+{
+  const struct portinfo *pi = items;
+  const int *errors = items;
   struct port_response resp;
-  struct portinfo *pi = NULL;
-  int len;
+  size_t len, size = 0;
+  char *p;
+  uint32_t i;
 
-  if (uc->pid == 0)
+  if (opcode == PORT_LIST)
+    size = version == 1 ? sizeof(*pi) : FRAME_ENTRY_LEN;
+  else if (opcode == PORT_BATCH)
+    size = version == 1 ? sizeof(*errors) : sizeof(uint32_t);
+  if (!items)
+    size = 0;
+
+  if (version == 1) {
+    /* portslen cannot say any more */
+    if (count > UINT16_MAX) {
+      error = E2BIG;
+      count = 0;
+    }
+    memset(&resp, 0, sizeof(resp));
+    resp.error = abs(error);
+    resp.portslen = count;
+    if (client_queue(c, &resp, sizeof(resp)) < 0
+        || client_queue(c, items, size * count) < 0)
+      c->closing = 1;
+    return;
+  }
+
+  len = FRAME_REPLY_LEN + size * count;
+  if (opcode == PORT_LIST)
+    len += sizeof(cursor);
+  p = client_reserve(c, FRAME_HEADER_LEN + len);
+  if (!p) {
+    c->closing = 1;
     return;
+  }
+
+  p = frame_put_header(p, opcode, len);
+  p = frame_put32(p, abs(error));
+  p = frame_put32(p, count);
+  for (i=0; size && i < count; i++) {
+    if (opcode == PORT_LIST)
+      p = frame_put_entry(p, pi[i].uid, pi[i].port, pi[i].status, pi[i].dont_reacquire);
+    else
+      p = frame_put32(p, errors[i]);
+  }
+  if (opcode == PORT_LIST)
+    frame_put32(p, cursor);
+}
+
+
+/* Entries of the batch being handled, kept off the stack */
+static __thread struct port_batch_entry batch_entries[PORT_BATCH_MAX];
+static __thread int batch_errors[PORT_BATCH_MAX];
+/* Filters of the PORT_LIST being handled */
+static __thread struct port_query list_query;
+/* Generation a PORT_CHANGES asks about and its epoch, 0 if not given */
+static __thread uint64_t changes_since;
+static __thread uint64_t changes_epoch;
+/* End of the range a PORT_RESERVE or PORT_RELEASE asks for, 0 for one port */
+static __thread uint16_t range_last;
+/* Changes being sent to a subscriber */
+static __thread struct port_event events[CLIENT_EVENTS];
+
+static void handle_batch(
+    struct client *c,
+    struct ucred *uc,
+    int version,
+    uint32_t count)
+{
+  int error;
+  uint32_t i;
+
+  /* Users may only batch operations on themselves */
+  for (i=0; i < count; i++) {
+    batch_errors[i] = 0;
+    if (batch_entries[i].uid != uc->uid && uc->uid != 0)
+      batch_errors[i] = -EPERM;
+  }
 
-  if (pr->magic != MAGIC)
+  error = users_port_batch(batch_entries, count, batch_errors);
+  if (error) {
+    client_reply(c, version, PORT_BATCH, error, 0, NULL, 0);
     return;
+  }
 
-  memset(&resp, 0, sizeof(resp));
+  for (i=0; i < count; i++)
+    batch_errors[i] = abs(batch_errors[i]);
+  client_reply(c, version, PORT_BATCH, 0, count, batch_errors, 0);
+}
 
-  switch(pr->request) {
+
+/* Attaches descriptors to the next output queued, we take ownership */
+static void client_pass_fds(
+    struct client *c,
+    int *fds,
+    int n)
+{
+  assert(c->npassfds == 0 && n <= 2);
+  client_compact(c);
+  memcpy(c->passfds, fds, n * sizeof(*fds));
+  c->npassfds = n;
+  c->passoff = c->outlen;
+}
+
+
+static void client_reply_changes(
+    struct client *c,
+    struct port_change *ch,
+    uint32_t count,
+    uint64_t gen,
+    uint64_t epoch,
+    int full)
+{
+  size_t len, max;
+  uint32_t flags = full ? CHANGES_FULL : 0;
+  char *p;
+  uint32_t i;
+
+  /* A message holds what it can, the rest is asked for from the last
+   * generation in it. The ports of a user share a generation, so they are
+   * not split between messages */
+  if (c->seqpacket) {
+    max = (CLIENT_MSGMAX - FRAME_HEADER_LEN - FRAME_REPLY_LEN - sizeof(gen) - sizeof(flags)
+           - sizeof(epoch)) / FRAME_CHANGE_LEN;
+    if (count > max) {
+      count = max;
+      while (ch[count - 1].generation == ch[count].generation)
+        count--;
+      gen = ch[count - 1].generation;
+      flags |= CHANGES_MORE;
+    }
+  }
+  len = FRAME_REPLY_LEN + count * FRAME_CHANGE_LEN + sizeof(gen) + sizeof(flags) + sizeof(epoch);
+
+  p = client_reserve(c, FRAME_HEADER_LEN + len);
+  if (!p) {
+    c->closing = 1;
+    return;
+  }
+
+  p = frame_put_header(p, PORT_CHANGES, len);
+  p = frame_put32(p, 0);
+  p = frame_put32(p, count);
+  for (i=0; i < count; i++)
+    p = frame_put_change(p, &ch[i]);
+  p = frame_put64(p, gen);
+  p = frame_put32(p, flags);
+  frame_put64(p, epoch);
+}
+
+
+static void client_reply_ready(
+    struct client *c)
+{
+  size_t len = FRAME_REPLY_LEN + FRAME_READY_LEN;
+  uint32_t bound, total;
+  char *p;
+  int state;
+
+  state = users_ready(&bound, &total);
+  p = client_reserve(c, FRAME_HEADER_LEN + len);
+  if (!p) {
+    c->closing = 1;
+    return;
+  }
+
+  p = frame_put_header(p, PORT_READY, len);
+  p = frame_put32(p, 0);
+  p = frame_put32(p, 0);
+  p = frame_put32(p, state);
+  p = frame_put32(p, bound);
+  frame_put32(p, total);
+}
+
+
+/* Queues changes for a subscriber while its output has room */
+static void client_push_events(
+    struct client *c)
+{
+  char *p;
+  int i, n;
+
+  while (c->sub && !c->closing && c->outlen - c->outoff <= CLIENT_OUTMAX) {
+    n = subscribe_take(c->sub, events, CLIENT_EVENTS);
+    if (n == 0)
+      break;
+
+    p = client_reserve(c, FRAME_HEADER_LEN + FRAME_REPLY_LEN + n * FRAME_EVENT_LEN);
+    if (!p) {
+      c->closing = 1;
+      break;
+    }
+    p = frame_put_header(p, PORT_EVENT, FRAME_REPLY_LEN + n * FRAME_EVENT_LEN);
+    p = frame_put32(p, 0);
+    p = frame_put32(p, n);
+    for (i=0; i < n; i++)
+      p = frame_put_event(p, &events[i]);
+  }
+}
+
+
+/* Called by the event loop when changes are waiting for a subscriber */
+static int client_notify(
+    int fd,
+    int event,
+    void *data)
+{
+  struct client *c = data;
+
+  if (client_update(c) < 0)
+    event_del_fd(c->fd);
+  return 0;
+}
+
+
+static int client_subscribe(
+    struct client *c,
+    uid_t uid)
+{
+  struct subscriber *sub;
+
+  if (c->sub)
+    return EALREADY;
+
+  sub = subscribe_add(uid);
+  if (!sub)
+    return ENOMEM;
+
+  if (event_add_fd(subscribe_fd(sub), client_notify, NULL, c, EPOLLIN) < 0) {
+    subscribe_del(sub);
+    return ENOMEM;
+  }
+  c->sub = sub;
+
+  /* Subscribers are expected to sit quietly */
+  event_timer_del(c->idle_timer);
+  c->idle_timer = 0;
+  return 0;
+}
+
+
+static void handle_request(
+    struct client *c,
+    struct ucred *uc,
+    int version,
+    uint16_t opcode,
+    struct portinfo *req,
+    uint32_t count)
+{
+  struct portinfo *pi = NULL;
+  struct port_change *ch = NULL;
+  uint64_t gen, epoch;
+  uid_t next;
+  int fds[2];
+  int error, full;
+
+  if (uc->pid == 0)
+    return;
+
+  switch(opcode) {
     case PORT_RESERVE:
-      if (pr->pi.uid != uc->uid && uc->uid != 0) {
-        resp.error = EPERM;
+      if (req->uid != uc->uid && uc->uid != 0) {
+        error = EPERM;
         break;
       }
-      resp.error = users_port_request(pr->pi.uid, pr->pi.port);
+      error = users_port_request(req->uid, req->port, version == 1 ? 0 : range_last);
     break;
 
     case PORT_RELEASE:
-      if (pr->pi.uid != uc->uid && uc->uid != 0) {
-        resp.error = EPERM;
+      if (req->uid != uc->uid && uc->uid != 0) {
+        error = EPERM;
         break;
       }
-      resp.error = users_port_release(pr->pi.uid, pr->pi.port);
+      error = users_port_release(req->uid, req->port, version == 1 ? 0 : range_last);
     break;
 
     case PORT_RQPOLICY:
-      if (pr->pi.uid != uc->uid && uc->uid != 0) {
-        resp.error = EPERM;
+      if (req->uid != uc->uid && uc->uid != 0) {
+        error = EPERM;
         break;
       }
-      resp.error = users_port_acquire_policy(pr->pi.uid, pr->pi.dont_reacquire);
+      error = users_port_acquire_policy(req->uid, req->dont_reacquire);
+    break;
+
+    case PORT_BATCH:
+      handle_batch(c, uc, version, count);
+      return;
+
+    case PORT_SNAPSHOT:
+      error = users_snapshot_fds(uc->uid, fds);
+      if (error > 0) {
+        client_pass_fds(c, fds, error);
+        client_reply(c, version, opcode, 0, error, NULL, 0);
+        return;
+      }
+    break;
+
+    case PORT_SUBSCRIBE:
+      /* Pushing changes needs framing */
+      if (version == 1) {
+        error = EINVAL;
+        break;
+      }
+      error = client_subscribe(c, uc->uid);
+    break;
+
+    case PORT_CHANGES:
+      /* The whole table is needed to make sense of them */
+      if (version == 1 || uc->uid != 0) {
+        error = version == 1 ? EINVAL : EPERM;
+        break;
+      }
+      error = users_port_changes(changes_since, changes_epoch, &ch, &count, &gen, &epoch, &full);
+      if (error == 0) {
+        client_reply_changes(c, ch, count, gen, epoch, full);
+        free(ch);
+        return;
+      }
+    break;
+
+    case PORT_READY:
+      if (version == 1) {
+        error = EINVAL;
+        break;
+      }
+      client_reply_ready(c);
+      return;
+
+    case PORT_UPGRADE:
+      if (version == 1 || uc->uid != 0) {
+        error = version == 1 ? EINVAL : EPERM;
+        break;
+      }
+      /* Done from the main loop, whichever thread serves this client */
+      error = kill(getpid(), SIGUSR2) < 0 ? errno : 0;
+    break;
+
+    case PORT_CHECKOUT:
+      if (version == 1 || (req->uid != uc->uid && uc->uid != 0)) {
+        error = version == 1 ? EINVAL : EPERM;
+        break;
+      }
+      error = users_port_checkout(req->uid, req->port, fds);
+      if (error == 0) {
+        client_pass_fds(c, fds, 1);
+        client_reply(c, version, opcode, 0, 1, NULL, 0);
+        return;
+      }
+    break;
+
+    case PORT_RETURN:
+      if (version == 1 || (req->uid != uc->uid && uc->uid != 0)) {
+        error = version == 1 ? EINVAL : EPERM;
+        break;
+      }
+      if (c->recvfd < 0) {
+        error = EBADF;
+        break;
+      }
+      error = users_port_return(req->uid, req->port, c->recvfd);
+      c->recvfd = -1;
     break;
 
     case PORT_LIST:
-      resp.error = users_port_list(uc->uid, &pi, &resp.portslen);
-      if (resp.error == 0) {
-        if (send(fd, &resp, sizeof(resp), 0) < 0) {
-          free(pi);
-          return;
-        }
-        send(fd, pi, sizeof(pi) * resp.portslen, 0);
+      if (c->seqpacket) {
+        count = (CLIENT_MSGMAX - FRAME_HEADER_LEN - FRAME_REPLY_LEN - sizeof(uint32_t)) / FRAME_ENTRY_LEN;
+        /* Room for a user whose ports run over the limit */
+        count -= PORTS_USER_MAX + 1;
+        if (list_query.limit == 0 || list_query.limit > count)
+          list_query.limit = count;
+      }
+      error = users_port_query(uc->uid, &list_query, &pi, &count, &next);
+      if (error == 0) {
+        client_reply(c, version, opcode, 0, count, pi, next);
         free(pi);
         return;
       }
     break;
 
     default:
-      resp.error = EINVAL;
+      error = EINVAL;
     break; 
   }
 
-  resp.error = abs(resp.error);
-  send(fd, &resp, sizeof(resp), 0);
+  client_reply(c, version, opcode, error, 0, NULL, 0);
 }
 
-int decode_packet(
+/* Sends the output at passoff with its descriptors */
+static ssize_t client_send_fds(
+    struct client *c,
+    size_t len)
+{
+  char buf[CMSG_SPACE(sizeof(c->passfds))];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec vec;
+  ssize_t rc;
+
+  memset(&msg, 0, sizeof(msg));
+  memset(buf, 0, sizeof(buf));
+  vec.iov_base = c->out + c->outoff;
+  vec.iov_len = len;
+  msg.msg_iov = &vec;
+  msg.msg_iovlen = 1;
+  msg.msg_control = buf;
+  msg.msg_controllen = CMSG_SPACE(c->npassfds * sizeof(int));
+
+  cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(c->npassfds * sizeof(int));
+  memcpy(CMSG_DATA(cmsg), c->passfds, c->npassfds * sizeof(int));
+
+  rc = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+  if (rc < 0)
+    return rc;
+
+  /* The client has its own copies now */
+  while (c->npassfds > 0)
+    close(c->passfds[--c->npassfds]);
+  return rc;
+}
+
+
+/* Sends as much pending output as the socket takes */
+static int client_flush(
+    struct client *c)
+{
+  struct frame_header hdr;
+  ssize_t rc;
+  size_t len;
+
+  while (c->outoff < c->outlen) {
+    len = c->outlen - c->outoff;
+    /* Stop short of output carrying descriptors */
+    if (c->npassfds && c->outoff < c->passoff)
+      len = c->passoff - c->outoff;
+    /* Replies go out a frame per message, sent whole or not at all */
+    if (c->seqpacket) {
+      frame_get_header(c->out + c->outoff, &hdr);
+      len = FRAME_HEADER_LEN + hdr.length;
+    }
+
+    if (c->npassfds && c->outoff == c->passoff)
+      rc = client_send_fds(c, len);
+    else
+      rc = send(c->fd, c->out + c->outoff, len, MSG_NOSIGNAL);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      return -1;
+    }
+    c->outoff += rc;
+  }
+
+  return 0;
+}
+
+
+/* Handles a version 1 request at off. Returns its length, or 0 if it is
+ * incomplete or ended the connection */
+static int client_parse_v1(
+    struct client *c,
+    size_t off)
+{
+  struct port_request pr;
+  size_t len = PORT_REQUEST_LEN;
+  uint32_t count = 0;
+
+  if (c->inlen - off < len)
+    return 0;
+
+  memset(&pr, 0, sizeof(pr));
+  unpack_request(c->in + off, &pr);
+  memset(&list_query, 0, sizeof(list_query));
+
+  /* Batches carry their entries after the request */
+  if ((pr.request & ~PORT_PERSIST) == PORT_BATCH) {
+    if (c->inlen - off < len + sizeof(count))
+      return 0;
+    memcpy(&count, c->in + off + len, sizeof(count));
+
+    /* Bounds the time spent on one client, and our buffer */
+    if (count > PORT_BATCH_MAX) {
+      client_reply(c, 1, PORT_BATCH, E2BIG, 0, NULL, 0);
+      c->closing = 1;
+      return 0;
+    }
+
+    len += sizeof(count) + count * sizeof(struct port_batch_entry);
+    if (c->inlen - off < len)
+      return 0;
+    memcpy(batch_entries, c->in + off + PORT_REQUEST_LEN + sizeof(count),
+           count * sizeof(*batch_entries));
+  }
+
+  handle_request(c, &c->cred, 1, pr.request & ~PORT_PERSIST, &pr.pi, count);
+
+  /* A request without the persist flag is the last on the connection */
+  if ((pr.request & PORT_PERSIST) == 0)
+    c->closing = 1;
+  return len;
+}
+
+
+/* Handles a version 2 frame at off. Returns its length, or 0 if it is
+ * incomplete or ended the connection */
+static int client_parse_v2(
+    struct client *c,
+    size_t off)
+{
+  struct frame_header hdr;
+  struct portinfo pi;
+  const char *p = c->in + off;
+  uint32_t count = 0;
+  uint32_t i;
+
+  if (c->inlen - off < FRAME_HEADER_LEN)
+    return 0;
+  p = frame_get_header(p, &hdr);
+
+  /* Without knowing the framing we cannot find the next request */
+  if (hdr.version != FRAME_VERSION) {
+    client_reply(c, FRAME_VERSION, hdr.opcode, EPROTONOSUPPORT, 0, NULL, 0);
+    c->closing = 1;
+    return 0;
+  }
+  if (hdr.length > sizeof(c->in) - FRAME_HEADER_LEN) {
+    client_reply(c, FRAME_VERSION, hdr.opcode, E2BIG, 0, NULL, 0);
+    c->closing = 1;
+    return 0;
+  }
+  if (c->inlen - off < FRAME_HEADER_LEN + hdr.length)
+    return 0;
+
+  memset(&pi, 0, sizeof(pi));
+  memset(&list_query, 0, sizeof(list_query));
+  range_last = 0;
+  switch (hdr.opcode) {
+    case PORT_RESERVE:
+    case PORT_RELEASE:
+      if (hdr.length >= FRAME_ENTRY_LEN + sizeof(range_last))
+        frame_get16(p + FRAME_ENTRY_LEN, &range_last);
+      /* Fall through */
+    case PORT_RQPOLICY:
+    case PORT_CHECKOUT:
+    case PORT_RETURN:
+      if (hdr.length < FRAME_ENTRY_LEN)
+        goto invalid;
+      frame_get_portinfo(p, &pi);
+    break;
+
+    case PORT_BATCH:
+      if (hdr.length < sizeof(count))
+        goto invalid;
+      p = frame_get32(p, &count);
+      if (count > PORT_BATCH_MAX) {
+        client_reply(c, FRAME_VERSION, hdr.opcode, E2BIG, 0, NULL, 0);
+        goto out;
+      }
+      if (hdr.length < sizeof(count) + count * FRAME_ENTRY_LEN)
+        goto invalid;
+      for (i=0; i < count; i++)
+        p = frame_get_batch_entry(p, &batch_entries[i]);
+    break;
+
+    case PORT_LIST:
+      if (hdr.length >= FRAME_QUERY_LEN)
+        frame_get_query(p, &list_query);
+    break;
+
+    case PORT_CHANGES:
+      if (hdr.length < sizeof(changes_since))
+        goto invalid;
+      p = frame_get64(p, &changes_since);
+      changes_epoch = 0;
+      if (hdr.length >= sizeof(changes_since) + sizeof(changes_epoch))
+        frame_get64(p, &changes_epoch);
+    break;
+  }
+
+  handle_request(c, &c->cred, FRAME_VERSION, hdr.opcode, &pi, count);
+  goto out;
+
+invalid:
+  client_reply(c, FRAME_VERSION, hdr.opcode, EINVAL, 0, NULL, 0);
+out:
+  return FRAME_HEADER_LEN + hdr.length;
+}
+
+
+/* Handles every complete request sitting in the input buffer, in order.
+ * Returns 1 if requests are left waiting on output or descriptors to be sent */
+static int client_parse(
+    struct client *c)
+{
+  uint32_t magic;
+  size_t off = 0;
+  int len;
+  int rc = 0;
+
+  while (!c->closing && c->inlen - off >= sizeof(magic)) {
+    /* Leave the rest until the client catches up on its replies */
+    if (c->outlen - c->outoff > CLIENT_OUTMAX) {
+      rc = 1;
+      break;
+    }
+
+    /* Only one set of descriptors may be in flight */
+    if (c->npassfds) {
+      rc = 1;
+      break;
+    }
+
+    /* Each request says which version it is */
+    memcpy(&magic, c->in + off, sizeof(magic));
+    if (magic == MAGIC && !c->seqpacket)
+      len = client_parse_v1(c, off);
+    else if (le32toh(magic) == FRAME_MAGIC)
+      len = client_parse_v2(c, off);
+    else
+      /* A corrupt stream cannot be resynchronised */
+      return -1;
+
+    if (len == 0)
+      break;
+    off += len;
+  }
+
+  if (off) {
+    memmove(c->in, c->in + off, c->inlen - off);
+    c->inlen -= off;
+  }
+  return rc;
+}
+
+
+/* Keeps the first descriptor passed in a message for the request it came
+ * with, any others are closed. One still unused is replaced */
+static void client_take_fds(
+    struct client *c,
+    struct msghdr *msg)
+{
+  struct cmsghdr *cmsg;
+  int *fds;
+  int i, n, taken = 0;
+
+  for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    fds = (int *)CMSG_DATA(cmsg);
+    n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    for (i=0; i < n; i++) {
+      if (taken) {
+        close(fds[i]);
+        continue;
+      }
+      if (c->recvfd > -1)
+        close(c->recvfd);
+      c->recvfd = fds[i];
+      taken = 1;
+    }
+  }
+}
+
+
+/* Reads whatever the client has sent, picking up credentials on the way */
+static int client_recv(
+    struct client *c)
+{
+  char buf[CMSG_SPACE(sizeof(struct ucred)) + CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec vec;
+  ssize_t rc;
+
+  while (!c->eof && c->inlen < sizeof(c->in)) {
+    memset(&msg, 0, sizeof(msg));
+    vec.iov_base = c->in + c->inlen;
+    vec.iov_len = sizeof(c->in) - c->inlen;
+    msg.msg_iov = &vec;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = sizeof(buf);
+
+    rc = recvmsg(c->fd, &msg, MSG_CMSG_CLOEXEC);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      return -1;
+    }
+    if (rc == 0) {
+      c->eof = 1;
+      return 0;
+    }
+
+    /* Expect credentials */
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_CREDENTIALS
+          && cmsg->cmsg_len >= CMSG_LEN(sizeof(struct ucred))) {
+        memcpy(&c->cred, CMSG_DATA(cmsg), sizeof(c->cred));
+        c->have_cred = 1;
+      }
+    }
+    client_take_fds(c, &msg);
+
+    c->inlen += rc;
+  }
+
+  return 0;
+}
+
+
+/* Reads whole messages from a seqpacket client while there is room for the
+ * largest request, credentials were taken when it connected */
+static int client_recv_seqpacket(
+    struct client *c)
+{
+  char buf[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg;
+  struct iovec vec;
+  ssize_t rc;
+
+  while (!c->eof && sizeof(c->in) - c->inlen >= CLIENT_REQMAX) {
+    memset(&msg, 0, sizeof(msg));
+    vec.iov_base = c->in + c->inlen;
+    vec.iov_len = sizeof(c->in) - c->inlen;
+    msg.msg_iov = &vec;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = sizeof(buf);
+
+    rc = recvmsg(c->fd, &msg, MSG_TRUNC|MSG_CMSG_CLOEXEC);
+    if (rc < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 0;
+      return -1;
+    }
+    if (rc == 0) {
+      c->eof = 1;
+      return 0;
+    }
+
+    client_take_fds(c, &msg);
+
+    /* The kernel dropped what did not fit, we cannot recover from that */
+    if ((size_t)rc > sizeof(c->in) - c->inlen)
+      return -1;
+    c->inlen += rc;
+  }
+
+  return 0;
+}
+
+
+/* Works out what we want to hear about next, or if we are done */
+static int client_update(
+    struct client *c)
+{
+  int event = 0;
+
+  client_push_events(c);
+  if (client_flush(c) < 0)
+    return -1;
+
+  if (c->outoff < c->outlen)
+    event |= EPOLLOUT;
+  else if (c->closing)
+    return -1;
+
+  if (!c->closing && !c->eof && c->outlen - c->outoff <= CLIENT_OUTMAX)
+    event |= EPOLLIN;
+
+  return event_mod_event(c->fd, event);
+}
+
+
+static int client_read(
     int fd,
     int event,
     void *data)
 {
+  struct client *c = data;
   int rc;
-  char buf[64];
-  struct msghdr msg;
-  struct ucred *uc;
-  struct cmsghdr *cmsg = NULL;
-  struct port_request pr;
-  struct iovec vec[7];
 
-  if ((event & EPOLLERR) == EPOLLERR || (event & EPOLLHUP) == EPOLLHUP)
-     return -1;
+  if ((event & EPOLLERR) == EPOLLERR)
+    return -1;
 
-  memset(buf, 0, sizeof(buf));
-  memset(&msg, 0, sizeof(msg));
-  memset(&pr, 0, sizeof(pr));
-  memset(vec, 0, sizeof(vec));
-  fill_request_vector(&pr, vec);
+  c->last_active = client_now();
 
-  msg.msg_iov = vec;
-  msg.msg_iovlen = 7;
-  msg.msg_control = buf;
-  msg.msg_controllen = 64;
-  msg.msg_flags = 0;
-  
-  rc = recvmsg(fd, &msg, 0);
-  if (rc < 0) {
-    close(fd);
+  if (event & EPOLLOUT) {
+    if (client_flush(c) < 0)
+      return -1;
+  }
+
+  if (event & (EPOLLIN|EPOLLHUP)) {
+    if ((c->seqpacket ? client_recv_seqpacket(c) : client_recv(c)) < 0)
+      c->closing = 1;
+  }
+
+  /* Carry on once any descriptors have gone out */
+  while ((rc = client_parse(c)) > 0) {
+    if (client_flush(c) < 0)
+      return -1;
+    if (c->npassfds || c->outlen - c->outoff > CLIENT_OUTMAX)
+      break;
+  }
+  if (rc < 0)
     return -1;
+
+  /* Everything it sent before shutting down has been answered */
+  if (c->eof && rc == 0)
+    c->closing = 1;
+
+  return client_update(c);
+}
+
+
+/* Called by the event loop when the client is removed */
+static void client_destroy(
+    void *data)
+{
+  struct client *c = data;
+
+  event_timer_del(c->idle_timer);
+  if (c->sub) {
+    event_del_fd(subscribe_fd(c->sub));
+    subscribe_del(c->sub);
   }
+  close(c->fd);
+  while (c->npassfds > 0)
+    close(c->passfds[--c->npassfds]);
+  if (c->recvfd > -1)
+    close(c->recvfd);
+
+  if (c->outcap > CLIENT_OUTKEEP) {
+    free(c->out);
+    c->out = NULL;
+    c->outcap = 0;
+  }
+  SLIST_INSERT_HEAD(&client_pool, c, free);
+}
 
-  /* Expect credentials */
-  cmsg = CMSG_FIRSTHDR(&msg);
-  uc = (struct ucred *)CMSG_DATA(cmsg);
 
-  handle_request(fd, uc, &pr);
+/* Reclaims connections nobody is talking on */
+static void client_idle(
+    void *data)
+{
+  struct client *c = data;
+  time_t idle = client_now() - c->last_active;
+
+  c->idle_timer = 0;
+  if (idle >= config.idle_timeout) {
+    event_del_fd(c->fd);
+    return;
+  }
+
+  c->idle_timer = event_timer_add((config.idle_timeout - idle) * 1000, client_idle, c);
+}
+
+
+/* Starts serving an accepted, non-blocking client on this threads loop */
+int protocol_client_add(
+    int fd)
+{
+  struct client *c;
+  socklen_t credlen;
+  char *out;
+  size_t outcap;
+
+  if (!SLIST_EMPTY(&client_pool)) {
+    c = SLIST_FIRST(&client_pool);
+    SLIST_REMOVE_HEAD(&client_pool, free);
+  }
+  else {
+    c = malloc(sizeof(*c));
+    if (!c)
+      return -1;
+    c->out = NULL;
+    c->outcap = 0;
+  }
+
+  /* The output buffer survives recycling */
+  out = c->out;
+  outcap = c->outcap;
+  memset(c, 0, offsetof(struct client, in));
+  c->fd = fd;
+  c->inlen = 0;
+  c->out = out;
+  c->outcap = outcap;
+  c->outlen = c->outoff = 0;
+  c->recvfd = -1;
+  c->last_active = client_now();
+
+  /* Seqpacket clients are authenticated once, here */
+  if (config.socktype == SOCK_SEQPACKET) {
+    c->seqpacket = 1;
+    credlen = sizeof(c->cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &c->cred, &credlen) < 0) {
+      syslog(LOG_WARNING, "Cannot get client credentials: %s", strerror(errno));
+      SLIST_INSERT_HEAD(&client_pool, c, free);
+      return -1;
+    }
+    c->have_cred = 1;
+  }
+
+  if (event_add_fd(fd, client_read, client_destroy, c, EPOLLIN) < 0) {
+    SLIST_INSERT_HEAD(&client_pool, c, free);
+    return -1;
+  }
 
-  close(fd);
+  c->idle_timer = event_timer_add(config.idle_timeout * 1000, client_idle, c);
   return 0;
 }
@@ -1,11 +1,17 @@
 #ifndef _PROTOCOL_H_
 #define _PROTOCOL_H_
 
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
+
 #define MAGIC 0x504F5254
 
 #define STATUS_RESERVED 0
 #define STATUS_RELEASED 1
 #define STATUS_UNKNOWN  2
+/* Handed to the owner with PORT_CHECKOUT, the daemon no longer holds it */
+#define STATUS_CHECKED_OUT 3
 
 #define REACQUIRE_DO      0
 #define REACQUIRE_DONT    1
@@ -15,9 +21,32 @@
 #define PORT_RELEASE   1
 #define PORT_RQPOLICY  2
 #define PORT_LIST      3
+#define PORT_BATCH     4
+#define PORT_SNAPSHOT  5
+#define PORT_SUBSCRIBE 6
+/* Only used for frames pushed to subscribers */
+#define PORT_EVENT     7
+#define PORT_CHANGES   8
+#define PORT_READY     9
+#define PORT_UPGRADE   10
+#define PORT_CHECKOUT  11
+#define PORT_RETURN    12
 
 #define PORT_RQMIN 0
-#define PORT_RQMAX 3
+#define PORT_RQMAX 12
+
+/* Or'd into the request to keep the connection open afterwards. Further
+ * requests may then be sent back to back, replies come back in order. A
+ * client that shuts down its side still gets a reply to everything sent */
+#define PORT_PERSIST 0x80000000
+
+/* Size of a request on the wire, its fields are packed */
+#define PORT_REQUEST_LEN 20
+
+/* A PORT_BATCH request is followed by a uint32_t count and that many
+ * entries. The response carries the count in portslen followed by an int
+ * error for each entry, in order */
+#define PORT_BATCH_MAX 1024
 
 struct portinfo {
   uid_t uid;
@@ -26,6 +55,106 @@ struct portinfo {
   uint8_t dont_reacquire;
 };
 
+/* A PORT_SNAPSHOT response passes portslen read-only memfds with
+ * SCM_RIGHTS. The first holds the whole table, redacted unless the caller
+ * is root. Other callers with an entry get a second one holding just it,
+ * which goes stale once the entry is deleted.
+ *
+ * Each memfd is a header followed by capacity entries. Readers copy the
+ * entries out and retry while seq is odd or changed during the copy. Once
+ * stale is set the daemon stopped updating it and it must be requested
+ * again */
+#define SNAPSHOT_MAGIC 0x534E4150
+#define SNAPSHOT_VERSION 1
+
+struct port_snapshot_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t seq;
+  uint32_t capacity;
+  uint32_t stale;
+};
+
+#define SNAPSHOT_ENTRY_USED 1
+
+struct port_snapshot_entry {
+  struct portinfo pi;
+  uint32_t flags;
+};
+
+struct port_batch_entry {
+  uid_t uid;
+  uint16_t port;
+  uint8_t op;
+  uint8_t dont_reacquire;
+};
+
+/* A query narrowing down a PORT_LIST. Ranges are inclusive, the list is
+ * in uid order starting at cursor and holds at most limit entries, 0 for
+ * no limit. Status and policy only match entries the caller may see */
+#define QUERY_UID       0x01
+#define QUERY_PORT      0x02
+#define QUERY_STATUS    0x04
+#define QUERY_REACQUIRE 0x08
+/* Only users whose port was assigned rather than following their uid */
+#define QUERY_ASSIGNED  0x10
+
+struct port_query {
+  uint32_t flags;
+  uid_t uid_min;
+  uid_t uid_max;
+  uint16_t port_min;
+  uint16_t port_max;
+  uint8_t status;
+  uint8_t dont_reacquire;
+  uid_t cursor;
+  uint32_t limit;
+};
+
+/* Why an entry changed, see PORT_SUBSCRIBE */
+#define EVENT_ADDED      0
+#define EVENT_DELETED    1
+#define EVENT_RESERVED   2
+#define EVENT_RELEASED   3
+#define EVENT_POLICY     4
+#define EVENT_REACQUIRED 5
+/* Changes were dropped, the subscriber must list the table again */
+#define EVENT_RESYNC     6
+#define EVENT_CHECKOUT   7
+#define EVENT_RETURN     8
+
+struct port_event {
+  uid_t uid;
+  uint16_t port;
+  uint8_t old_status;
+  uint8_t new_status;
+  uint8_t reason;
+  uint8_t dont_reacquire;
+};
+
+/* An entry of a PORT_CHANGES reply. Every change to the table gets the next
+ * generation, which the user and each of its extra ports are listed with. A
+ * deleted user or extra port comes back as a tombstone */
+#define CHANGE_DELETED 0x1
+/* The reply holds every entry, anything not in it is gone. Also set when
+ * the generation asked about came from another epoch, as after a restart */
+#define CHANGES_FULL   0x1
+/* Only part of the changes fit, ask again from the generation given for
+ * the rest. A full listing goes on in the replies that follow */
+#define CHANGES_MORE   0x2
+
+struct port_change {
+  struct portinfo pi;
+  uint32_t flags;
+  uint64_t generation;
+};
+
+/* State in a PORT_READY reply. While warming the daemon serves requests
+ * but some ports are not bound yet, a request for a user binds its port
+ * first */
+#define READY_WARMING 0
+#define READY_DONE    1
+
 struct port_request {
   uint32_t magic;
   uint32_t request;
@@ -38,5 +167,298 @@ struct port_response {
   uint16_t portslen;
 };
 
-int decode_packet(int fd, int event, void *data);
+/* Version 2 framing. Every request and reply is a header followed by
+ * length bytes of payload, all fields packed and little-endian. Replies
+ * carry the opcode of their request and come back in order, the
+ * connection stays open until the client closes it.
+ *
+ * Request payloads:
+ *   PORT_RESERVE, PORT_RELEASE                 a portinfo, optionally
+ *                                              followed by a uint16 last
+ *                                              port of a range
+ *   PORT_RQPOLICY                              a portinfo
+ *   PORT_CHECKOUT, PORT_RETURN                 a portinfo
+ *   PORT_BATCH                                 a uint32 count, then count
+ *                                              port_batch_entry
+ *   PORT_LIST                                  empty, or a port_query
+ *   PORT_SNAPSHOT, PORT_SUBSCRIBE, PORT_READY  empty
+ *   PORT_UPGRADE                               empty
+ *   PORT_CHANGES                               a uint64 generation,
+ *                                              optionally followed by the
+ *                                              uint64 epoch it came with
+ *
+ * Reply payloads are an int32 error and a uint32 count, followed by count
+ * portinfo for PORT_LIST or count int32 errors for PORT_BATCH. A
+ * PORT_LIST reply ends with a uint32 cursor to ask for the rest with, 0
+ * when there is no more. A PORT_CHANGES reply holds count port_change
+ * made after the generation asked for, oldest first, and ends with the
+ * current uint64 generation, uint32 flags and the uint64 epoch of the
+ * daemon. On a seqpacket socket a reply that would not fit a message
+ * stops short with CHANGES_MORE set, and the generation is that of the
+ * last change in it. It is only open to root. A PORT_READY reply ends with a uint32
+ * state, then the uint32 number of users bound so far and the uint32
+ * number found at startup. A PORT_UPGRADE reply says the daemon is about
+ * to hand over to a new process, which picks up queued requests once it
+ * has. It is only open to root. A PORT_SNAPSHOT reply passes count
+ * descriptors.
+ *
+ * A PORT_CHECKOUT reply passes the bound socket of a reserved port to its
+ * owner, who may listen on it straight away. The daemon lets go of its own
+ * copy and the port shows as STATUS_CHECKED_OUT, it is not re-acquired
+ * while the owner may still hold it. PORT_RETURN hands a socket bound to
+ * the wildcard address and port of a released or checked out entry back,
+ * passed with SCM_RIGHTS along with the request. A listening socket is
+ * shut down so connections are refused rather than left queued, the port
+ * stays bound throughout. Neither is open to version 1.
+ *
+ * Users may hold extra ports besides the one at port_offset + uid, listed
+ * in the ports file. PORT_RESERVE and PORT_RELEASE act on the port given,
+ * 0 being the users own, or on every port up to the last one given, which
+ * must all be the users. A list has an entry for each port of a user and
+ * never splits a user between pages. PORT_SNAPSHOT, PORT_CHANGES, saved
+ * state and checkouts only cover the users own port, extra ports come
+ * back reserved after a restart.
+ *
+ * A users own port is port_offset + uid, unless that is past the last port
+ * or taken. Such users are assigned a free port instead, which they keep
+ * across restarts. QUERY_ASSIGNED lists them. Unless the daemon is told
+ * otherwise, assigned ports come from the ports of system uids, so one
+ * never takes the port a user added later maps to.
+ * Payloads longer than expected are accepted, the remainder is ignored.
+ *
+ * After PORT_SUBSCRIBE succeeds, PORT_EVENT frames are pushed in between
+ * replies whenever an entry changes. They are laid out as a reply with
+ * count port_event. Changes to other users are redacted as in a list,
+ * and only their additions and deletions are sent. A subscriber that
+ * falls behind gets an EVENT_RESYNC in place of what it missed.
+ *
+ * Requests starting with MAGIC are read as version 1 */
+#define FRAME_MAGIC 0x32504B42
+#define FRAME_VERSION 2
+#define FRAME_HEADER_LEN 12
+/* A portinfo or port_batch_entry on the wire */
+#define FRAME_ENTRY_LEN 8
+/* Size of the error and count at the start of a reply */
+#define FRAME_REPLY_LEN 8
+/* A port_query on the wire */
+#define FRAME_QUERY_LEN 28
+/* A port_event on the wire */
+#define FRAME_EVENT_LEN 12
+/* A port_change on the wire */
+#define FRAME_CHANGE_LEN 20
+/* The state and counts ending a PORT_READY reply */
+#define FRAME_READY_LEN 12
+
+struct frame_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t opcode;
+  uint32_t length;
+};
+
+static inline char *frame_put16(
+    char *p,
+    uint16_t v)
+{
+  v = htole16(v);
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+static inline char *frame_put32(
+    char *p,
+    uint32_t v)
+{
+  v = htole32(v);
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+static inline const char *frame_get16(
+    const char *p,
+    uint16_t *v)
+{
+  memcpy(v, p, sizeof(*v));
+  *v = le16toh(*v);
+  return p + sizeof(*v);
+}
+
+static inline const char *frame_get32(
+    const char *p,
+    uint32_t *v)
+{
+  memcpy(v, p, sizeof(*v));
+  *v = le32toh(*v);
+  return p + sizeof(*v);
+}
+
+static inline char *frame_put64(
+    char *p,
+    uint64_t v)
+{
+  v = htole64(v);
+  memcpy(p, &v, sizeof(v));
+  return p + sizeof(v);
+}
+
+static inline const char *frame_get64(
+    const char *p,
+    uint64_t *v)
+{
+  memcpy(v, p, sizeof(*v));
+  *v = le64toh(*v);
+  return p + sizeof(*v);
+}
+
+static inline char *frame_put_header(
+    char *p,
+    uint16_t opcode,
+    uint32_t length)
+{
+  p = frame_put32(p, FRAME_MAGIC);
+  p = frame_put16(p, FRAME_VERSION);
+  p = frame_put16(p, opcode);
+  return frame_put32(p, length);
+}
+
+static inline const char *frame_get_header(
+    const char *p,
+    struct frame_header *hdr)
+{
+  p = frame_get32(p, &hdr->magic);
+  p = frame_get16(p, &hdr->version);
+  p = frame_get16(p, &hdr->opcode);
+  return frame_get32(p, &hdr->length);
+}
+
+/* Batch entries share the layout of a portinfo */
+static inline char *frame_put_entry(
+    char *p,
+    uint32_t uid,
+    uint16_t port,
+    uint8_t a,
+    uint8_t b)
+{
+  p = frame_put32(p, uid);
+  p = frame_put16(p, port);
+  *p++ = a;
+  *p++ = b;
+  return p;
+}
+
+static inline const char *frame_get_portinfo(
+    const char *p,
+    struct portinfo *pi)
+{
+  uint32_t uid;
+
+  p = frame_get32(p, &uid);
+  p = frame_get16(p, &pi->port);
+  pi->uid = uid;
+  pi->status = *p++;
+  pi->dont_reacquire = *p++;
+  return p;
+}
+
+static inline const char *frame_get_batch_entry(
+    const char *p,
+    struct port_batch_entry *e)
+{
+  uint32_t uid;
+
+  p = frame_get32(p, &uid);
+  p = frame_get16(p, &e->port);
+  e->uid = uid;
+  e->op = *p++;
+  e->dont_reacquire = *p++;
+  return p;
+}
+
+static inline char *frame_put_query(
+    char *p,
+    const struct port_query *q)
+{
+  p = frame_put32(p, q->flags);
+  p = frame_put32(p, q->uid_min);
+  p = frame_put32(p, q->uid_max);
+  p = frame_put16(p, q->port_min);
+  p = frame_put16(p, q->port_max);
+  *p++ = q->status;
+  *p++ = q->dont_reacquire;
+  p = frame_put16(p, 0);
+  p = frame_put32(p, q->cursor);
+  return frame_put32(p, q->limit);
+}
+
+static inline const char *frame_get_query(
+    const char *p,
+    struct port_query *q)
+{
+  uint32_t v;
+  uint16_t pad;
+
+  p = frame_get32(p, &q->flags);
+  p = frame_get32(p, &v);
+  q->uid_min = v;
+  p = frame_get32(p, &v);
+  q->uid_max = v;
+  p = frame_get16(p, &q->port_min);
+  p = frame_get16(p, &q->port_max);
+  q->status = *p++;
+  q->dont_reacquire = *p++;
+  p = frame_get16(p, &pad);
+  p = frame_get32(p, &v);
+  q->cursor = v;
+  return frame_get32(p, &q->limit);
+}
+
+static inline char *frame_put_event(
+    char *p,
+    const struct port_event *ev)
+{
+  p = frame_put32(p, ev->uid);
+  p = frame_put16(p, ev->port);
+  *p++ = ev->old_status;
+  *p++ = ev->new_status;
+  *p++ = ev->reason;
+  *p++ = ev->dont_reacquire;
+  return frame_put16(p, 0);
+}
+
+static inline const char *frame_get_event(
+    const char *p,
+    struct port_event *ev)
+{
+  uint32_t uid;
+  uint16_t pad;
+
+  p = frame_get32(p, &uid);
+  p = frame_get16(p, &ev->port);
+  ev->uid = uid;
+  ev->old_status = *p++;
+  ev->new_status = *p++;
+  ev->reason = *p++;
+  ev->dont_reacquire = *p++;
+  return frame_get16(p, &pad);
+}
+
+static inline char *frame_put_change(
+    char *p,
+    const struct port_change *ch)
+{
+  p = frame_put_entry(p, ch->pi.uid, ch->pi.port, ch->pi.status, ch->pi.dont_reacquire);
+  p = frame_put32(p, ch->flags);
+  return frame_put64(p, ch->generation);
+}
+
+static inline const char *frame_get_change(
+    const char *p,
+    struct port_change *ch)
+{
+  p = frame_get_portinfo(p, &ch->pi);
+  p = frame_get32(p, &ch->flags);
+  return frame_get64(p, &ch->generation);
+}
+
+int protocol_client_add(int fd);
 #endif
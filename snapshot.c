@@ -0,0 +1,367 @@
+/* Shared memory copies of the reservation table. Clients map these read-only
+ * and read the table without asking us, we keep them current as entries
+ * change. Writers hold snaplock, readers use the sequence counter */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include "protocol.h"
+#include "users.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_MINCAP 1024
+#define SELF_BUCKETS 256
+
+struct snapshot {
+  int fd;
+  size_t size;
+  struct port_snapshot_header *hdr;
+  struct port_snapshot_entry *entries;
+};
+
+/* A single entry view for a user that is not root */
+struct self_view {
+  uid_t uid;
+  struct snapshot snap;
+  struct self_view *next;
+};
+
+static pthread_mutex_t snaplock = PTHREAD_MUTEX_INITIALIZER;
+static int enabled = 0;
+static struct snapshot public_view;
+static struct snapshot full_view;
+static struct self_view *selfs[SELF_BUCKETS];
+
+/* Slot allocation */
+static uint32_t nextslot = 0;
+static int *freeslots = NULL;
+static int nfree = 0;
+static int freecap = 0;
+
+
+static int snapshot_create(
+    struct snapshot *s,
+    uint32_t capacity)
+{
+  s->size = sizeof(*s->hdr) + capacity * sizeof(*s->entries);
+  s->hdr = MAP_FAILED;
+
+  s->fd = memfd_create("bookkeeper", MFD_CLOEXEC|MFD_ALLOW_SEALING);
+  if (s->fd < 0)
+    goto fail;
+
+  if (ftruncate(s->fd, s->size) < 0)
+    goto fail;
+
+  s->hdr = mmap(NULL, s->size, PROT_READ|PROT_WRITE, MAP_SHARED, s->fd, 0);
+  if (s->hdr == MAP_FAILED)
+    goto fail;
+
+  /* Only our existing mapping may write, and the size is fixed for readers */
+  if (fcntl(s->fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_FUTURE_WRITE|F_SEAL_SEAL) < 0)
+    goto fail;
+
+  s->entries = (struct port_snapshot_entry *)(s->hdr + 1);
+  s->hdr->magic = SNAPSHOT_MAGIC;
+  s->hdr->version = SNAPSHOT_VERSION;
+  s->hdr->seq = 0;
+  s->hdr->capacity = capacity;
+  s->hdr->stale = 0;
+  return 0;
+
+fail:
+  syslog(LOG_WARNING, "Cannot create table snapshot: %s", strerror(errno));
+  if (s->hdr != MAP_FAILED)
+    munmap(s->hdr, s->size);
+  if (s->fd >= 0)
+    close(s->fd);
+  s->fd = -1;
+  return -1;
+}
+
+
+static void snapshot_destroy(
+    struct snapshot *s)
+{
+  munmap(s->hdr, s->size);
+  close(s->fd);
+  s->fd = -1;
+}
+
+
+/* Brackets a change, readers retry while seq is odd or has moved */
+static inline void snapshot_write_begin(
+    struct snapshot *s)
+{
+  __atomic_store_n(&s->hdr->seq, s->hdr->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void snapshot_write_end(
+    struct snapshot *s)
+{
+  __atomic_store_n(&s->hdr->seq, s->hdr->seq + 1, __ATOMIC_RELEASE);
+}
+
+
+/* Fills an entry, with the same redaction users_port_list applies */
+static void snapshot_fill(
+    struct port_snapshot_entry *e,
+    struct reserved_port *rp,
+    int redact)
+{
+  e->pi.uid = rp->uid;
+  e->pi.port = rp->port;
+  if (redact) {
+    e->pi.status = STATUS_UNKNOWN;
+    e->pi.dont_reacquire = REACQUIRE_UNKNOWN;
+  }
+  else {
+    e->pi.status = users_status(rp);
+    e->pi.dont_reacquire = rp->dont_reacquire;
+  }
+  e->flags = SNAPSHOT_ENTRY_USED;
+}
+
+
+static struct self_view * snapshot_self(
+    uid_t uid)
+{
+  struct self_view *sv;
+
+  for (sv = selfs[uid % SELF_BUCKETS]; sv != NULL; sv = sv->next) {
+    if (sv->uid == uid)
+      return sv;
+  }
+  return NULL;
+}
+
+
+/* Replaces a view with a larger copy, marking the old one stale */
+static int snapshot_grow_view(
+    struct snapshot *s,
+    uint32_t capacity)
+{
+  struct snapshot n;
+
+  if (snapshot_create(&n, capacity) < 0)
+    return -1;
+
+  memcpy(n.entries, s->entries, s->hdr->capacity * sizeof(*s->entries));
+  snapshot_write_begin(s);
+  s->hdr->stale = 1;
+  snapshot_write_end(s);
+  snapshot_destroy(s);
+  *s = n;
+  return 0;
+}
+
+
+static int snapshot_slot_alloc(
+    void)
+{
+  if (nfree)
+    return freeslots[--nfree];
+
+  /* Either view may have failed to grow last time */
+  if (public_view.hdr->capacity <= nextslot
+      && snapshot_grow_view(&public_view, nextslot * 2) < 0)
+    return -1;
+  if (full_view.hdr->capacity <= nextslot
+      && snapshot_grow_view(&full_view, nextslot * 2) < 0)
+    return -1;
+
+  return nextslot++;
+}
+
+
+static void snapshot_slot_free(
+    int slot)
+{
+  int *n;
+
+  if (nfree == freecap) {
+    freecap = freecap ? freecap * 2 : 64;
+    n = realloc(freeslots, freecap * sizeof(*n));
+    if (!n) {
+      /* The slot is lost, but the view remains correct */
+      freecap = nfree;
+      return;
+    }
+    freeslots = n;
+  }
+  freeslots[nfree++] = slot;
+}
+
+
+void snapshot_init(
+    void)
+{
+  if (snapshot_create(&public_view, SNAPSHOT_MINCAP) < 0)
+    return;
+  if (snapshot_create(&full_view, SNAPSHOT_MINCAP) < 0) {
+    snapshot_destroy(&public_view);
+    return;
+  }
+  enabled = 1;
+}
+
+
+/* Called with the users shard locked whenever an entry changes */
+void snapshot_update(
+    struct reserved_port *rp)
+{
+  struct self_view *sv;
+
+  if (!enabled)
+    return;
+
+  pthread_mutex_lock(&snaplock);
+  if (rp->snapslot < 0)
+    rp->snapslot = snapshot_slot_alloc();
+
+  if (rp->snapslot >= 0) {
+    snapshot_write_begin(&public_view);
+    snapshot_fill(&public_view.entries[rp->snapslot], rp, 1);
+    snapshot_write_end(&public_view);
+
+    snapshot_write_begin(&full_view);
+    snapshot_fill(&full_view.entries[rp->snapslot], rp, 0);
+    snapshot_write_end(&full_view);
+  }
+
+  sv = snapshot_self(rp->uid);
+  if (sv) {
+    snapshot_write_begin(&sv->snap);
+    snapshot_fill(&sv->snap.entries[0], rp, 0);
+    snapshot_write_end(&sv->snap);
+  }
+  pthread_mutex_unlock(&snaplock);
+}
+
+
+/* Takes the view of a users own entry away when the user goes, marking it
+ * stale for clients still holding it */
+static void snapshot_self_drop(
+    uid_t uid)
+{
+  struct self_view **svp, *sv;
+
+  for (svp = &selfs[uid % SELF_BUCKETS]; *svp != NULL; svp = &(*svp)->next) {
+    if ((*svp)->uid == uid)
+      break;
+  }
+  sv = *svp;
+  if (!sv)
+    return;
+
+  *svp = sv->next;
+  snapshot_write_begin(&sv->snap);
+  sv->snap.entries[0].flags = 0;
+  sv->snap.hdr->stale = 1;
+  snapshot_write_end(&sv->snap);
+  snapshot_destroy(&sv->snap);
+  free(sv);
+}
+
+
+void snapshot_remove(
+    struct reserved_port *rp)
+{
+  if (!enabled)
+    return;
+
+  pthread_mutex_lock(&snaplock);
+  snapshot_self_drop(rp->uid);
+  if (rp->snapslot < 0)
+    goto out;
+
+  snapshot_write_begin(&public_view);
+  public_view.entries[rp->snapslot].flags = 0;
+  snapshot_write_end(&public_view);
+
+  snapshot_write_begin(&full_view);
+  full_view.entries[rp->snapslot].flags = 0;
+  snapshot_write_end(&full_view);
+
+  snapshot_slot_free(rp->snapslot);
+  rp->snapslot = -1;
+
+out:
+  pthread_mutex_unlock(&snaplock);
+}
+
+
+/* Called with the users shard of uid locked, rp is NULL if the caller has
+ * no entry of their own */
+int snapshot_fds(
+    uid_t uid,
+    struct reserved_port *rp,
+    int fds[2])
+{
+  struct self_view *sv;
+  int n = 0;
+  int rc;
+
+  if (!enabled)
+    return -ENOSYS;
+
+  pthread_mutex_lock(&snaplock);
+  if (uid == 0) {
+    fds[n] = fcntl(full_view.fd, F_DUPFD_CLOEXEC, 0);
+    if (fds[n] < 0)
+      goto fail;
+    n++;
+    goto out;
+  }
+
+  fds[n] = fcntl(public_view.fd, F_DUPFD_CLOEXEC, 0);
+  if (fds[n] < 0)
+    goto fail;
+  n++;
+
+  /* Views of a users own entry are made the first time they ask and freed
+   * with the entry, so only users with an entry get one */
+  if (!rp)
+    goto out;
+  sv = snapshot_self(uid);
+  if (!sv) {
+    sv = malloc(sizeof(*sv));
+    if (!sv)
+      goto fail;
+    if (snapshot_create(&sv->snap, 1) < 0) {
+      free(sv);
+      goto fail;
+    }
+    sv->uid = uid;
+    sv->next = selfs[uid % SELF_BUCKETS];
+    selfs[uid % SELF_BUCKETS] = sv;
+    snapshot_fill(&sv->snap.entries[0], rp, 0);
+  }
+
+  fds[n] = fcntl(sv->snap.fd, F_DUPFD_CLOEXEC, 0);
+  if (fds[n] < 0)
+    goto fail;
+  n++;
+
+out:
+  pthread_mutex_unlock(&snaplock);
+  return n;
+
+fail:
+  rc = -errno;
+  pthread_mutex_unlock(&snaplock);
+  while (n > 0)
+    close(fds[--n]);
+  return rc;
+}
@@ -0,0 +1,12 @@
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+#include "users.h"
+
+void snapshot_init(void);
+/* Publishes the state of an entry, allocating it a slot on first use */
+void snapshot_update(struct reserved_port *rp);
+void snapshot_remove(struct reserved_port *rp);
+/* Duplicates the descriptors to pass to a client, returns how many */
+int snapshot_fds(uid_t uid, struct reserved_port *rp, int fds[2]);
+#endif
@@ -0,0 +1,698 @@
+/* Keeps the state of users across restarts. Every change is appended to a
+ * journal straight away so it survives the daemon crashing, and a thread
+ * makes a run of appends durable with one fdatasync. The journal is folded
+ * into a snapshot once it grows, which is mapped back in at startup */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "state.h"
+
+/* A record in either file. The files never leave the host so fields are in
+ * host order */
+/* Set in released alongside 1 for a port checked out, older files lack it */
+#define STATE_CHECKED_OUT 0x02
+
+struct state_disk {
+  uint32_t uid;
+  uint8_t released;
+  uint8_t dont_reacquire;
+  /* Was padding before ports were assigned, so zero in older files */
+  uint16_t port;
+  int64_t reacquire_time;
+  uint32_t check;
+  /* Was padding before extra ports were kept, so zero in older files */
+  uint16_t extra;
+  uint16_t pad2;
+};
+
+struct state_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t count;
+  uint32_t check;
+};
+
+#define SLOT_EMPTY 0
+#define SLOT_USED  1
+#define SLOT_GONE  2
+
+struct state_slot {
+  struct user_state st;
+  int used;
+};
+
+/* Guards everything below, taken with a shard lock held */
+static pthread_mutex_t state_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t state_cond = PTHREAD_COND_INITIALIZER;
+static int enabled = 0;
+static int statedir = -1;
+/* Closed while a successor takes the files over */
+static int jfd = -1;
+static pthread_t state_thread;
+static int stopping = 0;
+/* Records in the journal, and whether some are not yet durable */
+static unsigned long jrecords = 0;
+static int dirty = 0;
+
+/* Users not in the default state, open addressed by uid */
+static struct state_slot *map = NULL;
+static size_t mapcap = 0;
+static size_t mapused = 0;
+static size_t maplive = 0;
+
+static struct state_stats stats;
+
+
+static uint32_t state_check(
+    const void *data,
+    size_t len)
+{
+  const unsigned char *p = data;
+  uint32_t h = 0x811c9dc5;
+
+  while (len--) {
+    h ^= *p++;
+    h *= 0x01000193;
+  }
+  return h ^ STATE_MAGIC;
+}
+
+
+/* The extra port comes after the check, it is only folded in when set so
+ * that older records still pass */
+static uint32_t state_disk_check(
+    const struct state_disk *d)
+{
+  uint32_t h = state_check(d, offsetof(struct state_disk, check));
+
+  if (d->extra)
+    h = (h ^ d->extra) * 0x01000193;
+  return h;
+}
+
+
+static inline int state_default(
+    const struct user_state *st)
+{
+  return !st->released && !st->dont_reacquire && !st->port;
+}
+
+
+static size_t map_slot(
+    struct state_slot *m,
+    size_t cap,
+    uid_t uid,
+    uint16_t extra)
+{
+  size_t i = ((uid * 2654435761U) ^ (extra * 2246822519U)) & (cap - 1);
+  size_t gone = cap;
+
+  for (; m[i].used != SLOT_EMPTY; i = (i + 1) & (cap - 1)) {
+    if (m[i].used == SLOT_USED && m[i].st.uid == uid && m[i].st.extra == extra)
+      return i;
+    if (m[i].used == SLOT_GONE && gone == cap)
+      gone = i;
+  }
+  return gone != cap ? gone : i;
+}
+
+
+static int map_grow(
+    void)
+{
+  struct state_slot *m;
+  size_t cap = mapcap ? mapcap * 2 : 1024;
+  size_t i, j;
+
+  /* Mostly deleted slots, rehashing at the same size is enough */
+  if (mapcap && maplive * 4 < mapcap)
+    cap = mapcap;
+
+  m = calloc(cap, sizeof(*m));
+  if (!m)
+    return -1;
+
+  for (i=0; i < mapcap; i++) {
+    if (map[i].used != SLOT_USED)
+      continue;
+    j = map_slot(m, cap, map[i].st.uid, map[i].st.extra);
+    m[j] = map[i];
+  }
+
+  free(map);
+  map = m;
+  mapcap = cap;
+  mapused = maplive;
+  return 0;
+}
+
+
+/* Returns 1 if the map changed */
+static int map_set(
+    const struct user_state *st)
+{
+  size_t i;
+
+  if (mapused * 2 >= mapcap && map_grow() < 0) {
+    syslog(LOG_WARNING, "Cannot allocate memory for saved user state: %s", strerror(errno));
+    return 0;
+  }
+
+  i = map_slot(map, mapcap, st->uid, st->extra);
+  if (map[i].used == SLOT_USED) {
+    if (state_default(st)) {
+      map[i].used = SLOT_GONE;
+      maplive--;
+      return 1;
+    }
+    if (map[i].st.released == st->released && map[i].st.dont_reacquire == st->dont_reacquire
+        && map[i].st.reacquire_time == st->reacquire_time && map[i].st.port == st->port
+        && map[i].st.checked_out == st->checked_out)
+      return 0;
+    map[i].st = *st;
+    return 1;
+  }
+
+  if (state_default(st))
+    return 0;
+  if (map[i].used == SLOT_EMPTY)
+    mapused++;
+  map[i].st = *st;
+  map[i].used = SLOT_USED;
+  maplive++;
+  return 1;
+}
+
+
+static void state_pack(
+    struct state_disk *d,
+    const struct user_state *st)
+{
+  memset(d, 0, sizeof(*d));
+  d->uid = st->uid;
+  d->released = st->released ? 1 : 0;
+  if (st->released && st->checked_out)
+    d->released |= STATE_CHECKED_OUT;
+  d->dont_reacquire = st->dont_reacquire;
+  d->port = st->port;
+  d->reacquire_time = st->reacquire_time;
+  d->extra = st->extra;
+  d->check = state_disk_check(d);
+}
+
+
+static int state_unpack(
+    const struct state_disk *d,
+    struct user_state *st)
+{
+  if (d->check != state_disk_check(d))
+    return -1;
+
+  st->uid = d->uid;
+  st->released = d->released & 1;
+  st->dont_reacquire = d->dont_reacquire;
+  st->port = d->port;
+  st->reacquire_time = d->reacquire_time;
+  st->checked_out = st->released && (d->released & STATE_CHECKED_OUT);
+  st->extra = d->extra;
+  return 0;
+}
+
+
+/* Maps a file in, returning NULL with *len 0 when it is empty or missing */
+static void * state_map(
+    const char *name,
+    int fd,
+    size_t *len)
+{
+  struct stat st;
+  void *p;
+
+  *len = 0;
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size == 0)
+    return NULL;
+
+  p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (p == MAP_FAILED) {
+    syslog(LOG_WARNING, "Cannot map saved state %s: %s", name, strerror(errno));
+    return NULL;
+  }
+  *len = st.st_size;
+  return p;
+}
+
+
+static int state_load_snapshot(
+    void)
+{
+  const struct state_header *hdr;
+  const struct state_disk *d;
+  struct user_state st;
+  size_t len;
+  uint32_t i;
+  int fd, n = 0;
+  void *p;
+
+  fd = openat(statedir, STATE_SNAPSHOT, O_RDONLY|O_CLOEXEC);
+  if (fd < 0 && errno != ENOENT)
+    syslog(LOG_WARNING, "Cannot open saved state %s: %s", STATE_SNAPSHOT, strerror(errno));
+  p = state_map(STATE_SNAPSHOT, fd, &len);
+  if (fd > -1)
+    close(fd);
+  if (!p)
+    return 0;
+
+  hdr = p;
+  if (len < sizeof(*hdr) || hdr->magic != STATE_MAGIC || hdr->version < 1 || hdr->version > STATE_VERSION
+      || hdr->check != state_check(hdr, offsetof(struct state_header, check))
+      || (len - sizeof(*hdr)) / sizeof(*d) < hdr->count) {
+    syslog(LOG_WARNING, "Saved state %s is not valid, ignoring it", STATE_SNAPSHOT);
+    goto out;
+  }
+
+  d = (const struct state_disk *)(hdr + 1);
+  for (i=0; i < hdr->count; i++) {
+    if (state_unpack(&d[i], &st) < 0)
+      continue;
+    map_set(&st);
+    n++;
+  }
+
+out:
+  munmap(p, len);
+  return n;
+}
+
+
+/* Replays the journal, cutting off a record torn by a crash */
+static int state_load_journal(
+    void)
+{
+  const struct state_disk *d;
+  struct user_state st;
+  size_t len, i, n;
+  void *p;
+
+  p = state_map(STATE_JOURNAL, jfd, &len);
+  if (!p)
+    return 0;
+
+  d = p;
+  n = len / sizeof(*d);
+  for (i=0; i < n; i++) {
+    if (state_unpack(&d[i], &st) < 0)
+      break;
+    map_set(&st);
+  }
+  munmap(p, len);
+
+  if (i * sizeof(*d) != len) {
+    syslog(LOG_WARNING, "Discarding %zu bytes at the end of the state journal",
+           len - i * sizeof(*d));
+    if (ftruncate(jfd, i * sizeof(*d)) < 0)
+      syslog(LOG_WARNING, "Cannot truncate the state journal: %s", strerror(errno));
+  }
+  jrecords = i;
+  return i;
+}
+
+
+/* Keeps only the journal records appended since the first done of them,
+ * which a new snapshot does not cover. The tail is written to a new journal
+ * that is renamed over the old one, so a crash leaves one or the other
+ * whole. state_lock must be held */
+static int state_journal_trim(
+    unsigned long done)
+{
+  struct state_disk *tail = NULL;
+  size_t len = (jrecords - done) * sizeof(*tail);
+  int fd = -1;
+
+  if (len) {
+    tail = malloc(len);
+    if (!tail || pread(jfd, tail, len, done * sizeof(*tail)) != (ssize_t)len)
+      goto fail;
+  }
+
+  fd = openat(statedir, STATE_JOURNAL ".tmp", O_RDWR|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC, 0600);
+  if (fd < 0)
+    goto fail;
+  if ((len && write(fd, tail, len) != (ssize_t)len) || fdatasync(fd) < 0)
+    goto fail;
+  if (renameat(statedir, STATE_JOURNAL ".tmp", statedir, STATE_JOURNAL) < 0)
+    goto fail;
+
+  /* Appends go to the new journal from here on, even if the rename is not
+   * durable yet. Until it is, a crash brings back the old journal, which
+   * replays to the same state */
+  close(jfd);
+  jfd = fd;
+  jrecords -= done;
+  free(tail);
+  return fsync(statedir);
+
+fail:
+  free(tail);
+  if (fd > -1) {
+    close(fd);
+    unlinkat(statedir, STATE_JOURNAL ".tmp", 0);
+  }
+  return -1;
+}
+
+
+/* Writes the map out as a new snapshot and empties the journal. The map is
+ * copied under state_lock and written without it, so appends carry on while
+ * the snapshot is synced. Only the journal swap holds the lock again */
+static int state_compact(
+    void)
+{
+  struct state_header *hdr;
+  struct state_disk *d, *copy = NULL;
+  unsigned long done;
+  size_t len, i, n = 0;
+  void *p = MAP_FAILED;
+  int fd = -1;
+
+  pthread_mutex_lock(&state_lock);
+  copy = malloc((maplive ? maplive : 1) * sizeof(*copy));
+  if (!copy) {
+    pthread_mutex_unlock(&state_lock);
+    goto fail;
+  }
+  for (i=0; i < mapcap; i++) {
+    if (map[i].used == SLOT_USED)
+      state_pack(&copy[n++], &map[i].st);
+  }
+  done = jrecords;
+  pthread_mutex_unlock(&state_lock);
+
+  len = sizeof(*hdr) + n * sizeof(*d);
+  fd = openat(statedir, STATE_SNAPSHOT ".tmp", O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+  if (fd < 0)
+    goto fail;
+  if (ftruncate(fd, len) < 0)
+    goto fail;
+  p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED)
+    goto fail;
+
+  hdr = p;
+  d = (struct state_disk *)(hdr + 1);
+  memcpy(d, copy, n * sizeof(*d));
+  hdr->magic = STATE_MAGIC;
+  hdr->version = STATE_VERSION;
+  hdr->count = n;
+  hdr->check = state_check(hdr, offsetof(struct state_header, check));
+
+  if (msync(p, len, MS_SYNC) < 0 || fsync(fd) < 0)
+    goto fail;
+  munmap(p, len);
+  p = MAP_FAILED;
+  close(fd);
+  fd = -1;
+
+  /* Once renamed the journal is redundant, replaying it again is harmless */
+  if (renameat(statedir, STATE_SNAPSHOT ".tmp", statedir, STATE_SNAPSHOT) < 0 || fsync(statedir) < 0)
+    goto fail;
+
+  pthread_mutex_lock(&state_lock);
+  if (state_journal_trim(done) < 0) {
+    pthread_mutex_unlock(&state_lock);
+    goto fail;
+  }
+  stats.compactions++;
+  pthread_mutex_unlock(&state_lock);
+  free(copy);
+  return 0;
+
+fail:
+  syslog(LOG_WARNING, "Cannot write saved state snapshot: %s", strerror(errno));
+  free(copy);
+  if (p != MAP_FAILED)
+    munmap(p, len);
+  if (fd > -1)
+    close(fd);
+  return -1;
+}
+
+
+/* Commits journal appends in groups, folding the journal away when it grows */
+static void * state_run(
+    void *data)
+{
+  struct timespec ts = { 0, STATE_COMMIT_MS * 1000000L };
+
+  pthread_mutex_lock(&state_lock);
+  while (1) {
+    while (!dirty && !stopping)
+      pthread_cond_wait(&state_cond, &state_lock);
+    if (stopping)
+      break;
+    pthread_mutex_unlock(&state_lock);
+
+    /* Let appends that follow closely share the sync */
+    nanosleep(&ts, NULL);
+
+    pthread_mutex_lock(&state_lock);
+    dirty = 0;
+    pthread_mutex_unlock(&state_lock);
+
+    if (fdatasync(jfd) < 0)
+      syslog(LOG_WARNING, "Cannot sync the state journal: %s", strerror(errno));
+
+    pthread_mutex_lock(&state_lock);
+    stats.commits++;
+    if (jrecords >= STATE_COMPACT && jrecords >= maplive) {
+      pthread_mutex_unlock(&state_lock);
+      state_compact();
+      pthread_mutex_lock(&state_lock);
+    }
+  }
+
+  pthread_mutex_unlock(&state_lock);
+  return NULL;
+}
+
+
+int state_init(
+    const char *dir)
+{
+  struct timespec start, end;
+  int n, j;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+    goto fail;
+  statedir = open(dir, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (statedir < 0)
+    goto fail;
+  jfd = openat(statedir, STATE_JOURNAL, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0600);
+  if (jfd < 0)
+    goto fail;
+
+  pthread_mutex_lock(&state_lock);
+  n = state_load_snapshot();
+  j = state_load_journal();
+  pthread_mutex_unlock(&state_lock);
+  if (j > 0)
+    state_compact();
+
+  errno = pthread_create(&state_thread, NULL, state_run, NULL);
+  if (errno)
+    goto fail;
+  enabled = 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  syslog(LOG_NOTICE, "Restored saved state of %zu users from %d snapshot and %d journal records in %ldus",
+         maplive, n, j, (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000);
+  return 0;
+
+fail:
+  syslog(LOG_WARNING, "Cannot keep state in %s, it will be lost on restart: %s", dir, strerror(errno));
+  if (jfd > -1)
+    close(jfd);
+  if (statedir > -1)
+    close(statedir);
+  jfd = statedir = -1;
+  return -1;
+}
+
+
+static int state_find(
+    uid_t uid,
+    uint16_t extra,
+    struct user_state *st)
+{
+  size_t i;
+  int found = 0;
+
+  if (!enabled)
+    return 0;
+
+  pthread_mutex_lock(&state_lock);
+  if (mapcap) {
+    i = map_slot(map, mapcap, uid, extra);
+    if (map[i].used == SLOT_USED) {
+      *st = map[i].st;
+      found = 1;
+    }
+  }
+  pthread_mutex_unlock(&state_lock);
+  return found;
+}
+
+
+int state_lookup(
+    uid_t uid,
+    struct user_state *st)
+{
+  return state_find(uid, 0, st);
+}
+
+
+int state_lookup_extra(
+    uid_t uid,
+    uint16_t port,
+    struct user_state *st)
+{
+  return state_find(uid, port, st);
+}
+
+
+void state_record(
+    const struct user_state *st)
+{
+  struct state_disk d;
+
+  if (!enabled)
+    return;
+
+  pthread_mutex_lock(&state_lock);
+  if (!map_set(st) || jfd < 0)
+    goto out;
+
+  state_pack(&d, st);
+  if (write(jfd, &d, sizeof(d)) != sizeof(d)) {
+    syslog(LOG_WARNING, "Cannot append to the state journal: %s", strerror(errno));
+    goto out;
+  }
+  jrecords++;
+  stats.records++;
+  if (!dirty) {
+    dirty = 1;
+    pthread_cond_signal(&state_cond);
+  }
+
+out:
+  pthread_mutex_unlock(&state_lock);
+}
+
+
+/* Stops the state thread once it is between commits and closes the journal
+ * after a last sync, so a successor can take the files over. Saved state can
+ * still be looked up, changes are not journaled until state_resume */
+void state_suspend(
+    void)
+{
+  if (!enabled || jfd < 0)
+    return;
+
+  pthread_mutex_lock(&state_lock);
+  stopping = 1;
+  pthread_cond_signal(&state_cond);
+  pthread_mutex_unlock(&state_lock);
+  pthread_join(state_thread, NULL);
+
+  pthread_mutex_lock(&state_lock);
+  if (fdatasync(jfd) < 0)
+    syslog(LOG_WARNING, "Cannot sync the state journal: %s", strerror(errno));
+  close(jfd);
+  jfd = -1;
+  dirty = 0;
+  pthread_mutex_unlock(&state_lock);
+}
+
+
+/* Takes the files back after a handover failed. A successor that got far
+ * enough may have compacted them, which leaves the same state but another
+ * journal, so it is opened again by name */
+void state_resume(
+    void)
+{
+  struct stat sb;
+
+  if (!enabled || jfd > -1)
+    return;
+
+  pthread_mutex_lock(&state_lock);
+  jfd = openat(statedir, STATE_JOURNAL, O_RDWR|O_CREAT|O_APPEND|O_CLOEXEC, 0600);
+  if (jfd < 0 || fstat(jfd, &sb) < 0) {
+    syslog(LOG_WARNING, "Cannot reopen the state journal, changes will be lost on restart: %s",
+           strerror(errno));
+    if (jfd > -1)
+      close(jfd);
+    jfd = -1;
+    pthread_mutex_unlock(&state_lock);
+    return;
+  }
+  jrecords = sb.st_size / sizeof(struct state_disk);
+  stopping = 0;
+  pthread_mutex_unlock(&state_lock);
+
+  errno = pthread_create(&state_thread, NULL, state_run, NULL);
+  if (errno)
+    syslog(LOG_WARNING, "Cannot restart the state thread, changes are not synced: %s", strerror(errno));
+}
+
+
+/* A deleted user goes back to the default, which is not kept */
+void state_forget(
+    uid_t uid)
+{
+  struct user_state st;
+
+  memset(&st, 0, sizeof(st));
+  st.uid = uid;
+  state_record(&st);
+}
+
+
+void state_walk(
+    void (*cb)(const struct user_state *st, void *data),
+    void *data)
+{
+  size_t i;
+
+  pthread_mutex_lock(&state_lock);
+  for (i=0; i < mapcap; i++) {
+    if (map[i].used == SLOT_USED)
+      cb(&map[i].st, data);
+  }
+  pthread_mutex_unlock(&state_lock);
+}
+
+
+void state_get_stats(
+    struct state_stats *st)
+{
+  pthread_mutex_lock(&state_lock);
+  *st = stats;
+  st->users = maplive;
+  pthread_mutex_unlock(&state_lock);
+}
@@ -0,0 +1,58 @@
+#ifndef _STATE_H_
+#define _STATE_H_
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* Users whose port differs from the default of reserved and re-acquired, or
+ * who were assigned a port, are kept in a snapshot file along with released
+ * extra ports, with changes since appended to a journal. Both are read back
+ * at startup so a restart leaves released ports and policies as they were */
+#define STATE_SNAPSHOT "state"
+#define STATE_JOURNAL  "journal"
+#define STATE_MAGIC 0x42505354
+/* Version 2 added records for released extra ports, older snapshots are
+ * still read */
+#define STATE_VERSION 2
+
+/* Journal writes are made durable together, this long after the first */
+#define STATE_COMMIT_MS 20
+/* Journal records kept before they are folded into a new snapshot */
+#define STATE_COMPACT 4096
+
+struct user_state {
+  uid_t uid;
+  uint8_t released;
+  uint8_t dont_reacquire;
+  time_t reacquire_time;
+  /* Port assigned to the user, 0 if it follows the uid */
+  uint16_t port;
+  /* The owner may still hold the socket, so it is not re-acquired */
+  uint8_t checked_out;
+  /* The extra port this is about, 0 for the users own. Only released and
+   * reacquire_time apply to one */
+  uint16_t extra;
+};
+
+struct state_stats {
+  unsigned long users;
+  unsigned long records;
+  unsigned long commits;
+  unsigned long compactions;
+};
+
+/* Returns -1 if persistence could not be set up, the daemon runs without it */
+int state_init(const char *dir);
+/* Fills in the saved state of a user, returns 0 if there is none */
+int state_lookup(uid_t uid, struct user_state *st);
+int state_lookup_extra(uid_t uid, uint16_t port, struct user_state *st);
+void state_record(const struct user_state *st);
+void state_forget(uid_t uid);
+/* Around handing the files to a successor during an upgrade */
+void state_suspend(void);
+void state_resume(void);
+/* Calls cb for every user and extra port with saved state */
+void state_walk(void (*cb)(const struct user_state *st, void *data), void *data);
+void state_get_stats(struct state_stats *st);
+#endif
@@ -0,0 +1,169 @@
+/* Pushes changes to the reservation table to clients that subscribed. Changes
+ * are queued per subscriber by whichever thread made them, and the thread
+ * serving the subscriber is woken through an eventfd to send them on */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+
+#include "protocol.h"
+#include "subscribe.h"
+
+struct subscriber {
+  uid_t uid;
+  int fd;
+  /* Ring of changes not yet taken, guarded by sublock */
+  struct port_event queue[SUBSCRIBE_QUEUE];
+  unsigned int head;
+  unsigned int tail;
+  /* Changes were dropped since the subscriber last took any */
+  int resync;
+  LIST_ENTRY(subscriber) entries;
+};
+
+static pthread_mutex_t sublock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(, subscriber) subscribers = LIST_HEAD_INITIALIZER(subscribers);
+static int nsubscribers = 0;
+static struct subscribe_stats stats;
+
+
+struct subscriber * subscribe_add(
+    uid_t uid)
+{
+  struct subscriber *s;
+
+  s = calloc(1, sizeof(*s));
+  if (!s)
+    return NULL;
+
+  s->uid = uid;
+  s->fd = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+  if (s->fd < 0) {
+    syslog(LOG_WARNING, "Cannot create eventfd for subscriber: %s", strerror(errno));
+    free(s);
+    return NULL;
+  }
+
+  pthread_mutex_lock(&sublock);
+  LIST_INSERT_HEAD(&subscribers, s, entries);
+  __atomic_add_fetch(&nsubscribers, 1, __ATOMIC_RELAXED);
+  stats.subscribers++;
+  pthread_mutex_unlock(&sublock);
+  return s;
+}
+
+
+void subscribe_del(
+    struct subscriber *s)
+{
+  pthread_mutex_lock(&sublock);
+  LIST_REMOVE(s, entries);
+  __atomic_sub_fetch(&nsubscribers, 1, __ATOMIC_RELAXED);
+  stats.subscribers--;
+  pthread_mutex_unlock(&sublock);
+
+  close(s->fd);
+  free(s);
+}
+
+
+int subscribe_fd(
+    struct subscriber *s)
+{
+  return s->fd;
+}
+
+
+int subscribe_take(
+    struct subscriber *s,
+    struct port_event *ev,
+    int max)
+{
+  uint64_t val;
+  int n = 0;
+
+  /* Clear the wakeup, anything left over is picked up by our caller */
+  if (read(s->fd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+    syslog(LOG_WARNING, "Cannot read subscriber eventfd: %s", strerror(errno));
+
+  pthread_mutex_lock(&sublock);
+  if (s->resync && max > 0) {
+    memset(&ev[n], 0, sizeof(ev[n]));
+    ev[n].old_status = STATUS_UNKNOWN;
+    ev[n].new_status = STATUS_UNKNOWN;
+    ev[n].dont_reacquire = REACQUIRE_UNKNOWN;
+    ev[n].reason = EVENT_RESYNC;
+    s->resync = 0;
+    n++;
+  }
+
+  while (n < max && s->head != s->tail)
+    ev[n++] = s->queue[s->head++ % SUBSCRIBE_QUEUE];
+  pthread_mutex_unlock(&sublock);
+  return n;
+}
+
+
+/* Queues a change for every subscriber allowed to see it. Callers hold the
+ * shard lock of the entry, so changes to one user arrive in order */
+void subscribe_publish(
+    const struct port_event *ev)
+{
+  struct subscriber *s;
+  struct port_event *e;
+  uint64_t one = 1;
+  int wake;
+
+  if (__atomic_load_n(&nsubscribers, __ATOMIC_RELAXED) == 0)
+    return;
+
+  pthread_mutex_lock(&sublock);
+  stats.published++;
+  LIST_FOREACH(s, &subscribers, entries) {
+    /* Others only learn of users coming and going, as in a list */
+    if (s->uid != 0 && s->uid != ev->uid
+        && ev->reason != EVENT_ADDED && ev->reason != EVENT_DELETED)
+      continue;
+
+    /* A slow subscriber gets a resync marker rather than a backlog */
+    if (s->resync)
+      continue;
+    if (s->tail - s->head == SUBSCRIBE_QUEUE) {
+      s->head = s->tail;
+      s->resync = 1;
+      stats.resyncs++;
+      continue;
+    }
+
+    wake = s->head == s->tail;
+    e = &s->queue[s->tail++ % SUBSCRIBE_QUEUE];
+    *e = *ev;
+    if (s->uid != 0 && s->uid != ev->uid) {
+      e->old_status = STATUS_UNKNOWN;
+      e->new_status = STATUS_UNKNOWN;
+      e->dont_reacquire = REACQUIRE_UNKNOWN;
+    }
+
+    if (wake && write(s->fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      syslog(LOG_WARNING, "Cannot wake subscriber: %s", strerror(errno));
+  }
+  pthread_mutex_unlock(&sublock);
+}
+
+
+void subscribe_get_stats(
+    struct subscribe_stats *st)
+{
+  pthread_mutex_lock(&sublock);
+  *st = stats;
+  pthread_mutex_unlock(&sublock);
+}
@@ -0,0 +1,27 @@
+#ifndef _SUBSCRIBE_H_
+#define _SUBSCRIBE_H_
+
+#include <sys/types.h>
+
+#include "protocol.h"
+
+/* Changes held for a subscriber before it has to resync */
+#define SUBSCRIBE_QUEUE 1024
+
+struct subscriber;
+
+struct subscribe_stats {
+  unsigned long subscribers;
+  unsigned long published;
+  unsigned long resyncs;
+};
+
+struct subscriber * subscribe_add(uid_t uid);
+void subscribe_del(struct subscriber *s);
+/* Readable when changes are waiting for the subscriber */
+int subscribe_fd(struct subscriber *s);
+/* Takes up to max queued changes, a resync marker comes first if any were dropped */
+int subscribe_take(struct subscriber *s, struct port_event *ev, int max);
+void subscribe_publish(const struct port_event *ev);
+void subscribe_get_stats(struct subscribe_stats *st);
+#endif
@@ -0,0 +1,168 @@
+/* Checks that PORT_CHANGES lists the whole table for a generation that
+ * did not come from the running daemon, such as one kept from before a
+ * restart.
+ *
+ *   gcc -I.. -o changes changes.c && ./changes [SOCKPATH [CURSORFILE]]
+ *
+ * Run as root against a daemon with a stream request socket. Given a
+ * cursor file that does not exist, the cursor is saved to it. Restart the
+ * daemon and run again with the same file to check the saved cursor is
+ * refused. Exits 0 on success */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "protocol.h"
+
+#define DEFAULT_SOCKPATH "/var/run/bookkeeper/bookkeeper.sock"
+
+struct cursor {
+  uint64_t generation;
+  uint64_t epoch;
+};
+
+
+static void read_all(
+    int fd,
+    void *buf,
+    size_t len)
+{
+  char *p = buf;
+  ssize_t rc;
+
+  while (len > 0) {
+    rc = read(fd, p, len);
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0)
+      err(EXIT_FAILURE, "Cannot read reply");
+    if (rc == 0)
+      errx(EXIT_FAILURE, "Server closed the connection");
+    p += rc;
+    len -= rc;
+  }
+}
+
+
+/* Asks for the changes after a cursor, returns the flags of the reply and
+ * the cursor to go on from in next. An epoch of 0 is left out */
+static uint32_t ask(
+    int fd,
+    const struct cursor *since,
+    struct cursor *next)
+{
+  char req[FRAME_HEADER_LEN + 2 * sizeof(uint64_t)];
+  char hdrbuf[FRAME_HEADER_LEN];
+  struct frame_header hdr;
+  uint32_t error, count, flags;
+  uint32_t len = since->epoch ? 2 * sizeof(uint64_t) : sizeof(uint64_t);
+  const char *p;
+  char *buf;
+
+  frame_put64(frame_put64(frame_put_header(req, PORT_CHANGES, len), since->generation),
+              since->epoch);
+  if (write(fd, req, FRAME_HEADER_LEN + len) != (ssize_t)(FRAME_HEADER_LEN + len))
+    err(EXIT_FAILURE, "Cannot send request");
+
+  read_all(fd, hdrbuf, sizeof(hdrbuf));
+  frame_get_header(hdrbuf, &hdr);
+  if (hdr.magic != FRAME_MAGIC || hdr.opcode != PORT_CHANGES || hdr.length < FRAME_REPLY_LEN)
+    errx(EXIT_FAILURE, "Garbled reply");
+  buf = malloc(hdr.length);
+  if (!buf)
+    err(EXIT_FAILURE, "Cannot allocate memory");
+  read_all(fd, buf, hdr.length);
+
+  p = frame_get32(buf, &error);
+  p = frame_get32(p, &count);
+  if (error) {
+    errno = error;
+    err(EXIT_FAILURE, "PORT_CHANGES failed");
+  }
+  if (hdr.length != FRAME_REPLY_LEN + count * FRAME_CHANGE_LEN + 2 * sizeof(uint64_t)
+                    + sizeof(flags))
+    errx(EXIT_FAILURE, "Reply has no epoch");
+
+  p += count * FRAME_CHANGE_LEN;
+  p = frame_get64(p, &next->generation);
+  p = frame_get32(p, &flags);
+  frame_get64(p, &next->epoch);
+  free(buf);
+  return flags;
+}
+
+
+int main(
+    int argc,
+    char **argv)
+{
+  struct sockaddr_un sun;
+  struct cursor start = { 0, 0 }, cur, next, c;
+  FILE *f;
+  int fd;
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strncpy(sun.sun_path, argc > 1 ? argv[1] : DEFAULT_SOCKPATH, sizeof(sun.sun_path) - 1);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    err(EXIT_FAILURE, "Cannot create socket");
+  if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+    err(EXIT_FAILURE, "Cannot connect to %s", sun.sun_path);
+
+  if (!(ask(fd, &start, &cur) & CHANGES_FULL))
+    errx(EXIT_FAILURE, "First listing is not the whole table");
+  if (cur.epoch == 0)
+    errx(EXIT_FAILURE, "Server gave no epoch");
+
+  /* Our own cursor only gets what changed since */
+  if (ask(fd, &cur, &next) & CHANGES_FULL)
+    errx(EXIT_FAILURE, "Current cursor gave the whole table");
+
+  /* A cursor from another process */
+  c.generation = cur.generation;
+  c.epoch = cur.epoch ^ 1;
+  if (!(ask(fd, &c, &next) & CHANGES_FULL))
+    errx(EXIT_FAILURE, "Cursor from another epoch was taken");
+
+  /* Without an epoch, a generation not handed out yet */
+  c.generation = cur.generation + 1000;
+  c.epoch = 0;
+  if (!(ask(fd, &c, &next) & CHANGES_FULL))
+    errx(EXIT_FAILURE, "Cursor from the future was taken");
+
+  if (argc > 2) {
+    f = fopen(argv[2], "r");
+    if (f) {
+      if (fscanf(f, "%" SCNu64 " %" SCNu64, &c.generation, &c.epoch) != 2)
+        errx(EXIT_FAILURE, "Cannot parse %s", argv[2]);
+      fclose(f);
+      if (!(ask(fd, &c, &next) & CHANGES_FULL))
+        errx(EXIT_FAILURE, "Cursor from before the restart was taken");
+      unlink(argv[2]);
+    }
+    else {
+      f = fopen(argv[2], "w");
+      if (!f)
+        err(EXIT_FAILURE, "Cannot save cursor to %s", argv[2]);
+      fprintf(f, "%" PRIu64 " %" PRIu64 "\n", cur.generation, cur.epoch);
+      fclose(f);
+      printf("saved, restart the server and run again\n");
+      return 0;
+    }
+  }
+
+  printf("ok\n");
+  return 0;
+}
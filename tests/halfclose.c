@@ -0,0 +1,118 @@
+/* Checks that a client which writes its requests and then shuts down its
+ * side of the connection still gets every reply before the server closes.
+ *
+ *   gcc -I.. -o halfclose halfclose.c && ./halfclose [SOCKPATH]
+ *
+ * Run against a daemon with a stream request socket. Exits 0 on success */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "protocol.h"
+
+#define DEFAULT_SOCKPATH "/var/run/bookkeeper/bookkeeper.sock"
+/* Requests written per call */
+#define REQUESTS 1024
+/* Gives up filling the socket after this much */
+#define SEND_MAX (64 * 1024 * 1024)
+
+
+/* Packs a version 1 request, every field host-endian and in order */
+static char * pack_request(
+    char *p,
+    uint32_t request)
+{
+  struct port_request pr;
+
+  memset(&pr, 0, sizeof(pr));
+  pr.magic = MAGIC;
+  pr.request = request;
+  pr.pi.uid = getuid();
+
+  memcpy(p, &pr.magic, sizeof(pr.magic));
+  p += sizeof(pr.magic);
+  memcpy(p, &pr.request, sizeof(pr.request));
+  p += sizeof(pr.request);
+  memcpy(p, &pr.pi.uid, sizeof(pr.pi.uid));
+  p += sizeof(pr.pi.uid);
+  memcpy(p, &pr.pi.port, sizeof(pr.pi.port));
+  p += sizeof(pr.pi.port);
+  memcpy(p, &pr.pi.status, sizeof(pr.pi.status));
+  p += sizeof(pr.pi.status);
+  memcpy(p, &pr.pi.dont_reacquire, sizeof(pr.pi.dont_reacquire));
+  p += sizeof(pr.pi.dont_reacquire);
+  memcpy(p, &pr.error, sizeof(pr.error));
+  return p + sizeof(pr.error);
+}
+
+
+int main(
+    int argc,
+    char **argv)
+{
+  struct sockaddr_un sun;
+  static char buf[PORT_REQUEST_LEN * REQUESTS];
+  char reply[4096];
+  size_t sent = 0, got = 0, off;
+  ssize_t rc;
+  char *p = buf;
+  int fd, i;
+
+  memset(&sun, 0, sizeof(sun));
+  sun.sun_family = AF_UNIX;
+  strncpy(sun.sun_path, argc > 1 ? argv[1] : DEFAULT_SOCKPATH, sizeof(sun.sun_path) - 1);
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    err(EXIT_FAILURE, "Cannot create socket");
+  if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+    err(EXIT_FAILURE, "Cannot connect to %s", sun.sun_path);
+
+  /* A version 1 PORT_READY is refused, which still gets a reply and
+   * changes nothing */
+  for (i=0; i < REQUESTS; i++)
+    p = pack_request(p, PORT_READY | PORT_PERSIST);
+
+  /* Write without reading until the socket is full. The server stops
+   * reading once our replies back up, so the end of the stream is still
+   * unread when we shut down */
+  if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+    err(EXIT_FAILURE, "Cannot make the socket non-blocking");
+  while (sent < SEND_MAX) {
+    off = sent % sizeof(buf);
+    rc = write(fd, buf + off, sizeof(buf) - off);
+    if (rc < 0) {
+      if (errno == EAGAIN)
+        break;
+      err(EXIT_FAILURE, "Cannot send requests");
+    }
+    sent += rc;
+  }
+  if (shutdown(fd, SHUT_WR) < 0)
+    err(EXIT_FAILURE, "Cannot shut down the connection");
+  if (fcntl(fd, F_SETFL, 0) < 0)
+    err(EXIT_FAILURE, "Cannot make the socket blocking");
+
+  while ((rc = read(fd, reply, sizeof(reply))) > 0)
+    got += rc;
+  if (rc < 0)
+    err(EXIT_FAILURE, "Cannot read replies");
+
+  /* A request cut short by the shutdown gets no reply */
+  if (got != sizeof(struct port_response) * (sent / PORT_REQUEST_LEN))
+    errx(EXIT_FAILURE, "Sent %zu requests, got %zu replies", sent / PORT_REQUEST_LEN,
+         got / sizeof(struct port_response));
+
+  printf("ok\n");
+  return 0;
+}
@@ -0,0 +1,489 @@
+/* Replaces the running daemon with a freshly exec'd one without letting go of
+ * any port. The old process passes its request socket and every bound port
+ * over a socket pair with SCM_RIGHTS, along with the state of each user, and
+ * exits once the new one says it has adopted them */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "users.h"
+#include "upgrade.h"
+
+#define HANDOFF_LISTENER 1
+#define HANDOFF_USERS    2
+#define HANDOFF_DONE     3
+#define HANDOFF_ACK      4
+
+/* Every message starts with this, the payload follows. Both ends are the
+ * same host so fields are in host order */
+struct handoff_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t type;
+  uint32_t count;
+  uint32_t len;
+};
+
+/* A user in a HANDOFF_USERS payload, followed by namelen bytes of name. Users
+ * with extra ports then have a handoff_extra for each, followed by the int64
+ * time it is due back if released. Version 2 had one time for them all
+ * before the first instead. The sockets of those with hasfd set come with
+ * the message, in order, the users own first */
+struct handoff_user {
+  uint32_t uid;
+  uint16_t port;
+  uint8_t released;
+  uint8_t dont_reacquire;
+  int64_t reacquire_time;
+  uint8_t hasfd;
+  /* Was padding in earlier versions, so zero from them */
+  uint8_t checked_out;
+  uint16_t namelen;
+  /* Was padding before version 2, so zero from them */
+  uint16_t nextra;
+  uint8_t assigned;
+  uint8_t pad;
+};
+
+struct handoff_extra {
+  uint16_t port;
+  uint8_t hasfd;
+  uint8_t pad;
+};
+
+/* Users waiting to be sent in the next message */
+struct handoff {
+  int sock;
+  char buf[HANDOFF_MSGMAX];
+  size_t len;
+  uint32_t count;
+  int fds[HANDOFF_BATCH];
+  int nfds;
+  unsigned long users;
+  unsigned long sockets;
+  unsigned long messages;
+};
+
+static struct handoff out;
+/* The successors end of the socket pair, -1 if not upgrading */
+static int handoff_sock = -1;
+
+
+static int handoff_send(
+    int sock,
+    uint16_t type,
+    uint32_t count,
+    const void *payload,
+    size_t len,
+    const int *fds,
+    int nfds)
+{
+  struct handoff_header hdr;
+  struct msghdr msg;
+  struct iovec iov[2];
+  struct cmsghdr *cmsg;
+  char cbuf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.magic = HANDOFF_MAGIC;
+  hdr.version = HANDOFF_VERSION;
+  hdr.type = type;
+  hdr.count = count;
+  hdr.len = len;
+
+  iov[0].iov_base = &hdr;
+  iov[0].iov_len = sizeof(hdr);
+  iov[1].iov_base = (void *)payload;
+  iov[1].iov_len = len;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = len ? 2 : 1;
+  if (nfds > 0) {
+    memset(cbuf, 0, sizeof(cbuf));
+    msg.msg_control = cbuf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+  }
+
+  if (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0)
+    return -1;
+  return 0;
+}
+
+
+/* Receives one message into buf, with up to HANDOFF_BATCH descriptors */
+static ssize_t handoff_recv(
+    int sock,
+    struct handoff_header *hdr,
+    void *buf,
+    size_t size,
+    int *fds,
+    int *nfds)
+{
+  struct msghdr msg;
+  struct iovec iov[2];
+  struct cmsghdr *cmsg;
+  char cbuf[CMSG_SPACE(sizeof(int) * HANDOFF_BATCH)];
+  ssize_t rc;
+
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = sizeof(*hdr);
+  iov[1].iov_base = buf;
+  iov[1].iov_len = size;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = iov;
+  msg.msg_iovlen = 2;
+  msg.msg_control = cbuf;
+  msg.msg_controllen = sizeof(cbuf);
+
+  *nfds = 0;
+  rc = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+  if (rc < 0)
+    return -1;
+
+  for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+      *nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *nfds);
+    }
+  }
+
+  if (rc < (ssize_t)sizeof(*hdr) || hdr->magic != HANDOFF_MAGIC
+      || hdr->version < HANDOFF_VERSION_MIN || hdr->version > HANDOFF_VERSION
+      || (msg.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) || hdr->len != rc - sizeof(*hdr)) {
+    errno = EPROTO;
+    return -1;
+  }
+  return hdr->len;
+}
+
+
+static int handoff_flush(
+    struct handoff *h)
+{
+  if (h->count == 0)
+    return 0;
+  if (handoff_send(h->sock, HANDOFF_USERS, h->count, h->buf, h->len, h->fds, h->nfds) < 0)
+    return -1;
+
+  h->messages++;
+  h->len = 0;
+  h->count = 0;
+  h->nfds = 0;
+  return 0;
+}
+
+
+static int handoff_user(
+    const struct user_export *ue,
+    void *data)
+{
+  struct handoff *h = data;
+  struct handoff_user hu;
+  struct handoff_extra he;
+  uint16_t ports[PORTS_USER_MAX];
+  size_t namelen = strlen(ue->name);
+  size_t len;
+  int64_t reacquire;
+  int nextra = ue->extra ? ports_set_ports(ue->extra, ports) : 0;
+  int i;
+
+  if (namelen > UINT16_MAX)
+    namelen = UINT16_MAX;
+  len = sizeof(hu) + namelen + nextra * (sizeof(he) + sizeof(reacquire));
+
+  /* A user carries at most PORTS_USER_MAX + 1 sockets, within the batch limit */
+  if ((h->nfds + 1 + nextra > HANDOFF_BATCH || h->len + len > sizeof(h->buf))
+      && handoff_flush(h) < 0)
+    return -1;
+
+  memset(&hu, 0, sizeof(hu));
+  hu.uid = ue->uid;
+  hu.port = ue->port;
+  hu.released = ue->state.released;
+  hu.dont_reacquire = ue->state.dont_reacquire;
+  hu.reacquire_time = ue->state.reacquire_time;
+  hu.checked_out = ue->state.checked_out;
+  hu.assigned = ue->state.port != 0;
+  hu.hasfd = ue->fd > -1;
+  hu.namelen = namelen;
+  hu.nextra = nextra;
+  memcpy(h->buf + h->len, &hu, sizeof(hu));
+  memcpy(h->buf + h->len + sizeof(hu), ue->name, namelen);
+  h->len += sizeof(hu) + namelen;
+  h->count++;
+
+  if (hu.hasfd) {
+    h->fds[h->nfds++] = ue->fd;
+    h->sockets++;
+  }
+
+  for (i=0; i < nextra; i++) {
+    memset(&he, 0, sizeof(he));
+    he.port = ports[i];
+    he.hasfd = ue->extra->fds[i] > -1;
+    reacquire = ue->extra->reacquire[i];
+    memcpy(h->buf + h->len, &he, sizeof(he));
+    memcpy(h->buf + h->len + sizeof(he), &reacquire, sizeof(reacquire));
+    h->len += sizeof(he) + sizeof(reacquire);
+    if (he.hasfd) {
+      h->fds[h->nfds++] = ue->extra->fds[i];
+      h->sockets++;
+    }
+  }
+  h->users++;
+  return 0;
+}
+
+
+static long upgrade_elapsed(
+    const struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start->tv_sec) * 1000000 + (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+
+int upgrade_start(
+    const char *exe,
+    char **argv,
+    int listenfd)
+{
+  struct handoff_header hdr;
+  struct timespec start;
+  struct timeval tv = { HANDOFF_TIMEOUT, 0 };
+  char num[16];
+  long sent;
+  int sv[2] = { -1, -1 };
+  int fds[HANDOFF_BATCH];
+  int nfds, locked = 0;
+  pid_t pid = -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv) < 0)
+    goto fail;
+  if (setsockopt(sv[0], SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0
+      || setsockopt(sv[0], SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+    goto fail;
+
+  /* Set up before forking, the child may only exec */
+  snprintf(num, sizeof(num), "%d", sv[1]);
+  if (setenv(HANDOFF_ENV, num, 1) < 0)
+    goto fail;
+
+  pid = fork();
+  if (pid == 0) {
+    fcntl(sv[1], F_SETFD, 0);
+    execv(exe, argv);
+    _exit(127);
+  }
+  unsetenv(HANDOFF_ENV);
+  if (pid < 0)
+    goto fail;
+  close(sv[1]);
+  sv[1] = -1;
+
+  if (handoff_send(sv[0], HANDOFF_LISTENER, 1, NULL, 0, &listenfd, 1) < 0)
+    goto fail;
+
+  memset(&out, 0, sizeof(out));
+  out.sock = sv[0];
+  locked = 1;
+  if (users_export_begin(handoff_user, &out) < 0 || handoff_flush(&out) < 0)
+    goto fail;
+  if (handoff_send(sv[0], HANDOFF_DONE, out.users, NULL, 0, NULL, 0) < 0)
+    goto fail;
+  sent = upgrade_elapsed(&start);
+
+  if (handoff_recv(sv[0], &hdr, NULL, 0, fds, &nfds) < 0 || hdr.type != HANDOFF_ACK)
+    goto fail;
+
+  syslog(LOG_NOTICE, "Handed %lu users and %lu sockets in %lu messages to process %d, "
+         "sent in %ldus, taken over in %ldus", out.users, out.sockets, out.messages,
+         pid, sent, upgrade_elapsed(&start));
+  return 0;
+
+fail:
+  syslog(LOG_ERR, "Cannot hand over to a new process, carrying on: %s", errno ? strerror(errno) : "it went away");
+  /* Gone before we take the saved state back, it may have opened it */
+  if (pid > 0) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+  }
+  if (locked)
+    users_export_end();
+  if (sv[0] > -1)
+    close(sv[0]);
+  if (sv[1] > -1)
+    close(sv[1]);
+  return -1;
+}
+
+
+int upgrade_listener(
+    void)
+{
+  struct handoff_header hdr;
+  const char *env = getenv(HANDOFF_ENV);
+  int fds[HANDOFF_BATCH];
+  int nfds;
+
+  if (!env)
+    return -1;
+  handoff_sock = atoi(env);
+  unsetenv(HANDOFF_ENV);
+  fcntl(handoff_sock, F_SETFD, FD_CLOEXEC);
+
+  if (handoff_recv(handoff_sock, &hdr, NULL, 0, fds, &nfds) < 0)
+    err(EXIT_FAILURE, "Cannot receive the request socket from the old process");
+  if (hdr.type != HANDOFF_LISTENER || nfds != 1)
+    errx(EXIT_FAILURE, "The old process did not hand over a request socket");
+  return fds[0];
+}
+
+
+void upgrade_adopt(
+    void)
+{
+  static char buf[HANDOFF_MSGMAX];
+  struct handoff_header hdr;
+  struct handoff_user hu;
+  struct handoff_extra he;
+  struct user_export ue;
+  struct timespec start;
+  char name[UINT16_MAX + 1];
+  uint16_t ports[PORTS_USER_MAX];
+  int extrafd[PORTS_USER_MAX];
+  int64_t reacquire[PORTS_USER_MAX];
+  unsigned long users = 0, sockets = 0;
+  int64_t shared = 0;
+  size_t need;
+  int fds[HANDOFF_BATCH];
+  int nfds, nused, j;
+  ssize_t len, off;
+  uint32_t i;
+
+  if (handoff_sock < 0)
+    return;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (1) {
+    len = handoff_recv(handoff_sock, &hdr, buf, sizeof(buf), fds, &nfds);
+    if (len < 0)
+      err(EXIT_FAILURE, "Cannot receive users from the old process");
+    if (hdr.type == HANDOFF_DONE)
+      break;
+    if (hdr.type != HANDOFF_USERS)
+      errx(EXIT_FAILURE, "Unexpected handover message %d", hdr.type);
+
+    for (i=0, off=0, nused=0; i < hdr.count; i++) {
+      if (len - off < (ssize_t)sizeof(hu))
+        errx(EXIT_FAILURE, "Garbled handover from the old process");
+      memcpy(&hu, buf + off, sizeof(hu));
+      off += sizeof(hu);
+      if (len - off < hu.namelen || (hu.hasfd && nused == nfds))
+        errx(EXIT_FAILURE, "Garbled handover from the old process");
+      memcpy(name, buf + off, hu.namelen);
+      name[hu.namelen] = 0;
+      off += hu.namelen;
+
+      memset(&ue, 0, sizeof(ue));
+      ue.uid = hu.uid;
+      ue.port = hu.port;
+      ue.name = name;
+      ue.fd = hu.hasfd ? fds[nused++] : -1;
+
+      if (hdr.version < 2)
+        hu.nextra = 0;
+      need = hu.nextra * sizeof(he);
+      if (hu.nextra)
+        need += hdr.version < 3 ? sizeof(shared) : hu.nextra * sizeof(shared);
+      if (hu.nextra > PORTS_USER_MAX || len - off < (ssize_t)need)
+        errx(EXIT_FAILURE, "Garbled handover from the old process");
+      if (hu.nextra && hdr.version < 3) {
+        memcpy(&shared, buf + off, sizeof(shared));
+        off += sizeof(shared);
+      }
+      for (j=0; j < hu.nextra; j++) {
+        memcpy(&he, buf + off, sizeof(he));
+        off += sizeof(he);
+        reacquire[j] = shared;
+        if (hdr.version >= 3) {
+          memcpy(&reacquire[j], buf + off, sizeof(reacquire[j]));
+          off += sizeof(reacquire[j]);
+        }
+        if ((he.hasfd && nused == nfds) || (j > 0 && he.port <= ports[j-1]))
+          errx(EXIT_FAILURE, "Garbled handover from the old process");
+        ports[j] = he.port;
+        extrafd[j] = he.hasfd ? fds[nused++] : -1;
+        if (extrafd[j] > -1)
+          sockets++;
+      }
+      /* Adopting takes the sockets still listed, the rest are closed */
+      if (hu.nextra) {
+        ue.extra = ports_set_new(ports, hu.nextra);
+        if (!ue.extra)
+          syslog(LOG_WARNING, "Cannot allocate memory for the extra ports of user %s, binding them anew", name);
+      }
+      if (ue.extra) {
+        memcpy(ue.extra->fds, extrafd, hu.nextra * sizeof(*extrafd));
+        for (j=0; j < hu.nextra; j++)
+          ue.extra->reacquire[j] = reacquire[j];
+      }
+      ue.state.uid = hu.uid;
+      ue.state.released = hu.released;
+      ue.state.dont_reacquire = hu.dont_reacquire;
+      ue.state.reacquire_time = hu.reacquire_time;
+      ue.state.checked_out = hu.checked_out;
+      ue.state.port = hu.assigned ? hu.port : 0;
+      if (ue.fd > -1)
+        sockets++;
+      users_adopt(&ue);
+      users++;
+
+      if (ue.extra)
+        memcpy(extrafd, ue.extra->fds, hu.nextra * sizeof(*extrafd));
+      for (j=0; j < hu.nextra; j++) {
+        if (extrafd[j] > -1)
+          close(extrafd[j]);
+      }
+      free(ue.extra);
+    }
+
+    for (; nused < nfds; nused++)
+      close(fds[nused]);
+  }
+
+  if (hdr.count != users)
+    errx(EXIT_FAILURE, "The old process handed over %u users but %lu arrived", hdr.count, users);
+  if (handoff_send(handoff_sock, HANDOFF_ACK, users, NULL, 0, NULL, 0) < 0)
+    err(EXIT_FAILURE, "Cannot tell the old process to go");
+  close(handoff_sock);
+  handoff_sock = -1;
+
+  syslog(LOG_NOTICE, "Adopted %lu users and %lu sockets from the old process in %ldus",
+         users, sockets, upgrade_elapsed(&start));
+}
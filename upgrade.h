@@ -0,0 +1,26 @@
+#ifndef _UPGRADE_H_
+#define _UPGRADE_H_
+
+/* Names the descriptor a successor reads its handover from */
+#define HANDOFF_ENV "BOOKKEEPER_HANDOFF"
+#define HANDOFF_MAGIC 0x424B484F
+#define HANDOFF_VERSION 3
+/* Oldest predecessor a successor can take over from */
+#define HANDOFF_VERSION_MIN 1
+/* Most descriptors the kernel takes in one message, SCM_MAX_FD */
+#define HANDOFF_BATCH 253
+#define HANDOFF_MSGMAX 65536
+/* Seconds to wait on the successor before carrying on without it */
+#define HANDOFF_TIMEOUT 30
+
+/* Execs exe with argv and hands it the request socket and every user with
+ * its bound socket, so no port is ever unbound. Returns 0 once the successor
+ * took over, the caller must exit without touching the users again. On
+ * failure -1 is returned and the daemon carries on as before */
+int upgrade_start(const char *exe, char **argv, int listenfd);
+/* In a successor, returns the request socket handed over or -1 if the
+ * daemon was started normally */
+int upgrade_listener(void);
+/* In a successor, adopts the users handed over and lets the predecessor go */
+void upgrade_adopt(void);
+#endif
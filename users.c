@@ -1,5 +1,6 @@
 #define _POSIX_C_SOURCE 200809L
 #define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,18 +11,125 @@
 #include <err.h>
 #include <pwd.h>
 #include <syslog.h>
+#include <pthread.h>
+#include <time.h>
 
 #include <sys/types.h>
+#include <sys/random.h>
 #include <sys/socket.h>
-#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
 
 #include "config.h"
 #include "users.h"
+#include "event.h"
+#include "snapshot.h"
+#include "subscribe.h"
+#include "passwd.h"
+#include "state.h"
+#include "ports.h"
 
 extern struct config config;
 
-static struct userlist ulist;
-static int ulistnum = 0;
+/* Users are sharded by uid so requests for different users dont contend */
+#define USERS_SHARDS 16
+/* Initial buckets of a shards hash, doubled as it fills */
+#define USERS_BUCKETS 64
+/* Fewest new users worth binding on a pool of threads, and the most threads */
+#define BULK_MIN 256
+#define BULK_THREADS_MAX 16
+
+struct user_shard {
+  pthread_mutex_t lock;
+  struct userlist ulist;
+  int ulistnum;
+  /* Entries hashed by uid, a power of two buckets */
+  struct reserved_port **buckets;
+  unsigned int nbuckets;
+};
+
+static struct user_shard shards[USERS_SHARDS];
+
+struct bulk_bind {
+  pthread_t thread;
+  const uint16_t *ports;
+  int *fds;
+  int start;
+  int end;
+  long ms;
+};
+
+/* Entries ordered by uid for range queries. Additions are appended and the
+ * index is sorted again by the next query. Adding or removing an entry needs
+ * its shard lock and index_lock, sorting and reading need index_lock */
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct reserved_port **uid_index = NULL;
+static int uid_index_len = 0;
+static int uid_index_cap = 0;
+static int uid_index_sorted = 1;
+/* Owner of each port, kept under the same rules as the uid index */
+static struct reserved_port *port_index[65536];
+/* A bit for each port held or booked, under the same rules. A booked port has
+ * no owner yet, it is kept for the user it was assigned to before a restart */
+static uint64_t port_bits[65536 / 64];
+/* Extra ports held across every user */
+static int extra_ports = 0;
+/* Users whose port was assigned rather than following their uid */
+static int assigned_ports = 0;
+/* Where the next search for a port to assign starts, searches go down */
+static uint32_t assign_next = 0;
+
+/* Counts sync passes to find users no longer in passwd */
+static unsigned int sync_pass = 0;
+
+/* Users found by the first sync of a progressive startup, in uid order, whose
+ * ports are bound a slice at a time. A user that is added, deleted or asked
+ * about before its turn is done with out of order */
+struct warm_user {
+  uid_t uid;
+  /* Position in passwd, the first of a repeated uid wins */
+  int seq;
+  char *name;
+  int done;
+};
+
+static pthread_mutex_t warm_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct warm_user *warm = NULL;
+static int nwarm = 0;
+static int warm_cap = 0;
+static int warm_next = 0;
+static int warm_bound = 0;
+/* Set while users are left to bind, only ever cleared after it is set */
+static int warming = 0;
+/* The sync in progress queues users rather than adding them */
+static int warm_collect = 0;
+
+/* Users deleted recently enough to tell collectors about */
+#define TOMBSTONES_MAX 4096
+
+struct tombstone {
+  uid_t uid;
+  uint16_t port;
+  uint64_t generation;
+  TAILQ_ENTRY(tombstone) changes;
+};
+
+/* Every change takes the next generation. Entries and tombstones are kept
+ * in order of their last change, writers need the shard lock of the entry
+ * and gen_lock, readers every shard lock */
+static pthread_mutex_t gen_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t generation = 0;
+static struct changelist changed = TAILQ_HEAD_INITIALIZER(changed);
+static TAILQ_HEAD(tomblist, tombstone) tombstones = TAILQ_HEAD_INITIALIZER(tombstones);
+static int ntombstones = 0;
+/* Changes at or below this may have lost their tombstone */
+static uint64_t tombstone_floor = 0;
+/* Picked at random by each process. Generations start over with it, so a
+ * generation from another epoch means nothing here */
+static uint64_t epoch = 0;
+
+static pthread_mutex_t bind_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bind_stats bind_stats;
 
 static const char *user_blacklist[] = {
   "nfsnobody",
@@ -29,34 +137,58 @@ static const char *user_blacklist[] = {
   NULL,
 };
 
+static void users_bind_account(
+    const struct timespec *start,
+    int failed)
+{
+  struct timespec end;
+  uint64_t ns;
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  ns = (end.tv_sec - start->tv_sec) * 1000000000ULL + end.tv_nsec - start->tv_nsec;
+
+  pthread_mutex_lock(&bind_lock);
+  bind_stats.binds++;
+  if (failed)
+    bind_stats.failures++;
+  bind_stats.total_ns += ns;
+  if (ns > bind_stats.max_ns)
+    bind_stats.max_ns = ns;
+  pthread_mutex_unlock(&bind_lock);
+}
+
+
+/* Binds the wildcard address on both IPv6 and IPv4, whatever the
+ * net.ipv6.bindv6only default is, so the port is taken for either family */
 static int users_port_bind(
     uint16_t port,
     char try)
 {
-  struct addrinfo *ai, hints;
-  char s_port[64];
+  struct sockaddr_in6 sin6;
+  struct timespec start;
   int fd = -1;
   int rc;
 
-  memset(&hints, 0, sizeof(hints));
-  memset(s_port, 0, sizeof(s_port));
-  hints.ai_flags = AI_PASSIVE;
-  hints.ai_family = AF_INET6;
-  snprintf(s_port, 64, "%hu", port);
-
-  if (port < PRIVPORTS || port > 65535) {
-    syslog(LOG_WARNING, "Cannot bind to port %d, invalid port range: %s", port, strerror(errno));
+  if (port < PRIVPORTS) {
+    syslog(LOG_WARNING, "Cannot bind to port %d, invalid port range", port);
     return -1;
   }
 
-  rc = getaddrinfo(NULL, s_port, &hints, &ai);
-  if (rc) {
-    syslog(LOG_WARNING, "Cannot resolve address to bind to: %s", gai_strerror(rc));
-    return -1;
-  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
 
-  fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
-  if (fd < 0) {
+  memset(&sin6, 0, sizeof(sin6));
+  sin6.sin6_family = AF_INET6;
+  sin6.sin6_addr = in6addr_any;
+  sin6.sin6_port = htons(port);
+
+  /* Only handed to a successor on purpose, see upgrade.c */
+  fd = socket(AF_INET6, SOCK_STREAM|SOCK_CLOEXEC, 0);
+  if (fd < 0 && (errno == EMFILE || errno == ENFILE)) {
+    syslog(LOG_ERR, "Cannot allocate socket for port %d, out of file descriptors: %s. "
+           "Raise --max-files or give users fewer extra ports", port, strerror(errno));
+    goto fail;
+  }
+  else if (fd < 0) {
     syslog(LOG_WARNING, "Cannot allocate socket: %s", strerror(errno));
     goto fail;
   }
@@ -67,289 +199,2271 @@ static int users_port_bind(
     goto fail;
   }
 
-  if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+  rc = 0;
+  if (setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &rc, sizeof(rc)) < 0) {
+    syslog(LOG_WARNING, "Cannot make socket dual stack: %s", strerror(errno));
+    goto fail;
+  }
+
+  if (bind(fd, (struct sockaddr *)&sin6, sizeof(sin6)) < 0) {
     if (!try)
       syslog(LOG_WARNING, "Cannot bind to address: %s", strerror(errno));
     goto fail;
   }
 
-end:
-  freeaddrinfo(ai);
+  users_bind_account(&start, 0);
   return fd;
 
 fail:
-  if (ai)
-    freeaddrinfo(ai);
   if (fd >= 0)
     close(fd);
+  users_bind_account(&start, 1);
   return -1;
 }
 
 
+/* Checks a socket handed to us holds a port the way users_port_bind would,
+ * so it keeps out both families. One left listening is shut down, which
+ * refuses further connections but keeps it bound */
+static int users_port_check(
+    int fd,
+    uint16_t port)
+{
+  struct sockaddr_in6 sin6;
+  socklen_t len = sizeof(sin6);
+  int v;
+
+  if (getsockname(fd, (struct sockaddr *)&sin6, &len) < 0)
+    return -errno;
+  if (len < sizeof(sin6) || sin6.sin6_family != AF_INET6
+      || !IN6_IS_ADDR_UNSPECIFIED(&sin6.sin6_addr) || ntohs(sin6.sin6_port) != port)
+    return -EINVAL;
+
+  len = sizeof(v);
+  if (getsockopt(fd, SOL_SOCKET, SO_TYPE, &v, &len) < 0 || v != SOCK_STREAM)
+    return -EINVAL;
+  len = sizeof(v);
+  if (getsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &v, &len) < 0 || v)
+    return -EINVAL;
 
-static int users_search(
-    struct passwd *p)
+  len = sizeof(v);
+  if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &v, &len) == 0 && v
+      && shutdown(fd, SHUT_RDWR) < 0)
+    return -errno;
+  return 0;
+}
+
+
+/* The port a socket is bound to, 0 if it cannot be told */
+static uint16_t users_fd_port(
+    int fd)
 {
-  struct reserved_port *rp = NULL;
-  if (!p)
+  struct sockaddr_in6 sin6;
+  socklen_t len = sizeof(sin6);
+
+  if (getsockname(fd, (struct sockaddr *)&sin6, &len) < 0 || len < sizeof(sin6))
     return 0;
+  return ntohs(sin6.sin6_port);
+}
 
-  for (rp = ulist.lh_first; rp != NULL; rp = rp->entries.le_next) {
-    if (p->pw_uid == rp->uid)
-      return 1;
-  }
 
-  return 0;
+static inline struct user_shard * users_shard(
+    uid_t uid)
+{
+  return &shards[uid % USERS_SHARDS];
 }
 
 
-static int users_add(
-    struct passwd *p)
+/* The uids of a shard share their low bits, hash on the rest */
+static inline struct reserved_port ** users_bucket(
+    struct user_shard *sh,
+    uid_t uid)
 {
-  struct reserved_port *rp = NULL;
+  return &sh->buckets[(uid / USERS_SHARDS) & (sh->nbuckets - 1)];
+}
 
-  if (!p)
-    goto fail;
 
-  /* User already exists */
-  if (users_search(p))
-    goto fail;
+/* Find a user in its shard, the shard must be locked */
+static struct reserved_port * users_search(
+    struct user_shard *sh,
+    uid_t uid)
+{
+  struct reserved_port *rp;
 
-  rp = malloc(sizeof(*rp));
-  if (!rp) {
-    syslog(LOG_WARNING, "Cannot allocate memory for user %s to bind to port: %s", p->pw_name, strerror(errno));
-    goto fail;
+  for (rp = *users_bucket(sh, uid); rp != NULL; rp = rp->hnext) {
+    if (uid == rp->uid)
+      return rp;
   }
 
-  rp->username = strdup(p->pw_name);
-  if (!rp->username) {
-    syslog(LOG_WARNING, "Cannot allocate memory for username %s to bind to port: %s", p->pw_name, strerror(errno));
-    goto fail;
+  return NULL;
+}
+
+
+/* Doubles the buckets of a shard. On failure the chains just get longer */
+static void users_hash_grow(
+    struct user_shard *sh)
+{
+  struct reserved_port **old = sh->buckets;
+  struct reserved_port **bucket;
+  struct reserved_port *rp;
+
+  sh->buckets = calloc(sh->nbuckets * 2, sizeof(*sh->buckets));
+  if (!sh->buckets) {
+    sh->buckets = old;
+    return;
   }
+  sh->nbuckets *= 2;
 
-  rp->uid = p->pw_uid;
-  rp->fd = -1;
-  rp->dont_reacquire = 0;
-  rp->reacquire_time = 0;
-  rp->port = config.port_offset + p->pw_uid;
-  /* Dont allow overflow */
-  if ((int)rp->port < (int)config.port_offset) {
-    syslog(LOG_WARNING, "Cannot bind port, integer overflow");
-    goto fail;
+  for (rp = sh->ulist.lh_first; rp != NULL; rp = rp->entries.le_next) {
+    bucket = users_bucket(sh, rp->uid);
+    rp->hnext = *bucket;
+    *bucket = rp;
   }
+  free(old);
+}
 
-  if ((rp->fd = users_port_bind(rp->port, 0)) < 0)
-    goto fail;
-  rp->released = 0;
 
-  LIST_INSERT_HEAD(&ulist, rp, entries);
-  ulistnum++;
-  syslog(LOG_NOTICE, "Added port %d for user %s", rp->port, rp->username);
-  return 1;
+/* Links an entry into its shard, which must be locked */
+static void users_hash_insert(
+    struct user_shard *sh,
+    struct reserved_port *rp)
+{
+  struct reserved_port **bucket;
 
-fail:
-  if (rp) {
-    if (rp->username)
-      free(rp->username);
-    if (rp->fd > -1)
-      close(rp->fd);
-  }
-  return 0;
+  LIST_INSERT_HEAD(&sh->ulist, rp, entries);
+  sh->ulistnum++;
+  if ((unsigned int)sh->ulistnum > sh->nbuckets)
+    users_hash_grow(sh);
+
+  bucket = users_bucket(sh, rp->uid);
+  rp->hnext = *bucket;
+  *bucket = rp;
 }
 
 
-static int users_delete(
-   uid_t uid)
+static void users_hash_remove(
+    struct user_shard *sh,
+    struct reserved_port *rp)
 {
-  struct reserved_port *rp = NULL;
+  struct reserved_port **prev;
 
-  for (rp = ulist.lh_first; rp != NULL; rp = rp->entries.le_next) {
-    if (rp->uid == uid)
-      break;
+  for (prev = users_bucket(sh, rp->uid); *prev != rp; prev = &(*prev)->hnext);
+  *prev = rp->hnext;
+
+  LIST_REMOVE(rp, entries);
+  sh->ulistnum--;
+}
+
+
+/* Moves an entry to the end of the change list with the next generation */
+static void users_generation(
+    struct reserved_port *rp)
+{
+  pthread_mutex_lock(&gen_lock);
+  if (rp->generation)
+    TAILQ_REMOVE(&changed, rp, changes);
+  rp->generation = ++generation;
+  TAILQ_INSERT_TAIL(&changed, rp, changes);
+  pthread_mutex_unlock(&gen_lock);
+}
+
+
+/* Leaves a tombstone for a port that is gone with the next generation, the
+ * oldest are forgotten. gen_lock must be held */
+static uint64_t users_tombstone_add(
+    uid_t uid,
+    uint16_t port)
+{
+  struct tombstone *t;
+
+  ++generation;
+  if (ntombstones == TOMBSTONES_MAX) {
+    t = TAILQ_FIRST(&tombstones);
+    TAILQ_REMOVE(&tombstones, t, changes);
+    tombstone_floor = t->generation;
+  }
+  else {
+    t = malloc(sizeof(*t));
+    if (!t) {
+      /* Collectors have to start over */
+      tombstone_floor = generation;
+      return generation;
+    }
+    ntombstones++;
   }
 
-  if (!rp)
-    return 0;
+  t->uid = uid;
+  t->port = port;
+  t->generation = generation;
+  TAILQ_INSERT_TAIL(&tombstones, t, changes);
+  return generation;
+}
 
-  syslog(LOG_NOTICE, "Deleting %s", rp->username);
-  if (rp->released == 0)
-    close(rp->fd);
-  free(rp->username);
-  LIST_REMOVE(rp, entries);
-  ulistnum--;
-  free(rp);
-  return 1;
+
+/* Leaves a tombstone for a deleted entry */
+static void users_tombstone(
+    struct reserved_port *rp)
+{
+  pthread_mutex_lock(&gen_lock);
+  TAILQ_REMOVE(&changed, rp, changes);
+  rp->generation = users_tombstone_add(rp->uid, rp->port);
+  pthread_mutex_unlock(&gen_lock);
 }
 
 
+/* Leaves a tombstone for an extra port an entry no longer has */
+static void users_tombstone_port(
+    struct reserved_port *rp,
+    uint16_t port)
+{
+  pthread_mutex_lock(&gen_lock);
+  users_tombstone_add(rp->uid, port);
+  pthread_mutex_unlock(&gen_lock);
+}
+
 
-void users_init(
-    void)
+/* Tells subscribers about a change to one of the ports of an entry */
+static void users_notify(
+    struct reserved_port *rp,
+    uint16_t port,
+    uint8_t reason,
+    uint8_t old_status,
+    uint8_t new_status)
 {
-  LIST_INIT(&ulist);
+  struct port_event ev;
+
+  ev.uid = rp->uid;
+  ev.port = port;
+  ev.old_status = old_status;
+  ev.new_status = new_status;
+  ev.reason = reason;
+  ev.dont_reacquire = rp->dont_reacquire;
+  subscribe_publish(&ev);
 }
 
 
+/* Publishes a change to an entry, the shard must be locked */
+static inline void users_changed(
+    struct reserved_port *rp,
+    uint8_t reason,
+    uint8_t old_status)
+{
+  struct user_state st;
+
+  users_generation(rp);
+  snapshot_update(rp);
 
-void users_sync(
+  st.uid = rp->uid;
+  st.released = rp->released;
+  st.dont_reacquire = rp->dont_reacquire;
+  st.reacquire_time = rp->reacquire_time;
+  st.port = rp->assigned ? rp->port : 0;
+  st.checked_out = rp->checked_out;
+  st.extra = 0;
+  state_record(&st);
+
+  users_notify(rp, rp->port, reason, old_status, users_status(rp));
+}
+
+
+/* Saves whether an extra port is released, a reserved one is not kept */
+static void users_extra_record(
+    struct reserved_port *rp,
+    uint16_t port,
+    int released,
+    time_t reacquire)
+{
+  struct user_state st;
+
+  memset(&st, 0, sizeof(st));
+  st.uid = rp->uid;
+  st.extra = port;
+  st.released = released;
+  st.reacquire_time = released ? reacquire : 0;
+  state_record(&st);
+}
+
+
+/* Publishes a change to the extra port at i, which the entry shares its
+ * generation and snapshot slot with. The shard must be locked */
+static void users_extra_changed(
+    struct reserved_port *rp,
+    int i,
+    uint16_t port,
+    uint8_t reason,
+    uint8_t old_status)
+{
+  struct port_set *ps = rp->extra;
+
+  users_generation(rp);
+  snapshot_update(rp);
+  users_extra_record(rp, port, ps->fds[i] < 0, ps->reacquire[i]);
+  users_notify(rp, port, reason, old_status, ps->fds[i] > -1 ? STATUS_RESERVED : STATUS_RELEASED);
+}
+
+
+static inline int users_port_used(
+    uint32_t port)
+{
+  return (port_bits[port / 64] >> (port % 64)) & 1;
+}
+
+
+static inline void users_port_mark(
+    uint32_t port,
+    int used)
+{
+  if (used)
+    port_bits[port / 64] |= 1ULL << (port % 64);
+  else
+    port_bits[port / 64] &= ~(1ULL << (port % 64));
+}
+
+
+/* The highest free port from hi down to lo, a word of the bitmap at a time.
+ * Returns 0 if there is none, index_lock must be held */
+static uint32_t users_port_scan(
+    uint32_t hi,
+    uint32_t lo)
+{
+  uint64_t free;
+  uint32_t base;
+
+  while (hi >= lo) {
+    base = hi & ~63U;
+    free = ~port_bits[hi / 64];
+    if (hi % 64 != 63)
+      free &= (2ULL << (hi % 64)) - 1;
+    if (base < lo)
+      free &= ~((1ULL << (lo - base)) - 1);
+    if (free)
+      return base + 63 - __builtin_clzll(free);
+    if (base == 0)
+      break;
+    hi = base - 1;
+  }
+  return 0;
+}
+
+
+/* Picks a free port from the assign range, carrying on down from the last
+ * one picked and wrapping around to the top. By default the range is the
+ * ports of system uids, which nobody maps to. Returns 0 if all are taken,
+ * index_lock must be held */
+static uint32_t users_port_assign(
     void)
 {
-  struct passwd *p = NULL;
-  struct reserved_port *rp = NULL, *rp2 = NULL;
-  char **blacklist;
+  uint32_t port;
 
-  /* Add any users we are unaware of */
-  while ((p = getpwent())) {
-    /* Make sure the blacklist does not match */
-    for (blacklist = (char **)user_blacklist; *blacklist != NULL; blacklist++) {
-      if (strcmp(*blacklist, p->pw_name) == 0)
-        goto next;
-    }
+  if (assign_next < config.assign_min || assign_next > config.assign_max)
+    assign_next = config.assign_max;
+
+  port = users_port_scan(assign_next, config.assign_min);
+  if (!port && assign_next < config.assign_max)
+    port = users_port_scan(config.assign_max, assign_next + 1);
+  if (port)
+    assign_next = port - 1;
+  return port;
+}
+
+
+/* The port an entry for uid gets short of assigning one. That is want if it
+ * was assigned one before and nobody holds it, otherwise port_offset + uid
+ * if that is free. Returns 0 if one has to be assigned, index_lock must be
+ * held */
+static uint32_t users_port_pick(
+    uid_t uid,
+    uint16_t want)
+{
+  uint64_t direct = (uint64_t)config.port_offset + uid;
+
+  /* A booked port has its bit set but no owner */
+  if (want >= PRIVPORTS && !port_index[want])
+    return want;
+  /* Past the last port, the uid cannot map straight onto one */
+  if (direct <= UINT16_MAX && !users_port_used(direct))
+    return direct;
+  return 0;
+}
+
+
+/* Indexes an entry by uid and gives it a port, the one users_port_pick
+ * gives otherwise one assigned from the free ports. Fails if none is left */
+static int users_index_add(
+    struct reserved_port *rp,
+    uint16_t want)
+{
+  struct reserved_port **idx;
+  uint32_t port;
+  int cap;
 
-    /* Dont register users below the system user threshold */
-    if (p->pw_uid < config.system_user_threshold)
-      goto next;
-    users_add(p);
-next:
-    continue;
+  pthread_mutex_lock(&index_lock);
+  port = users_port_pick(rp->uid, want);
+  if (!port)
+    port = users_port_assign();
+
+  if (!port) {
+    pthread_mutex_unlock(&index_lock);
+    return -EADDRNOTAVAIL;
   }
 
-  /* Delete any users that no longer exist */
-  for (rp = ulist.lh_first; rp != NULL; rp = rp->entries.le_next) {
-restart:
-    p = getpwuid(rp->uid);
-    if (!p) {
-      /* Once the entry is deleted, we need to short-circuit the loop */
-      rp2 = rp->entries.le_next;
-      users_delete(rp->uid);
-      rp = rp2;
-      if (!rp)
-        break;
-      goto restart;
+  if (uid_index_len == uid_index_cap) {
+    cap = uid_index_cap ? uid_index_cap * 2 : 1024;
+    idx = realloc(uid_index, cap * sizeof(*idx));
+    if (!idx) {
+      pthread_mutex_unlock(&index_lock);
+      return -ENOMEM;
     }
+    uid_index = idx;
+    uid_index_cap = cap;
   }
 
-  endpwent();
+  if (uid_index_len > 0 && uid_index[uid_index_len-1]->uid > rp->uid)
+    uid_index_sorted = 0;
+  rp->uidslot = uid_index_len;
+  uid_index[uid_index_len++] = rp;
+  rp->port = port;
+  rp->assigned = port != (uint64_t)config.port_offset + rp->uid;
+  if (rp->assigned)
+    assigned_ports++;
+  port_index[port] = rp;
+  users_port_mark(port, 1);
+  pthread_mutex_unlock(&index_lock);
+  return 0;
 }
 
-void users_reacquire_ports(
-    void)
+
+static void users_index_remove(
+    struct reserved_port *rp)
 {
-  struct reserved_port *rp = NULL;
-  time_t now = time(NULL);
-  int tmp;
+  struct reserved_port *last;
 
-  for (rp = ulist.lh_first; rp != NULL; rp = rp->entries.le_next) {
-    if (rp->released && rp->reacquire_time < now && rp->dont_reacquire == 0) {
-      tmp = users_port_bind(rp->port, 1);
-      if (errno == EADDRINUSE) {
-        rp->reacquire_time += DEFAULT_REACQUIRE_TIMEOUT;
-        return;
-      }
-      syslog(LOG_NOTICE, "Re-acquired port %d for user %s", rp->port, rp->username);
-      rp->fd = tmp;
-      rp->reacquire_time = 0;
-      rp->released = 0;
-    }
+  pthread_mutex_lock(&index_lock);
+  port_index[rp->port] = NULL;
+  users_port_mark(rp->port, 0);
+  if (rp->assigned)
+    assigned_ports--;
+  last = uid_index[--uid_index_len];
+  if (last != rp) {
+    last->uidslot = rp->uidslot;
+    uid_index[rp->uidslot] = last;
+    uid_index_sorted = 0;
   }
+  pthread_mutex_unlock(&index_lock);
 }
 
 
-int users_port_request(
-     uid_t uid,
-     uint16_t port)
+/* Claims an extra port for an entry, fails if someone else holds it */
+static int users_index_claim(
+    struct reserved_port *rp,
+    uint16_t port)
 {
-  struct reserved_port *rp;
-
-  for (rp = ulist.lh_first; rp != NULL; rp = rp->entries.le_next) {
-    if (rp->uid == uid) {
-      if (port == 0)
-        port= rp->port;
-      else if (rp->port != port)
-        return -EINVAL;
-
-      if (rp->released) {
-        rp->fd = users_port_bind(port, 0);
-        if (rp->fd >= 0) {
-          rp->released = 0;
-          rp->reacquire_time = 0;
-        }
-        return -errno;
-      }
-      return -EADDRINUSE;
-    }
+  pthread_mutex_lock(&index_lock);
+  if (users_port_used(port)) {
+    if (port_index[port])
+      syslog(LOG_WARNING, "Cannot give port %d to user %s, it belongs to uid %d", port, rp->username, port_index[port]->uid);
+    else
+      syslog(LOG_WARNING, "Cannot give port %d to user %s, it is kept for a user assigned it", port, rp->username);
+    pthread_mutex_unlock(&index_lock);
+    return -EADDRINUSE;
   }
-  return -ENOENT;
+  port_index[port] = rp;
+  users_port_mark(port, 1);
+  extra_ports++;
+  pthread_mutex_unlock(&index_lock);
+  return 0;
 }
 
-int users_port_release(
-    uid_t uid,
+
+static void users_index_unclaim(
     uint16_t port)
 {
-  struct reserved_port *rp;
+  pthread_mutex_lock(&index_lock);
+  port_index[port] = NULL;
+  users_port_mark(port, 0);
+  extra_ports--;
+  pthread_mutex_unlock(&index_lock);
+}
 
-  for (rp = ulist.lh_first; rp != NULL; rp = rp->entries.le_next) {
-    if (rp->uid == uid) {
-      if (port == 0)
-        port= rp->port;
-      else if (rp->port != port)
-        return -EINVAL;
-
-      if (!rp->released) {
-        close(rp->fd);
-        rp->fd = -1;
-        rp->released = 1;
-        rp->reacquire_time = time(NULL) + DEFAULT_REACQUIRE_TIMEOUT;
-        return -errno;
-      }
-      return -ENOTCONN;
-    }
+
+static int users_index_compare(
+    const void *a,
+    const void *b)
+{
+  const struct reserved_port *x = *(struct reserved_port * const *)a;
+  const struct reserved_port *y = *(struct reserved_port * const *)b;
+
+  return (x->uid > y->uid) - (x->uid < y->uid);
+}
+
+
+/* Puts the index back in order, index_lock must be held */
+static void users_index_sort(
+    void)
+{
+  int i;
+
+  if (uid_index_sorted)
+    return;
+
+  qsort(uid_index, uid_index_len, sizeof(*uid_index), users_index_compare);
+  for (i=0; i < uid_index_len; i++)
+    uid_index[i]->uidslot = i;
+  uid_index_sorted = 1;
+}
+
+
+/* First position in the sorted index with a uid of at least uid */
+static int users_index_find(
+    uid_t uid)
+{
+  int lo = 0, hi = uid_index_len, mid;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (uid_index[mid]->uid < uid)
+      lo = mid + 1;
+    else
+      hi = mid;
   }
-  return -ENOENT;
+  return lo;
 }
 
-int users_port_acquire_policy(
-    uid_t uid,
-    uint8_t dont_reacquire)
+
+static int warm_compare(
+    const void *a,
+    const void *b)
 {
-  struct reserved_port *rp;
+  const struct warm_user *l = a;
+  const struct warm_user *r = b;
 
-  for (rp = ulist.lh_first; rp != NULL; rp = rp->entries.le_next) {
-    if (rp->uid == uid) {
-        rp->dont_reacquire = dont_reacquire;
-        return 0;
-    }
+  if (l->uid != r->uid)
+    return l->uid < r->uid ? -1 : 1;
+  return l->seq - r->seq;
+}
+
+
+/* Call with warm_lock held */
+static struct warm_user * warm_find(
+    uid_t uid)
+{
+  int lo = 0, hi = nwarm - 1, mid;
+
+  while (lo <= hi) {
+    mid = lo + (hi - lo) / 2;
+    if (warm[mid].uid == uid)
+      return &warm[mid];
+    if (warm[mid].uid < uid)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
   }
-  return -ENOENT;
+  return NULL;
 }
 
-int users_port_list(
+
+static void warm_queue(
     uid_t uid,
-    struct portinfo **info,
-    uint16_t *len)
+    const char *name)
 {
-  struct portinfo *pi = NULL;
-  struct reserved_port *rp;
-  int i=0;
-  pi = calloc(ulistnum, sizeof(*pi));
-  if (!pi)
-    return -errno;
+  struct warm_user *w;
+  int n;
 
-  for (rp = ulist.lh_first; rp != NULL; rp = rp->entries.le_next) {
-    pi[i].uid = rp->uid;
-    pi[i].port = rp->port;
-    /* Dont share reserve status with unauthorized users */
-    if (uid == rp->uid || uid == 0) {
-      pi[i].status = rp->released;
-      pi[i].dont_reacquire = rp->dont_reacquire;
-    }
-    else {
-      pi[i].status = STATUS_UNKNOWN;
-      pi[i].dont_reacquire = REACQUIRE_UNKNOWN;
-    }
-    i++;
+  if (nwarm == warm_cap) {
+    n = warm_cap ? warm_cap * 2 : 1024;
+    w = realloc(warm, n * sizeof(*warm));
+    if (!w)
+      goto fail;
+    warm = w;
+    warm_cap = n;
   }
-  *info = pi;
-  *len = ulistnum;
-  return 0;
+
+  w = &warm[nwarm];
+  w->name = strdup(name);
+  if (!w->name)
+    goto fail;
+  w->uid = uid;
+  w->seq = nwarm;
+  w->done = 0;
+  nwarm++;
+  return;
+
+fail:
+  syslog(LOG_WARNING, "Cannot allocate memory to queue user %s: %s", name, strerror(errno));
+}
+
+
+/* Takes the user off the queue, returning its name if it was still waiting */
+static char * warm_take(
+    uid_t uid)
+{
+  struct warm_user *w;
+  char *name = NULL;
+
+  if (!warming)
+    return NULL;
+
+  pthread_mutex_lock(&warm_lock);
+  w = warming ? warm_find(uid) : NULL;
+  if (w && !w->done) {
+    w->done = 1;
+    warm_bound++;
+    name = w->name;
+    w->name = NULL;
+  }
+  pthread_mutex_unlock(&warm_lock);
+  return name;
+}
+
+
+static void users_warm_done(
+    uid_t uid)
+{
+  free(warm_take(uid));
+}
+
+
+static void users_schedule_reacquire(struct reserved_port *rp);
+
+/* Finds when the first released extra port of a set is due back, returns 0
+ * if none is released */
+static int users_extra_due(
+    const struct port_set *ps,
+    time_t *when)
+{
+  int i, due = 0;
+
+  for (i=0; ps && i < ps->nports; i++) {
+    if (ps->fds[i] > -1)
+      continue;
+    if (!due || ps->reacquire[i] < *when)
+      *when = ps->reacquire[i];
+    due = 1;
+  }
+  return due;
+}
+
+
+/* Lets go of an extra port the entry no longer has, the shard must be locked */
+static void users_extra_gone(
+    struct reserved_port *rp,
+    uint16_t port,
+    int fd)
+{
+  users_tombstone_port(rp, port);
+  users_extra_record(rp, port, 0, 0);
+  users_notify(rp, port, EVENT_DELETED, fd > -1 ? STATUS_RESERVED : STATUS_RELEASED, STATUS_UNKNOWN);
+  users_index_unclaim(port);
+  if (fd > -1)
+    close(fd);
+}
+
+
+/* Lets go of every extra port of an entry, the shard must be locked */
+static void users_extra_drop(
+    struct reserved_port *rp)
+{
+  struct port_set *ps = rp->extra;
+  uint16_t ports[PORTS_USER_MAX];
+  int i, n;
+
+  if (!ps)
+    return;
+
+  n = ports_set_ports(ps, ports);
+  for (i=0; i < n; i++)
+    users_extra_gone(rp, ports[i], ps->fds[i]);
+  rp->extra = NULL;
+  free(ps);
+}
+
+
+/* Brings the extra ports of an entry in line with the ports file. Ports no
+ * longer listed are let go of. When adding, newly listed ones are claimed
+ * and bound, or taken from handed or left released as saved. A reload drops
+ * for every user before adding, so a port moving between users is free by
+ * the time it is claimed. The shard must be locked */
+static void users_extra_update(
+    struct reserved_port *rp,
+    int adding,
+    struct port_set *handed)
+{
+  struct port_set *ps = rp->extra;
+  struct user_state st;
+  uint16_t want[PORTS_USER_MAX], keep[PORTS_USER_MAX], old[PORTS_USER_MAX];
+  int fds[PORTS_USER_MAX];
+  time_t reacquire[PORTS_USER_MAX];
+  uint8_t isnew[PORTS_USER_MAX];
+  int nwant, nkeep = 0, nold = 0, added = 0;
+  int i, j, fd;
+
+  nwant = ports_lookup(rp->username, rp->uid, rp->port, want, PORTS_USER_MAX);
+  if (ps)
+    nold = ports_set_ports(ps, old);
+
+  for (i=0; i < nwant; i++) {
+    j = ps ? ports_set_find(ps, want[i]) : -1;
+    if (j > -1) {
+      fds[nkeep] = ps->fds[j];
+      reacquire[nkeep] = ps->reacquire[j];
+      isnew[nkeep] = 0;
+      keep[nkeep++] = want[i];
+      continue;
+    }
+    if (!adding || users_index_claim(rp, want[i]) < 0)
+      continue;
+
+    /* A port handed over or saved released stays that way */
+    reacquire[nkeep] = 0;
+    j = handed ? ports_set_find(handed, want[i]) : -1;
+    if (j > -1) {
+      fd = handed->fds[j];
+      handed->fds[j] = -1;
+      if (fd < 0)
+        reacquire[nkeep] = handed->reacquire[j];
+    }
+    else if (state_lookup_extra(rp->uid, want[i], &st) && st.released) {
+      fd = -1;
+      reacquire[nkeep] = st.reacquire_time;
+    }
+    else if ((fd = users_port_bind(want[i], 0)) < 0) {
+      syslog(LOG_WARNING, "Cannot bind extra port %d for user %s, leaving it released for %ds",
+             want[i], rp->username, DEFAULT_REACQUIRE_TIMEOUT);
+      reacquire[nkeep] = time(NULL) + DEFAULT_REACQUIRE_TIMEOUT;
+    }
+
+    fds[nkeep] = fd;
+    isnew[nkeep] = 1;
+    keep[nkeep++] = want[i];
+    added++;
+  }
+
+  if (!added && nkeep == nold)
+    return;
+
+  /* Both lists are sorted, whatever old has that keep lacks is gone */
+  for (i=0, j=0; i < nold; i++) {
+    while (j < nkeep && keep[j] < old[i])
+      j++;
+    if (j < nkeep && keep[j] == old[i])
+      continue;
+    users_extra_gone(rp, old[i], ps->fds[i]);
+  }
+  free(ps);
+
+  rp->extra = ports_set_new(keep, nkeep);
+  if (nkeep && !rp->extra) {
+    syslog(LOG_WARNING, "Cannot allocate memory for the extra ports of user %s, letting them go", rp->username);
+    for (i=0; i < nkeep; i++)
+      users_extra_gone(rp, keep[i], fds[i]);
+    return;
+  }
+
+  for (i=0; i < nkeep; i++) {
+    rp->extra->fds[i] = fds[i];
+    rp->extra->reacquire[i] = fds[i] < 0 ? reacquire[i] : 0;
+  }
+  if (added) {
+    users_generation(rp);
+    snapshot_update(rp);
+  }
+  for (i=0; i < nkeep; i++) {
+    if (!isnew[i])
+      continue;
+    users_extra_record(rp, keep[i], fds[i] < 0, reacquire[i]);
+    users_notify(rp, keep[i], EVENT_ADDED, STATUS_UNKNOWN, fds[i] > -1 ? STATUS_RESERVED : STATUS_RELEASED);
+  }
+  users_schedule_reacquire(rp);
+}
+
+
+/* Takes a socket already bound to the users port, or binds one itself if fd
+ * is -1. The socket is closed if the user is not added. The state of the user
+ * comes from saved if given, otherwise from what was kept over a restart.
+ * Extra ports are taken from handed where it has them */
+static int users_insert(
+    struct passwd *p,
+    int fd,
+    const struct user_state *saved,
+    struct port_set *handed)
+{
+  struct reserved_port *rp = NULL;
+  struct user_shard *sh;
+  struct user_state st;
+  char *name;
+  int indexed = 0, restored;
+  int rc;
+
+  if (!p)
+    return 0;
+
+  users_warm_done(p->pw_uid);
+  sh = users_shard(p->pw_uid);
+  pthread_mutex_lock(&sh->lock);
+
+  /* User already exists, follow a rename of the account */
+  rp = users_search(sh, p->pw_uid);
+  if (rp) {
+    rp->seen = sync_pass;
+    if (strcmp(rp->username, p->pw_name) != 0 && (name = strdup(p->pw_name))) {
+      syslog(LOG_NOTICE, "User %s on port %d is now %s", rp->username, rp->port, name);
+      free(rp->username);
+      rp->username = name;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    if (fd > -1)
+      close(fd);
+    return 0;
+  }
+
+  rp = malloc(sizeof(*rp));
+  if (!rp) {
+    syslog(LOG_WARNING, "Cannot allocate memory for user %s to bind to port: %s", p->pw_name, strerror(errno));
+    goto fail;
+  }
+  memset(rp, 0, sizeof(*rp));
+  rp->fd = fd;
+  fd = -1;
+  rp->snapslot = -1;
+
+  rp->username = strdup(p->pw_name);
+  if (!rp->username) {
+    syslog(LOG_WARNING, "Cannot allocate memory for username %s to bind to port: %s", p->pw_name, strerror(errno));
+    goto fail;
+  }
+
+  rp->uid = p->pw_uid;
+  rp->dont_reacquire = 0;
+  rp->reacquire_time = 0;
+
+  /* Pick up where the last run left the user, including an assigned port */
+  if (saved)
+    st = *saved;
+  restored = saved || state_lookup(rp->uid, &st);
+
+  rc = users_index_add(rp, restored ? st.port : 0);
+  if (rc == -EADDRNOTAVAIL) {
+    syslog(LOG_WARNING, "Cannot add user %s, no port is left to assign", p->pw_name);
+    goto fail;
+  }
+  else if (rc < 0) {
+    syslog(LOG_WARNING, "Cannot allocate memory to index user %s: %s", p->pw_name, strerror(-rc));
+    goto fail;
+  }
+  indexed = 1;
+  if (restored && st.port && st.port != rp->port)
+    syslog(LOG_WARNING, "User %s was assigned port %d but it is taken, assigned port %d instead",
+           rp->username, st.port, rp->port);
+
+  /* A socket bound before the port was known may be for the wrong one */
+  if (rp->fd > -1 && users_fd_port(rp->fd) != rp->port) {
+    close(rp->fd);
+    rp->fd = -1;
+  }
+
+  if (restored) {
+    rp->dont_reacquire = st.dont_reacquire;
+    rp->released = st.released;
+    rp->checked_out = st.released && st.checked_out;
+    if (rp->released)
+      rp->reacquire_time = st.reacquire_time;
+  }
+
+  if (rp->released && rp->fd > -1) {
+    close(rp->fd);
+    rp->fd = -1;
+  }
+  if (!rp->released && rp->fd < 0 && (rp->fd = users_port_bind(rp->port, 0)) < 0)
+    goto fail;
+  rp->seen = sync_pass;
+
+  users_hash_insert(sh, rp);
+  users_schedule_reacquire(rp);
+  users_changed(rp, EVENT_ADDED, STATUS_UNKNOWN);
+  users_extra_update(rp, 1, handed);
+  pthread_mutex_unlock(&sh->lock);
+  /* Adopted users are counted by the caller rather than logged one by one */
+  if (!saved)
+    syslog(LOG_NOTICE, "Added %sport %d for user %s%s", rp->assigned ? "assigned " : "", rp->port,
+           rp->username, rp->released ? ", left released" : "");
+  return 1;
+
+fail:
+  if (indexed)
+    users_index_remove(rp);
+  pthread_mutex_unlock(&sh->lock);
+  if (rp) {
+    if (rp->username)
+      free(rp->username);
+    if (rp->fd > -1)
+      close(rp->fd);
+    free(rp);
+  }
+  if (fd > -1)
+    close(fd);
+  return -1;
+}
+
+
+static int users_add_bound(
+    struct passwd *p,
+    int fd)
+{
+  return users_insert(p, fd, NULL, NULL);
+}
+
+
+static int users_add(
+    struct passwd *p)
+{
+  return users_add_bound(p, -1);
+}
+
+
+/* Adds a user still waiting to be bound ahead of its turn */
+static void users_warm_user(
+    uid_t uid)
+{
+  struct passwd pw;
+  char *name = warm_take(uid);
+
+  if (!name)
+    return;
+
+  memset(&pw, 0, sizeof(pw));
+  pw.pw_name = name;
+  pw.pw_uid = uid;
+  if (users_add(&pw) < 0)
+    passwd_forget(uid);
+  free(name);
+}
+
+
+static int users_known(
+    uid_t uid)
+{
+  struct user_shard *sh = users_shard(uid);
+  int known;
+
+  pthread_mutex_lock(&sh->lock);
+  known = users_search(sh, uid) != NULL;
+  pthread_mutex_unlock(&sh->lock);
+  return known;
+}
+
+
+static void * users_bulk_thread(
+    void *data)
+{
+  struct bulk_bind *b = data;
+  struct timespec start, end;
+  int i;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i=b->start; i < b->end; i++)
+    b->fds[i] = users_port_bind(b->ports[i], 1);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  b->ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+  return NULL;
+}
+
+
+/* Binds n ports of users across a pool of threads, leaving each socket in
+ * fds or -1 where the bind failed. Binding is most of the cost of adding a
+ * user, the rest is done on the calling thread */
+static void users_bulk_bind(
+    const uint16_t *ports,
+    int *fds,
+    int n)
+{
+  struct bulk_bind b[BULK_THREADS_MAX];
+  struct timespec start, end;
+  long ms, slowest = 0;
+  int i, nthreads, started;
+
+  for (i=0; i < n; i++)
+    fds[i] = -1;
+
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads > BULK_THREADS_MAX)
+    nthreads = BULK_THREADS_MAX;
+  if (nthreads > n / BULK_MIN)
+    nthreads = n / BULK_MIN;
+  if (nthreads < 1)
+    nthreads = 1;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (i=0, started=0; i < nthreads; i++) {
+    memset(&b[i], 0, sizeof(b[i]));
+    b[i].ports = ports;
+    b[i].fds = fds;
+    b[i].start = (long)n * i / nthreads;
+    b[i].end = (long)n * (i + 1) / nthreads;
+
+    /* The first slice is bound by this thread once the rest are running */
+    if (i == 0)
+      continue;
+    errno = pthread_create(&b[i].thread, NULL, users_bulk_thread, &b[i]);
+    if (errno) {
+      syslog(LOG_WARNING, "Cannot start bind thread, binding on the main thread: %s", strerror(errno));
+      b[i].thread = 0;
+      users_bulk_thread(&b[i]);
+      continue;
+    }
+    started++;
+  }
+
+  users_bulk_thread(&b[0]);
+  for (i=1; i < nthreads; i++) {
+    if (b[i].thread)
+      pthread_join(b[i].thread, NULL);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  ms = (end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+  for (i=0; i < nthreads; i++) {
+    syslog(LOG_INFO, "Bind thread %d bound %d ports in %ldms", i, b[i].end - b[i].start, b[i].ms);
+    if (b[i].ms > slowest)
+      slowest = b[i].ms;
+  }
+  syslog(LOG_NOTICE, "Bound %d ports on %d threads in %ldms, slowest thread %ldms",
+         n, started + 1, ms, slowest);
+}
+
+
+static int users_delete(
+   uid_t uid)
+{
+  struct reserved_port *rp = NULL;
+  struct user_shard *sh = users_shard(uid);
+
+  users_warm_done(uid);
+  pthread_mutex_lock(&sh->lock);
+  rp = users_search(sh, uid);
+  if (!rp) {
+    pthread_mutex_unlock(&sh->lock);
+    return 0;
+  }
+
+  users_hash_remove(sh, rp);
+  users_index_remove(rp);
+  users_tombstone(rp);
+  state_forget(uid);
+  snapshot_remove(rp);
+  users_notify(rp, rp->port, EVENT_DELETED, users_status(rp), STATUS_UNKNOWN);
+  users_extra_drop(rp);
+  pthread_mutex_unlock(&sh->lock);
+
+  syslog(LOG_NOTICE, "Deleting %s", rp->username);
+  if (rp->released == 0)
+    close(rp->fd);
+  free(rp->username);
+  free(rp);
+  return 1;
+}
+
+
+/* Copy out the uids in a shard not seen by the current sync pass */
+static int users_shard_unseen(
+    struct user_shard *sh,
+    uid_t **uids)
+{
+  struct reserved_port *rp;
+  int i = 0;
+
+  pthread_mutex_lock(&sh->lock);
+  *uids = calloc(sh->ulistnum ? sh->ulistnum : 1, sizeof(**uids));
+  if (!*uids) {
+    pthread_mutex_unlock(&sh->lock);
+    return -1;
+  }
+
+  for (rp = sh->ulist.lh_first; rp != NULL; rp = rp->entries.le_next) {
+    if (rp->seen != sync_pass)
+      (*uids)[i++] = rp->uid;
+  }
+  pthread_mutex_unlock(&sh->lock);
+  return i;
+}
+
+
+
+void users_init(
+    void)
+{
+  int i;
+
+  snapshot_init();
+
+  /* Need not be secret, only unlike that of the process before */
+  if (getrandom(&epoch, sizeof(epoch), GRND_NONBLOCK) != sizeof(epoch))
+    epoch = (uint64_t)time(NULL) << 32 | (uint32_t)getpid();
+  /* 0 is left for clients that have no epoch yet */
+  if (epoch == 0)
+    epoch = 1;
+
+  for (i=0; i < USERS_SHARDS; i++) {
+    pthread_mutex_init(&shards[i].lock, NULL);
+    LIST_INIT(&shards[i].ulist);
+    shards[i].ulistnum = 0;
+    shards[i].nbuckets = USERS_BUCKETS;
+    shards[i].buckets = calloc(USERS_BUCKETS, sizeof(*shards[i].buckets));
+    if (!shards[i].buckets)
+      err(EXIT_FAILURE, "Cannot allocate memory for users");
+  }
+}
+
+
+static void users_book(
+    const struct user_state *st,
+    void *data)
+{
+  int *booked = data;
+
+  if (st->extra || st->port < PRIVPORTS)
+    return;
+  /* Adopted from a predecessor already */
+  if (port_index[st->port] && port_index[st->port]->uid == st->uid)
+    return;
+  if (users_port_used(st->port)) {
+    syslog(LOG_WARNING, "Port %d was assigned to more than one user, uid %d will get another",
+           st->port, st->uid);
+    return;
+  }
+  users_port_mark(st->port, 1);
+  (*booked)++;
+}
+
+
+/* Keeps the ports users were assigned before a restart for them, so that
+ * nobody added first takes them */
+void users_book_ports(
+    void)
+{
+  int booked = 0;
+
+  pthread_mutex_lock(&index_lock);
+  state_walk(users_book, &booked);
+  pthread_mutex_unlock(&index_lock);
+  if (booked)
+    syslog(LOG_INFO, "Kept %d assigned ports for their users", booked);
+}
+
+
+
+static int users_wanted(
+    const char *name,
+    uid_t uid)
+{
+  char **blacklist;
+
+  /* Make sure the blacklist does not match */
+  for (blacklist = (char **)user_blacklist; *blacklist != NULL; blacklist++) {
+    if (strcmp(*blacklist, name) == 0)
+      return 0;
+  }
+
+  /* Dont register users below the system user threshold */
+  if (uid < config.system_user_threshold)
+    return 0;
+  return 1;
+}
+
+
+/* Delete any users the current sync pass did not see. With check set only
+ * those getpwuid no longer knows about go, and they are looked up without the
+ * shard lock held so slow NSS backends dont stall requests */
+static void users_sweep(
+    int check)
+{
+  uid_t *uids;
+  int i, j, n;
+
+  for (i=0; i < USERS_SHARDS; i++) {
+    n = users_shard_unseen(&shards[i], &uids);
+    if (n < 0) {
+      syslog(LOG_WARNING, "Cannot allocate memory to check for deleted users: %s", strerror(errno));
+      continue;
+    }
+
+    for (j=0; j < n; j++) {
+      if (!check || !getpwuid(uids[j]))
+        users_delete(uids[j]);
+    }
+    free(uids);
+  }
+}
+
+
+/* Applies the lines of the passwd file that changed since the last sync. The
+ * first pass has nothing to diff against and reconciles the whole table */
+static int users_sync_files(
+    void)
+{
+  struct passwd_delta d;
+  struct passwd pw;
+  struct user_state st;
+  uid_t *uids = NULL;
+  uint16_t *ports = NULL;
+  int *fds = NULL;
+  int i, j, n = 0, fd, restored;
+
+  if (passwd_diff(&d) < 0)
+    return -1;
+
+  sync_pass++;
+  memset(&pw, 0, sizeof(pw));
+
+  if (warm_collect) {
+    for (i=0; i < d.nset; i++) {
+      if (users_wanted(d.set[i].name, d.set[i].uid))
+        warm_queue(d.set[i].uid, d.set[i].name);
+    }
+    passwd_delta_free(&d);
+    return 0;
+  }
+
+  /* Many new users, after a restart say, have their ports bound in bulk */
+  if (d.nset >= BULK_MIN) {
+    uids = calloc(d.nset, sizeof(*uids));
+    ports = calloc(d.nset, sizeof(*ports));
+    fds = calloc(d.nset, sizeof(*fds));
+    if (uids && ports && fds) {
+      for (i=0; i < d.nset; i++) {
+        if (!users_wanted(d.set[i].name, d.set[i].uid) || users_known(d.set[i].uid))
+          continue;
+        /* Released ports stay unbound */
+        restored = state_lookup(d.set[i].uid, &st);
+        if (restored && st.released)
+          continue;
+        /* Bind the port the user will be given, a user that needs one
+         * assigned is bound once it has it */
+        pthread_mutex_lock(&index_lock);
+        ports[n] = users_port_pick(d.set[i].uid, restored ? st.port : 0);
+        pthread_mutex_unlock(&index_lock);
+        if (ports[n])
+          uids[n++] = d.set[i].uid;
+      }
+      if (n >= BULK_MIN)
+        users_bulk_bind(ports, fds, n);
+      else
+        n = 0;
+    }
+    else {
+      syslog(LOG_WARNING, "Cannot allocate memory to bind ports in bulk: %s", strerror(errno));
+    }
+  }
+
+  /* The set is in uid order and so are the bound sockets */
+  for (i=0, j=0; i < d.nset; i++) {
+    if (!users_wanted(d.set[i].name, d.set[i].uid)) {
+      users_delete(d.set[i].uid);
+      continue;
+    }
+
+    fd = -1;
+    if (j < n && uids[j] == d.set[i].uid)
+      fd = fds[j++];
+
+    pw.pw_name = d.set[i].name;
+    pw.pw_uid = d.set[i].uid;
+    /* Retry on the next sync even if the line does not change */
+    if (users_add_bound(&pw, fd) < 0)
+      passwd_forget(d.set[i].uid);
+  }
+  free(uids);
+  free(ports);
+  free(fds);
+
+  for (i=0; i < d.nremoved; i++)
+    users_delete(d.removed[i]);
+
+  if (d.full)
+    users_sweep(0);
+
+  passwd_delta_free(&d);
+  return 0;
+}
+
+
+/* Only ever called from the housekeeping thread, getpwent is not reentrant */
+void users_sync(
+    void)
+{
+  struct passwd *p = NULL;
+
+  if (passwd_files_only() && users_sync_files() == 0)
+    return;
+
+  /* Some users come from elsewhere, so walk the whole database. The parse is
+   * dropped as it will be stale by the time the files are used again */
+  passwd_reset();
+  sync_pass++;
+
+  /* Add any users we are unaware of, marking those we know as seen */
+  while ((p = getpwent())) {
+    if (!users_wanted(p->pw_name, p->pw_uid))
+      continue;
+    if (warm_collect)
+      warm_queue(p->pw_uid, p->pw_name);
+    else
+      users_add(p);
+  }
+  endpwent();
+
+  if (warm_collect)
+    return;
+
+  /* Delete any users that no longer exist */
+  users_sweep(1);
+}
+
+
+/* Finds the users to add without binding any of their ports yet, those are
+ * bound by users_warm_step while requests are served */
+void users_warm_start(
+    void)
+{
+  int i, j;
+
+  warm_collect = 1;
+  users_sync();
+  warm_collect = 0;
+
+  qsort(warm, nwarm, sizeof(*warm), warm_compare);
+  for (i=0, j=0; i < nwarm; i++) {
+    if (j > 0 && warm[j-1].uid == warm[i].uid) {
+      free(warm[i].name);
+      continue;
+    }
+    warm[j++] = warm[i];
+  }
+  nwarm = j;
+
+  pthread_mutex_lock(&warm_lock);
+  warming = nwarm > 0;
+  pthread_mutex_unlock(&warm_lock);
+  syslog(LOG_NOTICE, "Warming up, %d users to bind", nwarm);
+}
+
+
+/* Binds up to max users in uid order. Returns 1 while users are left */
+int users_warm_step(
+    int max)
+{
+  struct passwd pw;
+  char *name;
+  uid_t uid;
+  int n;
+
+  if (!warming)
+    return 0;
+
+  memset(&pw, 0, sizeof(pw));
+  for (n=0; n < max; n++) {
+    pthread_mutex_lock(&warm_lock);
+    while (warm_next < nwarm && warm[warm_next].done)
+      warm_next++;
+
+    if (warm_next == nwarm) {
+      warming = 0;
+      free(warm);
+      warm = NULL;
+      warm_cap = 0;
+      pthread_mutex_unlock(&warm_lock);
+      syslog(LOG_NOTICE, "Warmed up, %d users bound", warm_bound);
+      return 0;
+    }
+
+    uid = warm[warm_next].uid;
+    name = warm[warm_next].name;
+    warm[warm_next].name = NULL;
+    warm[warm_next].done = 1;
+    warm_bound++;
+    pthread_mutex_unlock(&warm_lock);
+
+    pw.pw_name = name;
+    pw.pw_uid = uid;
+    if (users_add(&pw) < 0)
+      passwd_forget(uid);
+    free(name);
+  }
+
+  return 1;
+}
+
+
+int users_ready(
+    uint32_t *bound,
+    uint32_t *total)
+{
+  int state;
+
+  pthread_mutex_lock(&warm_lock);
+  state = warming ? READY_WARMING : READY_DONE;
+  *bound = warm_bound;
+  *total = nwarm;
+  pthread_mutex_unlock(&warm_lock);
+  return state;
+}
+
+
+/* Forget what the passwd file looked like, the next sync goes over all of it */
+void users_resync(
+    void)
+{
+  passwd_reset();
+  users_sync();
+}
+
+
+/* Every user lets go of the ports it lost before any claims those it gained */
+void users_ports_reload(
+    void)
+{
+  struct reserved_port *rp;
+  int pass, s;
+
+  for (pass=0; pass < 2; pass++) {
+    for (s=0; s < USERS_SHARDS; s++) {
+      pthread_mutex_lock(&shards[s].lock);
+      for (rp = shards[s].ulist.lh_first; rp != NULL; rp = rp->entries.le_next)
+        users_extra_update(rp, pass, NULL);
+      pthread_mutex_unlock(&shards[s].lock);
+    }
+  }
+}
+
+static void users_reacquire_port(void *data);
+
+/* Binds the released extra ports of an entry that are due, trying those it
+ * cannot again later. The shard must be locked */
+static void users_extra_reacquire(
+    struct reserved_port *rp,
+    time_t now)
+{
+  struct port_set *ps = rp->extra;
+  uint16_t ports[PORTS_USER_MAX];
+  int i, n;
+
+  if (!ps)
+    return;
+
+  n = ports_set_ports(ps, ports);
+  for (i=0; i < n; i++) {
+    if (ps->fds[i] > -1 || ps->reacquire[i] > now)
+      continue;
+    ps->fds[i] = users_port_bind(ports[i], 1);
+    if (ps->fds[i] < 0) {
+      ps->reacquire[i] = now + DEFAULT_REACQUIRE_TIMEOUT;
+      continue;
+    }
+    syslog(LOG_NOTICE, "Re-acquired port %d for user %s", ports[i], rp->username);
+    ps->reacquire[i] = 0;
+    users_extra_changed(rp, i, ports[i], EVENT_REACQUIRED, STATUS_RELEASED);
+  }
+}
+
+/* Make sure a timer will fire by the reacquire time of a released port. At
+ * most one timer is pending per user, the shard must be locked */
+static void users_schedule_reacquire(
+    struct reserved_port *rp)
+{
+  time_t now = time(NULL);
+  time_t when = 0, extra_when = 0;
+  int due = 0;
+
+  /* Binding under a user who checked the socket out would leave two holding
+   * the port, the owner hands it back instead */
+  if (rp->released && !rp->checked_out) {
+    when = rp->reacquire_time;
+    due = 1;
+  }
+  if (users_extra_due(rp->extra, &extra_when) && (!due || extra_when < when)) {
+    when = extra_when;
+    due = 1;
+  }
+  if (!due || rp->dont_reacquire)
+    return;
+  if (when < now)
+    when = now;
+
+  /* The pending timer fires first and will reschedule for the remainder */
+  if (rp->reacquire_sched && rp->reacquire_sched <= when)
+    return;
+
+  if (event_timer_add((when - now) * 1000, users_reacquire_port,
+                      (void *)(uintptr_t)rp->uid) == 0)
+    return;
+  rp->reacquire_sched = when;
+}
+
+
+/* Timer callback, runs when a released port reaches its reacquire time */
+static void users_reacquire_port(
+    void *data)
+{
+  uid_t uid = (uid_t)(uintptr_t)data;
+  struct user_shard *sh = users_shard(uid);
+  struct reserved_port *rp;
+  time_t now = time(NULL);
+  int tmp;
+
+  pthread_mutex_lock(&sh->lock);
+  /* The user may have been deleted since */
+  rp = users_search(sh, uid);
+  if (!rp)
+    goto out;
+
+  rp->reacquire_sched = 0;
+  if (rp->dont_reacquire)
+    goto out;
+
+  if (rp->released && !rp->checked_out && rp->reacquire_time <= now) {
+    tmp = users_port_bind(rp->port, 1);
+    if (tmp < 0) {
+      rp->reacquire_time = now + DEFAULT_REACQUIRE_TIMEOUT;
+    }
+    else {
+      syslog(LOG_NOTICE, "Re-acquired port %d for user %s", rp->port, rp->username);
+      rp->fd = tmp;
+      rp->reacquire_time = 0;
+      rp->released = 0;
+      users_changed(rp, EVENT_REACQUIRED, STATUS_RELEASED);
+    }
+  }
+  users_extra_reacquire(rp, now);
+
+  users_schedule_reacquire(rp);
+
+out:
+  pthread_mutex_unlock(&sh->lock);
+}
+
+
+/* Operations on an extra port of an entry, the shard must be locked */
+static int users_extra_request(
+    struct reserved_port *rp,
+    uint16_t port)
+{
+  int i = rp->extra ? ports_set_find(rp->extra, port) : -1;
+
+  if (i < 0)
+    return -EINVAL;
+  if (rp->extra->fds[i] > -1)
+    return -EADDRINUSE;
+
+  rp->extra->fds[i] = users_port_bind(port, 0);
+  if (rp->extra->fds[i] < 0)
+    return -errno;
+  rp->extra->reacquire[i] = 0;
+  users_extra_changed(rp, i, port, EVENT_RESERVED, STATUS_RELEASED);
+  return 0;
+}
+
+static int users_extra_release(
+    struct reserved_port *rp,
+    uint16_t port)
+{
+  int i = rp->extra ? ports_set_find(rp->extra, port) : -1;
+
+  if (i < 0)
+    return -EINVAL;
+  if (rp->extra->fds[i] < 0)
+    return -ENOTCONN;
+
+  close(rp->extra->fds[i]);
+  rp->extra->fds[i] = -1;
+  rp->extra->reacquire[i] = time(NULL) + DEFAULT_REACQUIRE_TIMEOUT;
+  users_schedule_reacquire(rp);
+  users_extra_changed(rp, i, port, EVENT_RELEASED, STATUS_RESERVED);
+  return 0;
+}
+
+
+/* Operations on a single entry, the shard must be locked */
+static int users_rp_request(
+    struct reserved_port *rp,
+    uint16_t port)
+{
+  uint8_t old = users_status(rp);
+
+  if (port == 0)
+    port= rp->port;
+  else if (rp->port != port)
+    return users_extra_request(rp, port);
+
+  if (!rp->released)
+    return -EADDRINUSE;
+
+  rp->fd = users_port_bind(port, 0);
+  if (rp->fd < 0)
+    return -errno;
+  rp->released = 0;
+  rp->checked_out = 0;
+  rp->reacquire_time = 0;
+  users_changed(rp, EVENT_RESERVED, old);
+  return 0;
+}
+
+static int users_rp_release(
+    struct reserved_port *rp,
+    uint16_t port)
+{
+  if (port == 0)
+    port= rp->port;
+  else if (rp->port != port)
+    return users_extra_release(rp, port);
+
+  if (rp->released)
+    return -ENOTCONN;
+
+  close(rp->fd);
+  rp->fd = -1;
+  rp->released = 1;
+  rp->reacquire_time = time(NULL) + DEFAULT_REACQUIRE_TIMEOUT;
+  users_schedule_reacquire(rp);
+  users_changed(rp, EVENT_RELEASED, STATUS_RESERVED);
+  return 0;
+}
+
+/* Whether an entry holds one of its ports, -1 if the port is not the users.
+ * The shard must be locked */
+static int users_rp_holds(
+    struct reserved_port *rp,
+    uint16_t port)
+{
+  int i;
+
+  if (port == rp->port)
+    return !rp->released;
+  i = rp->extra ? ports_set_find(rp->extra, port) : -1;
+  if (i < 0)
+    return -1;
+  return rp->extra->fds[i] > -1;
+}
+
+/* Reserves or releases every port from port to last. Ports of the range that
+ * are already as asked are left alone, the first other failure is returned */
+static int users_rp_range(
+    struct reserved_port *rp,
+    uint16_t port,
+    uint16_t last,
+    int release)
+{
+  uint32_t p;
+  int held, rc = 0, err;
+
+  if (last == 0 || last == port)
+    return release ? users_rp_release(rp, port) : users_rp_request(rp, port);
+  if (port == 0 || last < port)
+    return -EINVAL;
+
+  /* Nothing is done unless the whole range is the users */
+  for (p = port; p <= last; p++) {
+    if (users_rp_holds(rp, p) < 0)
+      return -EINVAL;
+  }
+
+  for (p = port; p <= last; p++) {
+    held = users_rp_holds(rp, p);
+    if (held == !release)
+      continue;
+    err = release ? users_rp_release(rp, p) : users_rp_request(rp, p);
+    if (err < 0 && rc == 0)
+      rc = err;
+  }
+  return rc;
+}
+
+static int users_rp_policy(
+    struct reserved_port *rp,
+    uint8_t dont_reacquire)
+{
+  rp->dont_reacquire = dont_reacquire;
+  users_schedule_reacquire(rp);
+  users_changed(rp, EVENT_POLICY, users_status(rp));
+  return 0;
+}
+
+static int users_rp_checkout(
+    struct reserved_port *rp,
+    uint16_t port,
+    int *fd)
+{
+  if (port != 0 && rp->port != port)
+    return -EINVAL;
+
+  if (rp->released)
+    return -ENOTCONN;
+
+  *fd = rp->fd;
+  rp->fd = -1;
+  rp->released = 1;
+  rp->checked_out = 1;
+  /* Should checked_out be lost, by a predecessor that did not hand it
+   * over say, the port is only due back like any other released one */
+  rp->reacquire_time = time(NULL) + DEFAULT_REACQUIRE_TIMEOUT;
+  users_changed(rp, EVENT_CHECKOUT, STATUS_RESERVED);
+  return 0;
+}
+
+static int users_rp_return(
+    struct reserved_port *rp,
+    uint16_t port,
+    int fd)
+{
+  uint8_t old = users_status(rp);
+  int rc;
+
+  if (port != 0 && rp->port != port)
+    return -EINVAL;
+
+  if (!rp->released)
+    return -EADDRINUSE;
+
+  rc = users_port_check(fd, rp->port);
+  if (rc < 0)
+    return rc;
+
+  rp->fd = fd;
+  rp->released = 0;
+  rp->checked_out = 0;
+  rp->reacquire_time = 0;
+  users_changed(rp, EVENT_RETURN, old);
+  return 0;
+}
+
+
+int users_port_request(
+     uid_t uid,
+     uint16_t port,
+     uint16_t last)
+{
+  struct reserved_port *rp;
+  struct user_shard *sh = users_shard(uid);
+  int rc = -ENOENT;
+
+  users_warm_user(uid);
+  pthread_mutex_lock(&sh->lock);
+  rp = users_search(sh, uid);
+  if (rp)
+    rc = users_rp_range(rp, port, last, 0);
+  pthread_mutex_unlock(&sh->lock);
+  return rc;
+}
+
+int users_port_release(
+    uid_t uid,
+    uint16_t port,
+    uint16_t last)
+{
+  struct reserved_port *rp;
+  struct user_shard *sh = users_shard(uid);
+  int rc = -ENOENT;
+
+  users_warm_user(uid);
+  pthread_mutex_lock(&sh->lock);
+  rp = users_search(sh, uid);
+  if (rp)
+    rc = users_rp_range(rp, port, last, 1);
+  pthread_mutex_unlock(&sh->lock);
+  return rc;
+}
+
+int users_port_acquire_policy(
+    uid_t uid,
+    uint8_t dont_reacquire)
+{
+  struct reserved_port *rp;
+  struct user_shard *sh = users_shard(uid);
+  int rc = -ENOENT;
+
+  users_warm_user(uid);
+  pthread_mutex_lock(&sh->lock);
+  rp = users_search(sh, uid);
+  if (rp)
+    rc = users_rp_policy(rp, dont_reacquire);
+  pthread_mutex_unlock(&sh->lock);
+  return rc;
+}
+
+int users_port_checkout(
+    uid_t uid,
+    uint16_t port,
+    int *fd)
+{
+  struct reserved_port *rp;
+  struct user_shard *sh = users_shard(uid);
+  int rc = -ENOENT;
+
+  users_warm_user(uid);
+  pthread_mutex_lock(&sh->lock);
+  rp = users_search(sh, uid);
+  if (rp)
+    rc = users_rp_checkout(rp, port, fd);
+  pthread_mutex_unlock(&sh->lock);
+  return rc;
+}
+
+int users_port_return(
+    uid_t uid,
+    uint16_t port,
+    int fd)
+{
+  struct reserved_port *rp;
+  struct user_shard *sh = users_shard(uid);
+  int rc = -ENOENT;
+
+  users_warm_user(uid);
+  pthread_mutex_lock(&sh->lock);
+  rp = users_search(sh, uid);
+  if (rp)
+    rc = users_rp_return(rp, port, fd);
+  pthread_mutex_unlock(&sh->lock);
+  if (rc < 0)
+    close(fd);
+  return rc;
+}
+
+
+/* Batch entries are visited by shard then uid, keeping the order of
+ * operations for the same user */
+struct batch_order {
+  int shard;
+  uid_t uid;
+  int idx;
+};
+
+static int batch_compare(
+    const void *a,
+    const void *b)
+{
+  const struct batch_order *oa = a, *ob = b;
+
+  if (oa->shard != ob->shard)
+    return oa->shard < ob->shard ? -1 : 1;
+  if (oa->uid != ob->uid)
+    return oa->uid < ob->uid ? -1 : 1;
+  return oa->idx - ob->idx;
+}
+
+
+static int users_batch_apply(
+    struct reserved_port *rp,
+    struct port_batch_entry *e)
+{
+  switch (e->op) {
+    case PORT_RESERVE:
+      return users_rp_request(rp, e->port);
+    case PORT_RELEASE:
+      return users_rp_release(rp, e->port);
+    case PORT_RQPOLICY:
+      return users_rp_policy(rp, e->dont_reacquire);
+  }
+  return -EINVAL;
+}
+
+
+/* Applies a batch of operations visiting each shard once, errors[i] gets
+ * the result of entries[i]. Entries the caller already rejected by setting
+ * a non-zero error are left alone */
+int users_port_batch(
+    struct port_batch_entry *entries,
+    int num,
+    int *errors)
+{
+  struct reserved_port *rp = NULL;
+  struct user_shard *sh;
+  struct batch_order *order;
+  int i, j, k, last;
+
+  order = calloc(num ? num : 1, sizeof(*order));
+  if (!order)
+    return -ENOMEM;
+
+  for (i=0, k=0; i < num; i++) {
+    if (errors[i])
+      continue;
+    users_warm_user(entries[i].uid);
+    order[k].shard = entries[i].uid % USERS_SHARDS;
+    order[k].uid = entries[i].uid;
+    order[k].idx = i;
+    errors[i] = -ENOENT;
+    k++;
+  }
+  num = k;
+  qsort(order, num, sizeof(*order), batch_compare);
+
+  for (i=0; i < num; i = last) {
+    sh = &shards[order[i].shard];
+    for (last = i; last < num && order[last].shard == order[i].shard; last++);
+
+    /* One lock of the shard, entries of a user stay in order */
+    pthread_mutex_lock(&sh->lock);
+    for (j = i; j < last; j++) {
+      if (j == i || order[j].uid != order[j-1].uid)
+        rp = users_search(sh, order[j].uid);
+      if (rp)
+        errors[order[j].idx] = users_batch_apply(rp, &entries[order[j].idx]);
+    }
+    pthread_mutex_unlock(&sh->lock);
+  }
+
+  free(order);
+  return 0;
+}
+
+/* Whether a port of an entry passes a query. Status and policy are only
+ * matched for entries the caller may see, so filtering cannot reveal them */
+static int users_query_match(
+    uid_t uid,
+    const struct port_query *q,
+    struct reserved_port *rp,
+    uint16_t port,
+    uint8_t status)
+{
+  int visible = uid == rp->uid || uid == 0;
+
+  if ((q->flags & QUERY_PORT) && (port < q->port_min || port > q->port_max))
+    return 0;
+  if ((q->flags & QUERY_STATUS) && (!visible || status != q->status))
+    return 0;
+  if ((q->flags & QUERY_REACQUIRE) && (!visible || rp->dont_reacquire != q->dont_reacquire))
+    return 0;
+  if ((q->flags & QUERY_ASSIGNED) && (!rp->assigned || port != rp->port))
+    return 0;
+  return 1;
+}
+
+
+/* Fills in an entry for each port of a user passing a query, its own port
+ * first. Returns how many there are */
+static int users_query_ports(
+    uid_t uid,
+    const struct port_query *q,
+    struct reserved_port *rp,
+    struct portinfo *pi)
+{
+  uint16_t ports[PORTS_USER_MAX + 1];
+  uint8_t status[PORTS_USER_MAX + 1];
+  int i, n, m = 0;
+
+  ports[0] = rp->port;
+  status[0] = users_status(rp);
+  n = 1;
+  if (rp->extra) {
+    n += ports_set_ports(rp->extra, ports + 1);
+    for (i=1; i < n; i++)
+      status[i] = rp->extra->fds[i-1] > -1 ? STATUS_RESERVED : STATUS_RELEASED;
+  }
+
+  for (i=0; i < n; i++) {
+    if (!users_query_match(uid, q, rp, ports[i], status[i]))
+      continue;
+    pi[m].uid = rp->uid;
+    pi[m].port = ports[i];
+    /* Dont share reserve status with unauthorized users */
+    if (uid == rp->uid || uid == 0) {
+      pi[m].status = status[i];
+      pi[m].dont_reacquire = rp->dont_reacquire;
+    }
+    else {
+      pi[m].status = STATUS_UNKNOWN;
+      pi[m].dont_reacquire = REACQUIRE_UNKNOWN;
+    }
+    m++;
+  }
+  return m;
+}
+
+
+/* Lists the entries matching a query in uid order. next is set to the
+ * cursor to carry on from when the limit cut the list short, otherwise 0 */
+int users_port_query(
+    uid_t uid,
+    const struct port_query *q,
+    struct portinfo **info,
+    uint32_t *len,
+    uid_t *next)
+{
+  struct portinfo *pi = NULL;
+  struct reserved_port *rp;
+  uid_t lo = 0, hi = (uid_t)-1;
+  uid_t offset = config.port_offset;
+  uint32_t n = 0, m, max, cap;
+  int i, s;
+
+  *next = 0;
+
+  if (q->flags & QUERY_UID) {
+    lo = q->uid_min;
+    hi = q->uid_max;
+    /* Asking after one user brings it forward */
+    if (lo == hi)
+      users_warm_user(lo);
+  }
+
+  /* Sort before stopping every shard, only additions made in between are
+   * left to sort with them held */
+  pthread_mutex_lock(&index_lock);
+  users_index_sort();
+  pthread_mutex_unlock(&index_lock);
+
+  /* Hold every shard so the list is a consistent snapshot */
+  for (s=0; s < USERS_SHARDS; s++)
+    pthread_mutex_lock(&shards[s].lock);
+  pthread_mutex_lock(&index_lock);
+
+  /* Unless someone holds extra or assigned ports, ports follow uids, so a
+   * port range narrows the uids to walk */
+  if ((q->flags & QUERY_PORT) && extra_ports == 0 && assigned_ports == 0) {
+    if (q->port_max < offset) {
+      lo = 1;
+      hi = 0;
+    }
+    else {
+      if (q->port_min > offset && q->port_min - offset > lo)
+        lo = q->port_min - offset;
+      if (q->port_max - offset < hi)
+        hi = q->port_max - offset;
+    }
+  }
+  if (q->cursor > lo)
+    lo = q->cursor;
+
+  users_index_sort();
+  i = users_index_find(lo);
+  cap = uid_index_len - i + extra_ports;
+  max = cap;
+  if (q->limit && q->limit < max)
+    max = q->limit;
+
+  pi = calloc(cap ? cap : 1, sizeof(*pi));
+  if (!pi)
+    goto out;
+
+  for (; i < uid_index_len && lo <= hi; i++) {
+    rp = uid_index[i];
+    if (rp->uid > hi)
+      break;
+    m = users_query_ports(uid, q, rp, pi + n);
+    if (m == 0)
+      continue;
+    /* The ports of a user are never split between pages */
+    if (n > 0 && n + m > max) {
+      *next = rp->uid;
+      break;
+    }
+    n += m;
+  }
+
+out:
+  pthread_mutex_unlock(&index_lock);
+  for (s=USERS_SHARDS-1; s >= 0; s--)
+    pthread_mutex_unlock(&shards[s].lock);
+
+  if (!pi)
+    return -ENOMEM;
+  *info = pi;
+  *len = n;
+  return 0;
+}
+
+
+int users_port_list(
+    uid_t uid,
+    struct portinfo **info,
+    uint32_t *len)
+{
+  struct port_query q;
+  uid_t next;
+
+  memset(&q, 0, sizeof(q));
+  return users_port_query(uid, &q, info, len, &next);
+}
+
+/* Lists what changed after a generation, oldest first. An entry that
+ * changed is listed with each of its ports, all of the same generation. If
+ * tombstones that old are gone, or the generation is not one of ours, the
+ * whole table is listed instead and full is set. since_epoch is 0 when not
+ * known */
+int users_port_changes(
+    uint64_t since,
+    uint64_t since_epoch,
+    struct port_change **changes,
+    uint32_t *len,
+    uint64_t *gen,
+    uint64_t *gen_epoch,
+    int *full)
+{
+  struct port_change *ch = NULL;
+  struct reserved_port *rp, *rpstart = NULL;
+  struct tombstone *t, *tstart = NULL;
+  uint16_t ports[PORTS_USER_MAX];
+  uint32_t n = 0, total = 0;
+  int s, i, nextra;
+
+  for (s=0; s < USERS_SHARDS; s++)
+    pthread_mutex_lock(&shards[s].lock);
+
+  *full = since == 0 || since < tombstone_floor || since > generation
+          || (since_epoch && since_epoch != epoch);
+  if (*full)
+    since = 0;
+
+  /* Find where the changes start, counting them on the way */
+  TAILQ_FOREACH_REVERSE(rp, &changed, changelist, changes) {
+    if (rp->generation <= since)
+      break;
+    rpstart = rp;
+    total += 1 + (rp->extra ? rp->extra->nports : 0);
+  }
+  if (!*full) {
+    TAILQ_FOREACH_REVERSE(t, &tombstones, tomblist, changes) {
+      if (t->generation <= since)
+        break;
+      tstart = t;
+      total++;
+    }
+  }
+
+  ch = calloc(total ? total : 1, sizeof(*ch));
+  if (!ch)
+    goto out;
+
+  /* Merge the two in order of generation */
+  rp = rpstart;
+  t = tstart;
+  while (rp || t) {
+    if (rp && (!t || rp->generation < t->generation)) {
+      ch[n].pi.uid = rp->uid;
+      ch[n].pi.port = rp->port;
+      ch[n].pi.status = users_status(rp);
+      ch[n].pi.dont_reacquire = rp->dont_reacquire;
+      ch[n].generation = rp->generation;
+      nextra = rp->extra ? ports_set_ports(rp->extra, ports) : 0;
+      for (i=0; i < nextra; i++) {
+        n++;
+        ch[n].pi.uid = rp->uid;
+        ch[n].pi.port = ports[i];
+        ch[n].pi.status = rp->extra->fds[i] > -1 ? STATUS_RESERVED : STATUS_RELEASED;
+        ch[n].pi.dont_reacquire = rp->dont_reacquire;
+        ch[n].generation = rp->generation;
+      }
+      rp = TAILQ_NEXT(rp, changes);
+    }
+    else {
+      ch[n].pi.uid = t->uid;
+      ch[n].pi.port = t->port;
+      ch[n].pi.status = STATUS_UNKNOWN;
+      ch[n].pi.dont_reacquire = REACQUIRE_UNKNOWN;
+      ch[n].flags = CHANGE_DELETED;
+      ch[n].generation = t->generation;
+      t = TAILQ_NEXT(t, changes);
+    }
+    n++;
+  }
+  *gen = generation;
+  *gen_epoch = epoch;
+
+out:
+  for (s=USERS_SHARDS-1; s >= 0; s--)
+    pthread_mutex_unlock(&shards[s].lock);
+
+  if (!ch)
+    return -ENOMEM;
+  *changes = ch;
+  *len = n;
+  return 0;
+}
+
+
+/* Descriptors of the shared table for a client, see PORT_SNAPSHOT */
+int users_snapshot_fds(
+    uid_t uid,
+    int fds[2])
+{
+  struct user_shard *sh = users_shard(uid);
+  int rc;
+
+  users_warm_user(uid);
+  pthread_mutex_lock(&sh->lock);
+  rc = snapshot_fds(uid, users_search(sh, uid), fds);
+  pthread_mutex_unlock(&sh->lock);
+  return rc;
+}
+
+
+void users_get_bind_stats(
+    struct bind_stats *st)
+{
+  pthread_mutex_lock(&bind_lock);
+  *st = bind_stats;
+  pthread_mutex_unlock(&bind_lock);
+}
+
+
+/* Calls cb for every user with the whole table locked. It stays locked when
+ * this returns, so nothing changes until users_export_end, or the process
+ * exits having handed the users over */
+int users_export_begin(
+    int (*cb)(const struct user_export *ue, void *data),
+    void *data)
+{
+  struct reserved_port *rp;
+  struct user_export ue;
+  int s, rc;
+
+  for (s=0; s < USERS_SHARDS; s++)
+    pthread_mutex_lock(&shards[s].lock);
+  /* The successor takes the saved state over along with the users */
+  state_suspend();
+
+  for (s=0; s < USERS_SHARDS; s++) {
+    for (rp = shards[s].ulist.lh_first; rp != NULL; rp = rp->entries.le_next) {
+      ue.uid = rp->uid;
+      ue.port = rp->port;
+      ue.name = rp->username;
+      ue.fd = rp->released ? -1 : rp->fd;
+      ue.state.uid = rp->uid;
+      ue.state.released = rp->released;
+      ue.state.checked_out = rp->checked_out;
+      ue.state.dont_reacquire = rp->dont_reacquire;
+      ue.state.reacquire_time = rp->reacquire_time;
+      ue.state.port = rp->assigned ? rp->port : 0;
+      ue.state.extra = 0;
+      ue.extra = rp->extra;
+      if ((rc = cb(&ue, data)) < 0)
+        return rc;
+    }
+  }
+  return 0;
+}
+
+
+void users_export_end(
+    void)
+{
+  int s;
+
+  state_resume();
+  for (s=USERS_SHARDS-1; s >= 0; s--)
+    pthread_mutex_unlock(&shards[s].lock);
+}
+
+
+/* Takes over a user from a predecessor along with its bound socket */
+int users_adopt(
+    const struct user_export *ue)
+{
+  struct passwd pw;
+
+  /* Should the port offset have changed with the upgrade, the socket is
+   * for the wrong port and users_insert binds the new one instead */
+  memset(&pw, 0, sizeof(pw));
+  pw.pw_name = (char *)ue->name;
+  pw.pw_uid = ue->uid;
+  return users_insert(&pw, ue->fd, &ue->state, ue->extra);
 }
@@ -5,25 +5,103 @@
 #include <sys/queue.h>
 
 #include "protocol.h"
+#include "state.h"
+#include "ports.h"
 
 LIST_HEAD(userlist, reserved_port);
+TAILQ_HEAD(changelist, reserved_port);
 
 struct reserved_port {
   char *username;
   uid_t uid;
   int fd;
   int released;
+  /* Released by handing the bound socket to the user, see PORT_CHECKOUT */
+  char checked_out;
   time_t reacquire_time;
+  /* When the pending reacquire timer fires, 0 if none is pending */
+  time_t reacquire_sched;
   uint16_t port;
+  /* The port was assigned, it does not follow the uid */
+  char assigned;
   char dont_reacquire;
+  /* Ports held beyond port, NULL if none. They share the re-acquire policy
+   * but are left out of the snapshot, the change log and the saved state */
+  struct port_set *extra;
+  /* Slot in the shared table snapshot, -1 if none */
+  int snapslot;
+  /* Position in the uid index */
+  int uidslot;
+  /* Next entry in the same hash bucket of the shard */
+  struct reserved_port *hnext;
+  /* Sync pass that last found the user in passwd */
+  unsigned int seen;
+  /* Generation of the last change, entries are kept in this order */
+  uint64_t generation;
+  TAILQ_ENTRY(reserved_port) changes;
   LIST_ENTRY(reserved_port) entries;
 };
 
+/* Time spent binding reserved ports */
+struct bind_stats {
+  unsigned long binds;
+  unsigned long failures;
+  uint64_t total_ns;
+  uint64_t max_ns;
+};
+
+/* A user as handed from one daemon to its successor */
+struct user_export {
+  uid_t uid;
+  uint16_t port;
+  const char *name;
+  /* The bound socket, -1 if released */
+  int fd;
+  struct user_state state;
+  /* Extra ports with their sockets, NULL if none. Adopting takes the
+   * sockets it uses and leaves -1 in their place */
+  struct port_set *extra;
+};
+
+/* The status of an entry as clients see it */
+static inline uint8_t users_status(
+    const struct reserved_port *rp)
+{
+  if (rp->checked_out)
+    return STATUS_CHECKED_OUT;
+  return rp->released ? STATUS_RELEASED : STATUS_RESERVED;
+}
+
 void users_init(void);
+/* Called once saved state is read, before any user is added */
+void users_book_ports(void);
 void users_sync(void);
-void users_reacquire_ports(void);
-int users_port_request(uid_t uid, uint16_t port);
-int users_port_release(uid_t uid, uint16_t port);
+void users_resync(void);
+/* Applies the ports file after it was read again */
+void users_ports_reload(void);
+void users_warm_start(void);
+int users_warm_step(int max);
+/* Returns READY_WARMING or READY_DONE, with how many users are bound of those
+ * found at startup */
+int users_ready(uint32_t *bound, uint32_t *total);
+/* Port 0 is the users own port. A non-zero last asks for every port from
+ * port to last, each of which must belong to the user */
+int users_port_request(uid_t uid, uint16_t port, uint16_t last);
+int users_port_release(uid_t uid, uint16_t port, uint16_t last);
 int users_port_acquire_policy(uid_t uid, uint8_t dont_reacquire);
-int users_port_list(uid_t uid, struct portinfo **info, uint16_t *len);
+int users_port_batch(struct port_batch_entry *entries, int num, int *errors);
+int users_port_list(uid_t uid, struct portinfo **info, uint32_t *len);
+int users_port_query(uid_t uid, const struct port_query *q, struct portinfo **info, uint32_t *len, uid_t *next);
+int users_port_changes(uint64_t since, uint64_t since_epoch, struct port_change **changes, uint32_t *len, uint64_t *generation, uint64_t *epoch, int *full);
+int users_snapshot_fds(uid_t uid, int fds[2]);
+/* Hands over the bound socket of a reserved port in *fd */
+int users_port_checkout(uid_t uid, uint16_t port, int *fd);
+/* Takes a socket holding the port back, fd is closed if it is refused */
+int users_port_return(uid_t uid, uint16_t port, int fd);
+void users_get_bind_stats(struct bind_stats *st);
+/* Holds every user and the saved state for a successor. users_export_end
+ * gives them back, only if the handover failed */
+int users_export_begin(int (*cb)(const struct user_export *ue, void *data), void *data);
+void users_export_end(void);
+int users_adopt(const struct user_export *ue);
 #endif
@@ -0,0 +1,140 @@
+/* Request worker threads. Each worker owns its own event handle and is fed
+ * accepted client descriptors by the acceptor over a pipe */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+#include <fcntl.h>
+#include <syslog.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+
+#include "event.h"
+#include "protocol.h"
+#include "workers.h"
+
+struct worker {
+  pthread_t thread;
+  int id;
+  int pipe[2];
+};
+
+static struct worker *workers = NULL;
+static int numworkers = 0;
+static int nextworker = 0;
+
+
+/* Picks up client descriptors passed to us by the acceptor */
+static int worker_handoff_read(
+    int fd,
+    int event,
+    void *data)
+{
+  int clifds[64];
+  int rc, i;
+
+  if ((event & EPOLLERR) == EPOLLERR || (event & EPOLLHUP) == EPOLLHUP)
+     return -1;
+
+  rc = read(fd, clifds, sizeof(clifds));
+  if (rc < 0) {
+    if (errno == EINTR || errno == EAGAIN)
+      return 0;
+    return -1;
+  }
+
+  /* Writes of a single int to a pipe are atomic, we never see a partial fd */
+  for (i=0; i < rc / (int)sizeof(int); i++) {
+    if (protocol_client_add(clifds[i]) < 0)
+      close(clifds[i]);
+  }
+
+  return 0;
+}
+
+
+static void * worker_run(
+    void *data)
+{
+  struct worker *w = data;
+
+  event_init();
+  if (event_add_fd(w->pipe[0], worker_handoff_read, NULL, NULL, EPOLLIN) < 0)
+    err(EXIT_FAILURE, "Cannot add handoff event for worker %d", w->id);
+
+  while(1) {
+    event_loop(128, -1);
+  }
+
+  return NULL;
+}
+
+
+/* Starts the worker threads, zero workers serves requests inline */
+void workers_init(
+    int num)
+{
+  int i;
+
+  if (num <= 0)
+    return;
+
+  workers = calloc(num, sizeof(*workers));
+  if (!workers)
+    err(EXIT_FAILURE, "Cannot allocate workers");
+
+  for (i=0; i < num; i++) {
+    workers[i].id = i;
+    /* A stalled worker must not hold up the acceptor */
+    if (pipe2(workers[i].pipe, O_CLOEXEC|O_NONBLOCK) < 0)
+      err(EXIT_FAILURE, "Cannot create handoff pipe for worker %d", i);
+    errno = pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+    if (errno)
+      err(EXIT_FAILURE, "Cannot start worker %d", i);
+  }
+
+  numworkers = num;
+  syslog(LOG_NOTICE, "Started %d request workers", num);
+}
+
+
+int workers_enabled(
+    void)
+{
+  return numworkers > 0;
+}
+
+
+/* Hands a client to the next worker, skipping any whose pipe is full. Fails
+ * if every worker is backed up, the caller then closes the client */
+int workers_dispatch(
+    int fd)
+{
+  struct worker *w;
+  int rc, tries;
+
+  for (tries=0; tries < numworkers; tries++) {
+    w = &workers[nextworker];
+    nextworker = (nextworker + 1) % numworkers;
+
+    do {
+      rc = write(w->pipe[1], &fd, sizeof(fd));
+    } while (rc < 0 && errno == EINTR);
+
+    if (rc == sizeof(fd))
+      return 0;
+    if (rc < 0 && errno == EAGAIN)
+      continue;
+    syslog(LOG_WARNING, "Cannot hand client to worker %d: %s", w->id, strerror(errno));
+    return -1;
+  }
+
+  syslog(LOG_WARNING, "Cannot hand client to a worker, every one is backed up");
+  return -1;
+}
@@ -0,0 +1,10 @@
+#ifndef _WORKERS_H_
+#define _WORKERS_H_
+
+#define WORKERS_MAX 64
+
+void workers_init(int num);
+int workers_enabled(void);
+/* Hands an accepted client to a worker, returns -1 on failure */
+int workers_dispatch(int fd);
+#endif